@@ -0,0 +1,476 @@
+#!/bin/sh
+"""": # -*-python-*-
+bup_python="$(dirname "$0")/bup-python" || exit $?
+exec "$bup_python" "$0" ${1+"$@"}
+"""
+# end of bup preamble
+
+from __future__ import absolute_import, division, print_function
+from io import BytesIO
+import glob, json, os, platform, random, shutil, subprocess, sys, tempfile
+import time, zlib
+
+from bup import bloom, git, hashsplit, index, options, path, version, _helpers
+from bup.compat import environ, range
+from bup.helpers import handle_ctrl_c, mkdirp, parse_num, qprogress
+from bup.io import byte_stream
+
+
+optspec = """
+bup bench [options...] [benchmark...]
+--
+S,seed=    random number seed for the generated workloads [1]
+r,repeat=  number of timed runs of each benchmark [10]
+size=      amount of data for the data benchmarks [4M]
+n,number=  number of object ids for the object benchmarks [100000]
+files=     number of files in the synthetic tree [200]
+j,json     write the results as JSON
+l,list     list the available benchmarks and exit
+"""
+
+
+handle_ctrl_c()
+
+
+class Workload:
+    """The seeded data shared by the benchmarks, generated on demand
+    in (and below) tmpdir."""
+    def __init__(self, tmpdir, seed, size, number, files):
+        self.tmpdir = tmpdir
+        self.seed = seed
+        self.size = size
+        self.number = number
+        self.files = files
+        self._cache = {}
+
+    def _cached(self, name, make):
+        if name not in self._cache:
+            self._cache[name] = make()
+        return self._cache[name]
+
+    def random_bytes(self, n, seed):
+        # write_random() reports its progress once it writes a MiB, so
+        # stay just under that.
+        name = os.path.join(self.tmpdir, b'random')
+        with open(name, 'w+b') as f:
+            for i, ofs in enumerate(range(0, n, 1023 * 1024)):
+                _helpers.write_random(f.fileno(), min(1023 * 1024, n - ofs),
+                                      seed + i, 0)
+            f.seek(0)
+            result = f.read()
+        os.unlink(name)
+        return result
+
+    def data(self):
+        return self._cached('data', lambda: self.random_bytes(self.size,
+                                                               self.seed))
+
+    def blobs(self):
+        def split():
+            data = self.data()
+            return [bytes(b) for b, level
+                    in hashsplit.hashsplit_iter([BytesIO(data)], True, None)]
+        return self._cached('blobs', split)
+
+    def shas(self):
+        def make():
+            raw = self.random_bytes(20 * self.number, self.seed + 1000)
+            return [raw[i:i + 20] for i in range(0, len(raw), 20)]
+        return self._cached('shas', make)
+
+    def missing_shas(self):
+        def make():
+            raw = self.random_bytes(20 * self.number, self.seed + 2000)
+            return [raw[i:i + 20] for i in range(0, len(raw), 20)]
+        return self._cached('missing_shas', make)
+
+    def tree(self):
+        """Return the path and total size of a synthetic tree of
+        random files."""
+        def make():
+            top = os.path.join(self.tmpdir, b'tree')
+            rand = random.Random(self.seed)
+            total = 0
+            for i in range(self.files):
+                d = os.path.join(top, b'd%d' % (i % 16), b'e%d' % (i % 5))
+                mkdirp(d)
+                n = min(rand.expovariate(1.0 / (self.size // self.files)),
+                        4 * self.size // self.files)
+                with open(os.path.join(d, b'f%d' % i), 'wb') as f:
+                    f.write(self.random_bytes(int(n), self.seed + 3000 + i))
+                total += int(n)
+            return top, total
+        return self._cached('tree', make)
+
+    def repo(self, name):
+        """Return a new repository, replacing any existing one."""
+        repo_dir = os.path.join(self.tmpdir, name)
+        if os.path.exists(repo_dir):
+            shutil.rmtree(repo_dir)
+        bup([b'init'], repo_dir)
+        return repo_dir
+
+    def packs(self):
+        """Return a repository pack directory containing the shas as
+        (empty) objects spread over a few packs, without any midx."""
+        def make():
+            repo_dir = self.repo(b'packs')
+            pack_dir = os.path.join(repo_dir, b'objects/pack')
+            w = git.PackWriter(repo_dir=repo_dir, run_midx=False,
+                               objcache_maker=lambda: None,
+                               max_pack_objects=max(1, self.number // 8))
+            # Write the objects directly, since the ids are arbitrary.
+            for sha in self.shas():
+                w._write(sha, b'blob', b'')
+            w.close(run_midx=False)
+            return pack_dir
+        return self._cached('packs', make)
+
+    def pack_repo(self):
+        return os.path.dirname(os.path.dirname(self.packs()))
+
+
+def bup(args, repo_dir):
+    env = dict(environ)
+    env[b'BUP_DIR'] = repo_dir
+    p = subprocess.Popen([path.exe()] + args, env=env,
+                         stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = p.communicate()
+    if p.returncode:
+        raise Exception('%r failed (%d): %r' % (args, p.returncode, err))
+
+
+# Each benchmark takes the workload and returns (ops, nbytes, run,
+# prepare), where run(lap) performs ops operations covering nbytes of
+# data (0 if throughput in bytes isn't meaningful), calling lap(n)
+# after each batch of n of them, and prepare(), if not None, is called
+# (untimed) before each run.  The latency percentiles are computed
+# from the batches, so benchmarks should split their runs into about
+# SAMPLES_PER_RUN batches when they can (cf. batches() and counted()).
+
+SAMPLES_PER_RUN = 100
+
+def batches(items, lap):
+    """Yield about SAMPLES_PER_RUN successive slices of items, calling
+    lap(len(slice)) after each one has been processed."""
+    n = max(1, len(items) // SAMPLES_PER_RUN)
+    for i in range(0, len(items), n):
+        batch = items[i : i + n]
+        yield batch
+        lap(len(batch))
+
+def counted(iterable, count, lap):
+    """Yield the count items of iterable, calling lap(n) after each
+    batch of about count / SAMPLES_PER_RUN of them."""
+    every = max(1, count // SAMPLES_PER_RUN)
+    n = 0
+    for x in iterable:
+        yield x
+        n += 1
+        if n == every:
+            lap(n)
+            n = 0
+    if n:
+        lap(n)
+
+def split_with(w, method):
+    data = w.data()
+    def chunks():
+        return hashsplit.hashsplit_iter([BytesIO(data)], True, None)
+    def run(lap):
+        hashsplit.set_split_method(method)
+        try:
+            for chunk in counted(chunks(), count, lap):
+                pass
+        finally:
+            hashsplit.set_split_method(None)
+    hashsplit.set_split_method(method)
+    try:
+        count = sum(1 for chunk in chunks())
+    finally:
+        hashsplit.set_split_method(None)
+    return count, len(data), run, None
+
+def bench_split(w):
+    return split_with(w, b'legacy')
+
+def bench_split_fastcdc(w):
+    return split_with(w, b'fastcdc')
+
+def bench_sha1(w):
+    blobs = w.blobs()
+    def run(lap):
+        for batch in batches(blobs, lap):
+            for b in batch:
+                git.calc_hash(b'blob', b)
+    return len(blobs), len(w.data()), run, None
+
+def bench_zlib_compress(w):
+    blobs = w.blobs()
+    def run(lap):
+        for batch in batches(blobs, lap):
+            for b in batch:
+                zlib.compress(b, 1)
+    return len(blobs), len(w.data()), run, None
+
+def bench_zlib_decompress(w):
+    packed = [zlib.compress(b, 1) for b in w.blobs()]
+    def run(lap):
+        for batch in batches(packed, lap):
+            for b in batch:
+                zlib.decompress(b)
+    return len(packed), len(w.data()), run, None
+
+def _bloom_name(w):
+    return os.path.join(w.tmpdir, b'bench.bloom')
+
+def bench_bloom_add(w):
+    shas = w.shas()
+    ids = [b''.join(batch) for batch in batches(shas, lambda n: None)]
+    state = {}
+    def prepare():
+        if state:
+            state['bloom'].close()
+        state['bloom'] = bloom.create(_bloom_name(w), expected=len(shas),
+                                      delaywrite=False)
+    def run(lap):
+        b = state['bloom']
+        for batch in ids:
+            b.add(batch)
+            lap(len(batch) // 20)
+    return len(shas), 0, run, prepare
+
+def bench_bloom_contains(w):
+    shas = w.shas()
+    b = bloom.create(_bloom_name(w), expected=len(shas), delaywrite=False)
+    b.add(b''.join(shas))
+    probes = shas[::2] + w.missing_shas()[::2]
+    def run(lap):
+        for batch in batches(probes, lap):
+            for sha in batch:
+                b.exists(sha)
+    return len(probes), 0, run, None
+
+def bench_idx_write(w):
+    shas = w.shas()
+    state = {}
+    def prepare():
+        idx = list(list() for i in range(256))
+        for i, sha in enumerate(shas):
+            idx[bytearray(sha)[0]].append((sha, i, i * 4096))
+        state['idx'] = idx
+    buf = bytearray(8 + 4 * 256 + 28 * len(shas))
+    def run(lap):
+        _helpers.write_idx(buf, state['idx'], len(shas))
+        lap(len(shas))
+    return len(shas), 0, run, prepare
+
+def bench_midx_merge(w):
+    pack_dir = w.packs()
+    def prepare():
+        for name in glob.glob(os.path.join(pack_dir, b'*.midx')):
+            os.unlink(name)
+    def run(lap):
+        bup([b'midx', b'-f', b'--dir', pack_dir], w.pack_repo())
+        lap(1)
+    return 1, 0, run, prepare
+
+def bench_midx_exists(w):
+    pack_dir = w.packs()
+    if not glob.glob(os.path.join(pack_dir, b'*.midx')):
+        bup([b'midx', b'-f', b'--dir', pack_dir], w.pack_repo())
+    ix = git.PackIdxList(pack_dir)
+    probes = w.shas()[::2] + w.missing_shas()[::2]
+    def run(lap):
+        ix.refresh()
+        for batch in batches(probes, lap):
+            for sha in batch:
+                ix.exists(sha)
+    return len(probes), 0, run, None
+
+def bench_index_read(w):
+    top, total = w.tree()
+    repo_dir = w.repo(b'index-read')
+    bup([b'index', top], repo_dir)
+    indexfile = os.path.join(repo_dir, b'bupindex')
+    count = sum(1 for e in index.Reader(indexfile))
+    def run(lap):
+        for e in counted(index.Reader(indexfile), count, lap):
+            pass
+    return count, 0, run, None
+
+def _shalists(w):
+    shas = w.shas()
+    return [[(hashsplit.GIT_MODE_FILE, b'%08x' % j, shas[(i + j) % len(shas)])
+             for j in range(256)]
+            for i in range(0, min(len(shas), 256 * 100), 256)]
+
+def bench_tree_encode(w):
+    shalists = _shalists(w)
+    def run(lap):
+        for batch in batches(shalists, lap):
+            for l in batch:
+                git.tree_encode(l)
+    return len(shalists), 0, run, None
+
+def bench_tree_decode(w):
+    trees = [git.tree_encode(l) for l in _shalists(w)]
+    def run(lap):
+        for batch in batches(trees, lap):
+            for t in batch:
+                for ent in git.tree_decode(t):
+                    pass
+    return len(trees), 0, run, None
+
+def bench_save(w):
+    top, total = w.tree()
+    state = {}
+    def prepare():
+        state['repo'] = w.repo(b'save')
+        bup([b'index', top], state['repo'])
+    def run(lap):
+        bup([b'save', b'-n', b'bench', top], state['repo'])
+        lap(1)
+    return 1, total, run, prepare
+
+def bench_restore(w):
+    top, total = w.tree()
+    repo_dir = w.repo(b'restore')
+    bup([b'index', top], repo_dir)
+    bup([b'save', b'--strip', b'-n', b'bench', top], repo_dir)
+    dest = os.path.join(w.tmpdir, b'restored')
+    def prepare():
+        if os.path.exists(dest):
+            shutil.rmtree(dest)
+    def run(lap):
+        bup([b'restore', b'-C', dest, b'/bench/latest/'], repo_dir)
+        lap(1)
+    return 1, total, run, prepare
+
+
+benchmarks = (('split', bench_split, 'rollsum splitting of random data'),
+              ('split-fastcdc', bench_split_fastcdc,
+               'gear hash (bup.split.files=fastcdc) splitting of random data'),
+              ('sha1', bench_sha1, 'git blob ids of the split chunks'),
+              ('zlib-compress', bench_zlib_compress,
+               'zlib compression of the split chunks'),
+              ('zlib-decompress', bench_zlib_decompress,
+               'zlib decompression of the split chunks'),
+              ('bloom-add', bench_bloom_add, 'bloom filter insertions'),
+              ('bloom-contains', bench_bloom_contains,
+               'bloom filter probes (half present)'),
+              ('idx-write', bench_idx_write, 'PackIdxV2 construction'),
+              ('midx-merge', bench_midx_merge,
+               'bup midx -f over 8 pack indexes'),
+              ('midx-exists', bench_midx_exists,
+               'PackIdxList.exists() probes (half present)'),
+              ('index-read', bench_index_read,
+               'index.Reader iteration over the synthetic tree'),
+              ('tree-encode', bench_tree_encode, 'git tree encoding'),
+              ('tree-decode', bench_tree_decode, 'git tree decoding'),
+              ('save', bench_save, 'bup save of the synthetic tree'),
+              ('restore', bench_restore,
+               'bup restore of the synthetic tree'))
+
+
+def percentile(sorted_values, p):
+    # Nearest rank
+    i = max(0, int(-(-len(sorted_values) * p // 100)) - 1)
+    return sorted_values[i]
+
+
+def measure(w, name, bench, repeat):
+    ops, nbytes, run, prepare = bench(w)
+    latencies = []
+    elapsed = 0
+    for i in range(repeat):
+        qprogress('%s: run %d/%d\r' % (name, i + 1, repeat))
+        if prepare:
+            prepare()
+        last = [time.time()]
+        def lap(n):
+            now = time.time()
+            latencies.append((now - last[0]) / n)
+            last[0] = now
+        start = last[0]
+        run(lap)
+        elapsed += time.time() - start
+    latencies.sort()
+    result = {'runs': repeat,
+              'ops_per_run': ops,
+              'latency_samples': len(latencies),
+              'seconds': elapsed,
+              'ops_per_second': ops * repeat / elapsed if elapsed else None,
+              'latency_us': dict((k, percentile(latencies, p) * 1e6)
+                                 for k, p in (('min', 0), ('p50', 50),
+                                              ('p90', 90), ('p99', 99),
+                                              ('max', 100)))}
+    if nbytes:
+        result['bytes_per_run'] = nbytes
+        result['bytes_per_second'] = \
+            nbytes * repeat / elapsed if elapsed else None
+    return result
+
+
+def fmt_rate(result):
+    rate = result.get('bytes_per_second')
+    if rate is not None:
+        return '%.1f MiB/s' % (rate / (1024 * 1024))
+    rate = result['ops_per_second']
+    if rate is None:
+        return '-'
+    return '%.0f ops/s' % rate
+
+
+o = options.Options(optspec)
+(opt, flags, extra) = o.parse(sys.argv[1:])
+
+known = [name for name, bench, desc in benchmarks]
+if opt.list:
+    out = byte_stream(sys.stdout)
+    for name, bench, desc in benchmarks:
+        out.write(b'%-16s %s\n' % (name.encode('ascii'), desc.encode('ascii')))
+    sys.exit(0)
+for name in extra:
+    if name not in known:
+        o.fatal('unknown benchmark %r (see --list)' % name)
+if opt.repeat < 1:
+    o.fatal('--repeat must be at least 1')
+size = parse_num(opt.size)
+if size < 1 or opt.number < 1 or opt.files < 1:
+    o.fatal('--size, --number, and --files must be positive')
+
+selected = [(name, bench) for name, bench, desc in benchmarks
+            if not extra or name in extra]
+tmp_root = environ.get(b'TMPDIR') or b'/tmp'
+tmpdir = tempfile.mkdtemp(b'', b'bup-bench-', tmp_root)
+try:
+    w = Workload(tmpdir, opt.seed, size, opt.number, opt.files)
+    results = {}
+    for name, bench in selected:
+        results[name] = measure(w, name, bench, opt.repeat)
+finally:
+    shutil.rmtree(tmpdir)
+
+sys.stdout.flush()
+out = byte_stream(sys.stdout)
+if opt.json:
+    report = {'commit': version.COMMIT,
+              'python': platform.python_version(),
+              'seed': opt.seed,
+              'size': size,
+              'number': opt.number,
+              'files': opt.files,
+              'benchmarks': results}
+    out.write(json.dumps(report, indent=2, sort_keys=True).encode('ascii'))
+    out.write(b'\n')
+else:
+    out.write(b'%-16s %14s %12s %12s %12s\n'
+              % (b'benchmark', b'throughput', b'p50 (us)', b'p90 (us)',
+                 b'p99 (us)'))
+    for name, bench in selected:
+        r = results[name]
+        lat = r['latency_us']
+        out.write(b'%-16s %14s %12.2f %12.2f %12.2f\n'
+                  % (name.encode('ascii'), fmt_rate(r).encode('ascii'),
+                     lat['p50'], lat['p90'], lat['p99']))
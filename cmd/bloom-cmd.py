@@ -6,7 +6,7 @@ exec "$bup_python" "$0" ${1+"$@"}
 # end of bup preamble
 
 from __future__ import absolute_import
-import glob, os, sys, tempfile
+import glob, multiprocessing, os, sys, tempfile, threading
 
 from bup import options, git, bloom
 from bup.compat import argv_bytes, hexstr
@@ -24,9 +24,61 @@ o,output=  output bloom filename (default: auto)
 d,dir=     input directory to look for idx files (default: auto)
 k,hashes=  number of hash functions to use (4 or 5) (default: auto)
 c,check=   check the given .idx file against the bloom filter
+check-all  check all of the bloom filter's .idx files against it
+j,jobs=    number of idx files to process at once (default: number of CPUs)
 """
 
 
+def parallel_map(fn, items, jobs):
+    """Return [fn(x) for x in items], computed by up to jobs threads,
+    or raise the first exception any of the calls raised."""
+    items = list(items)
+    if jobs <= 1 or len(items) <= 1:
+        return [fn(x) for x in items]
+    results = [None] * len(items)
+    failures = []
+    pending = iter(range(len(items)))
+    lock = threading.Lock()
+    def work():
+        while True:
+            with lock:
+                i = None if failures else next(pending, None)
+            if i is None:
+                return
+            try:
+                results[i] = fn(items[i])
+            except Exception as ex:
+                with lock:
+                    failures.append(ex)
+                return
+    threads = [threading.Thread(target=work)
+               for i in range(min(jobs, len(items)))]
+    for t in threads:
+        t.daemon = True
+        t.start()
+    for t in threads:
+        t.join()
+    if failures:
+        raise failures[0]
+    return results
+
+
+class Progress:
+    """Count the objects processed by parallel_map() workers, and
+    report them via qprogress."""
+    def __init__(self, fmt, total_objects):
+        self.fmt = fmt
+        self.total = total_objects
+        self.objects = 0
+        self.lock = threading.Lock()
+
+    def add(self, objects):
+        with self.lock:
+            self.objects += objects
+            qprogress(self.fmt % (self.objects * 100.0 / (self.total or 1),
+                                  self.objects, self.total))
+
+
 def ruin_bloom(bloomfilename):
     rbloomfilename = git.repo_rel(bloomfilename)
     if not os.path.exists(bloomfilename):
@@ -55,64 +107,67 @@ def check_bloom(path, bloomfilename, idx):
         idx = os.path.join(path, idx)
     log('bloom: bloom file: %s\n' % path_msg(rbloomfilename))
     log('bloom:   checking %s\n' % path_msg(ridx))
-    for objsha in git.open_idx(idx):
-        if not b.exists(objsha):
-            add_error('bloom: ERROR: object %s missing' % hexstr(objsha))
+    for sha in missing_shas(b, idx):
+        add_error('bloom: ERROR: object %s missing' % hexstr(sha))
+
+
+def missing_shas(b, idx):
+    """Return a list of the hashes in the idx file that aren't in the
+    bloom filter b."""
+    shas = git.open_idx(idx).shas()
+    found = b.exists_many(shas)
+    missing = []
+    i = found.find(b'\0')
+    while i >= 0:
+        missing.append(bytes(shas[i * 20 : (i + 1) * 20]))
+        i = found.find(b'\0', i + 1)
+    return missing
+
+
+def check_all_bloom(path, bloomfilename, jobs):
+    rbloomfilename = git.repo_rel(bloomfilename)
+    if not os.path.exists(bloomfilename):
+        log('bloom: %s: does not exist.\n' % path_msg(rbloomfilename))
+        return
+    b = bloom.ShaBloom(bloomfilename)
+    if not b.valid():
+        add_error('bloom: %r is invalid.\n' % path_msg(rbloomfilename))
+        return
+    log('bloom: bloom file: %s\n' % path_msg(rbloomfilename))
+    idxs = [os.path.join(path, name) for name in b.idxnames]
+    present = [idx for idx in idxs if os.path.exists(idx)]
+    for idx in idxs:
+        if idx not in present:
+            log('bloom: %s no longer exists.\n' % path_msg(git.repo_rel(idx)))
+    log('bloom:   checking %d idx file%s\n'
+        % (len(present), len(present) != 1 and 's' or ''))
+    for idx, missing in zip(present,
+                            parallel_map(lambda idx: missing_shas(b, idx),
+                                         present, jobs)):
+        for sha in missing:
+            add_error('bloom: ERROR: object %s from %s missing'
+                      % (hexstr(sha), path_msg(git.repo_rel(idx))))
 
 
 _first = None
-def do_bloom(path, outfilename, k):
+def do_bloom(path, outfilename, k, jobs):
     global _first
-    assert k in (None, 4, 5)
-    b = None
-    if os.path.exists(outfilename) and not opt.force:
-        b = bloom.ShaBloom(outfilename)
-        if not b.valid():
-            debug1("bloom: Existing invalid bloom found, regenerating.\n")
-            b = None
-
-    add = []
-    rest = []
-    add_count = 0
-    rest_count = 0
-    for i, name in enumerate(glob.glob(b'%s/*.idx' % path)):
-        progress('bloom: counting: %d\r' % i)
-        ix = git.open_idx(name)
-        ixbase = os.path.basename(name)
-        if b and (ixbase in b.idxnames):
-            rest.append(name)
-            rest_count += len(ix)
-        else:
-            add.append(name)
-            add_count += len(ix)
-
+    names = glob.glob(b'%s/*.idx' % path)
+    counted = [0]
+    counted_lock = threading.Lock()
+    def count(name):
+        n = len(git.open_idx(name))
+        with counted_lock:
+            progress('bloom: counting: %d\r' % counted[0])
+            counted[0] += 1
+        return n
+    sizes = dict(zip(names, parallel_map(count, names, jobs)))
+
+    b, add, add_count = bloom.plan_update(outfilename, sizes, k=k,
+                                          force=opt.force)
     if not add:
-        debug1("bloom: nothing to do.\n")
         return
 
-    if b:
-        if len(b) != rest_count:
-            debug1("bloom: size %d != idx total %d, regenerating\n"
-                   % (len(b), rest_count))
-            b = None
-        elif k is not None and k != b.k:
-            debug1("bloom: new k %d != existing k %d, regenerating\n"
-                   % (k, b.k))
-            b = None
-        elif (b.bits < bloom.MAX_BLOOM_BITS[b.k] and
-              b.pfalse_positive(add_count) > bloom.MAX_PFALSE_POSITIVE):
-            debug1("bloom: regenerating: adding %d entries gives "
-                   "%.2f%% false positives.\n"
-                   % (add_count, b.pfalse_positive(add_count)))
-            b = None
-        else:
-            b = bloom.ShaBloom(outfilename, readwrite=True, expected=add_count)
-    if not b: # Need all idxs to build from scratch
-        add += rest
-        add_count += rest_count
-    del rest
-    del rest_count
-
     msg = b is None and 'creating from' or 'adding'
     if not _first: _first = path
     dirprefix = (_first != path) and git.repo_rel(path) + b': ' or b''
@@ -125,15 +180,16 @@ def do_bloom(path, outfilename, k):
     if b is None:
         tfname = os.path.join(path, b'bup.tmp.bloom')
         b = bloom.create(tfname, expected=add_count, k=k)
-    count = 0
-    icount = 0
-    for name in add:
+    # Each thread adds whole idx files, and since the GIL's released
+    # while the bits are set (atomically), the threads can share the
+    # filter.
+    prog = Progress('bloom: writing %.2f%% (%d/%d objects)\r', add_count)
+    concurrent = jobs > 1 and len(add) > 1
+    def add_idx(name):
         ix = git.open_idx(name)
-        qprogress('bloom: writing %.2f%% (%d/%d objects)\r' 
-                  % (icount*100.0/add_count, icount, add_count))
-        b.add_idx(ix)
-        count += 1
-        icount += len(ix)
+        b.add_idx(ix, concurrent=concurrent)
+        prog.add(len(ix))
+    parallel_map(add_idx, add, jobs)
 
     # Currently, there's an open file object for tfname inside b.
     # Make sure it's closed before rename.
@@ -153,6 +209,12 @@ if extra:
 
 if not opt.check and opt.k and opt.k not in (4,5):
     o.fatal('only k values of 4 and 5 are supported')
+if opt.check and opt.check_all:
+    o.fatal('--check and --check-all are mutually exclusive')
+if opt.jobs is None:
+    opt.jobs = multiprocessing.cpu_count()
+elif opt.jobs < 1:
+    o.fatal('--jobs must be at least 1')
 
 if opt.check:
     opt.check = argv_bytes(opt.check)
@@ -166,13 +228,15 @@ for path in paths:
     outfilename = output or os.path.join(path, b'bup.bloom')
     if opt.check:
         check_bloom(path, outfilename, opt.check)
+    elif opt.check_all:
+        check_all_bloom(path, outfilename, opt.jobs)
     elif opt.ruin:
         ruin_bloom(outfilename)
     else:
-        do_bloom(path, outfilename, opt.k)
+        do_bloom(path, outfilename, opt.k, opt.jobs)
 
 if saved_errors:
     log('WARNING: %d errors encountered during bloom.\n' % len(saved_errors))
     sys.exit(1)
-elif opt.check:
+elif opt.check or opt.check_all:
     log('All tests passed.\n')
@@ -6,7 +6,8 @@ exec "$bup_python" "$0" ${1+"$@"}
 # end of bup preamble
 
 from __future__ import absolute_import, print_function
-import sys, os, errno
+from stat import S_ISREG
+import sys, os, errno, threading
 
 try:
     import fuse
@@ -43,28 +44,34 @@ from bup.repo import LocalRepo
 # The path handling is just wrong, but the current fuse module can't
 # handle bytes paths.
 
+# Requests may be handled concurrently (f.multithreaded), but the
+# repository (i.e. its CatPipe) and the vfs cache can only be used by
+# one thread at a time, so everything that touches them holds
+# repo_lock.  Each open() returns a vfs.ReadAhead for the file, which
+# fuse passes to read() and release(), so sequential reads just pick
+# up where the last one left off, instead of resolving the path and
+# seeking through the chunk tree every time.  Paths are resolved via
+# a vfs.DentryCache, since tools like find and du will ask about the
+# same (immutable) directories over and over.
+
 class BupFs(fuse.Fuse):
     def __init__(self, repo, verbose=0, fake_metadata=False):
         fuse.Fuse.__init__(self)
         self.repo = repo
+        self.repo_lock = threading.Lock()
         self.verbose = verbose
         self.fake_metadata = fake_metadata
+        self.dentries = vfs.DentryCache(repo, want_meta=(not fake_metadata))
     
     def getattr(self, path):
         path = argv_bytes(path)
         global opt
         if self.verbose > 0:
             log('--getattr(%r)\n' % path)
-        res = vfs.resolve(self.repo, path, want_meta=(not self.fake_metadata),
-                          follow=False)
-        name, item = res[-1]
+        with self.repo_lock:
+            name, item = self.dentries.resolve(path)[-1]
         if not item:
             return -errno.ENOENT
-        if self.fake_metadata:
-            item = vfs.augment_item_meta(self.repo, item, include_size=True)
-        else:
-            item = vfs.ensure_item_has_metadata(self.repo, item,
-                                                include_size=True)
         meta = item.meta
         # FIXME: do we want/need to do anything more with nlink?
         st = fuse.Stat(st_mode=meta.mode, st_nlink=1, st_size=meta.size)
@@ -79,13 +86,13 @@ class BupFs(fuse.Fuse):
     def readdir(self, path, offset):
         path = argv_bytes(path)
         assert not offset  # We don't return offsets, so offset should be unused
-        res = vfs.resolve(self.repo, path, follow=False)
-        dir_name, dir_item = res[-1]
-        if not dir_item:
+        with self.repo_lock:
+            names = self.dentries.names(path)
+        if names is None:
             yield -errno.ENOENT
+            return
         yield fuse.Direntry('..')
-        # FIXME: make sure want_meta=False is being completely respected
-        for ent_name, ent_item in vfs.contents(repo, dir_item, want_meta=False):
+        for ent_name in names:
             fusename = fsdecode(ent_name.replace(b'/', b'-'))
             yield fuse.Direntry(fusename)
 
@@ -93,38 +100,47 @@ class BupFs(fuse.Fuse):
         path = argv_bytes(path)
         if self.verbose > 0:
             log('--readlink(%r)\n' % path)
-        res = vfs.resolve(self.repo, path, follow=False)
-        name, item = res[-1]
-        if not item:
-            return -errno.ENOENT
-        return fsdecode(vfs.readlink(repo, item))
+        with self.repo_lock:
+            name, item = self.dentries.resolve(path)[-1]
+            if not item:
+                return -errno.ENOENT
+            return fsdecode(vfs.readlink(self.repo, item))
 
     def open(self, path, flags):
         path = argv_bytes(path)
         if self.verbose > 0:
             log('--open(%r)\n' % path)
-        res = vfs.resolve(self.repo, path, follow=False)
-        name, item = res[-1]
-        if not item:
-            return -errno.ENOENT
-        accmode = os.O_RDONLY | os.O_WRONLY | os.O_RDWR
-        if (flags & accmode) != os.O_RDONLY:
-            return -errno.EACCES
-        # Return None since read doesn't need the file atm...
-        # If we *do* return the file, it'll show up as the last argument
-        #return vfs.fopen(repo, item)
-
-    def read(self, path, size, offset):
+        with self.repo_lock:
+            name, item = self.dentries.resolve(path)[-1]
+            if not item:
+                return -errno.ENOENT
+            accmode = os.O_RDONLY | os.O_WRONLY | os.O_RDWR
+            if (flags & accmode) != os.O_RDONLY:
+                return -errno.EACCES
+            if not S_ISREG(vfs.item_mode(item)):
+                return None
+            # This will show up as the last argument to read() and
+            # release().
+            return vfs.ReadAhead(vfs.fopen(self.repo, item), self.repo_lock)
+
+    def read(self, path, size, offset, f=None):
         path = argv_bytes(path)
         if self.verbose > 0:
             log('--read(%r)\n' % path)
-        res = vfs.resolve(self.repo, path, follow=False)
-        name, item = res[-1]
-        if not item:
-            return -errno.ENOENT
-        with vfs.fopen(repo, item) as f:
-            f.seek(offset)
-            return f.read(size)
+        if f:
+            return f.read(size, offset)
+        with self.repo_lock:
+            res = vfs.resolve(self.repo, path, follow=False)
+            name, item = res[-1]
+            if not item:
+                return -errno.ENOENT
+            with vfs.fopen(self.repo, item) as f:
+                f.seek(offset)
+                return f.read(size)
+
+    def release(self, path, flags, f=None):
+        if f:
+            f.close()
 
 
 optspec = """
@@ -161,7 +177,7 @@ if opt.debug:
     f.fuse_args.add('debug')
 if opt.foreground:
     f.fuse_args.setmod('foreground')
-f.multithreaded = False
+f.multithreaded = True
 if opt.allow_other:
     f.fuse_args.add('allow_other')
 f.main()
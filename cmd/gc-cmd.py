@@ -8,7 +8,7 @@ exec "$bup_python" "$0" ${1+"$@"}
 from __future__ import absolute_import
 import sys
 
-from bup import git, options
+from bup import git, metrics, options
 from bup.gc import bup_gc
 from bup.helpers import die_if_errors, handle_ctrl_c, log
 
@@ -20,6 +20,7 @@ v,verbose   increase log output (can be used more than once)
 threshold=  only rewrite a packfile if it's over this percent garbage [10]
 #,compress= set compression level to # (0-9, 9 is highest) [1]
 unsafe      use the command even though it may be DANGEROUS
+stats=      dump performance statistics to stderr (format: json) at exit and on SIGUSR1
 """
 
 # FIXME: server mode?
@@ -44,6 +45,9 @@ if opt.threshold:
     if opt.threshold < 0 or opt.threshold > 100:
         o.fatal('threshold must be an integer percentage value')
 
+if opt.stats and not metrics.enable_stats(opt.stats):
+    o.fatal('unsupported --stats format %r' % opt.stats)
+
 git.check_repo_or_die()
 
 bup_gc(threshold=opt.threshold,
@@ -14,7 +14,7 @@ from stat import S_ISDIR
 
 from bup import git, client, helpers, vfs
 from bup.compat import argv_bytes, environ, hexstr, items, wrap_main
-from bup.git import get_cat_data, parse_commit, walk_object
+from bup.git import get_cat_data, parse_commit, walk_object_batched
 from bup.helpers import add_error, debug1, handle_ctrl_c, log, saved_errors
 from bup.helpers import hostname, shstr, tty_width
 from bup.io import path_msg
@@ -181,10 +181,14 @@ def parse_args(args):
 # FIXME: walk_object in in git.py doesn't support opt.verbose.  Do we
 # need to adjust for that here?
 def get_random_item(name, hash, repo, writer, opt):
+    # The writer's objcache knows everything the destination has
+    # (for a remote destination, via its synced indexes), so only
+    # request the objects it's missing from the source, in batches.
     def already_seen(oid):
         return writer.exists(unhexlify(oid))
-    for item in walk_object(repo.cat, hash, stop_at=already_seen,
-                            include_data=True):
+    for item in walk_object_batched(repo.cat_batch, hash,
+                                    stop_at=already_seen,
+                                    include_data=True):
         # already_seen ensures that writer.exists(id) is false.
         # Otherwise, just_write() would fail.
         writer.just_write(item.oid, item.type, item.data)
@@ -7,6 +7,7 @@ exec "$bup_python" "$0" ${1+"$@"}
 
 from __future__ import absolute_import, print_function
 from binascii import hexlify
+from collections import deque
 import sys, stat, time, os, errno, re
 
 from bup import metadata, options, git, index, drecurse, hlinkdb
@@ -61,7 +62,8 @@ def check_index(reader):
 
 
 def clear_index(indexfile):
-    indexfiles = [indexfile, indexfile + b'.meta', indexfile + b'.hlink']
+    indexfiles = [indexfile, indexfile + b'.meta', indexfile + b'.meta.hidx',
+                  indexfile + b'.hlink']
     for indexfile in indexfiles:
         path = git.repo(indexfile)
         try:
@@ -89,6 +91,52 @@ def update_index(top, excluded_paths, exclude_rxs, xdev_exceptions, out=None):
         def fake_hash(name):
             return (GIT_MODE_FILE, index.FAKE_SHA)
 
+    # Metadata is collected by the harvester, possibly concurrently,
+    # and each path's index update is deferred until its metadata is
+    # ready, with the updates applied in path order.
+    harvester = metadata.Harvester(opt.meta_threads)
+    pending = deque()
+    meta_window = 16 * opt.meta_threads
+
+    def finish_harvest(limit=0):
+        while len(pending) > limit:
+            get_meta, update = pending.popleft()
+            try:
+                meta = get_meta()
+            except (OSError, IOError) as e:
+                add_error(e)
+                continue
+            # Clear these so they don't bloat the store -- they're
+            # already in the index (since they vary a lot and they're
+            # fixed length).  If you've noticed "tmax", you might
+            # wonder why it's OK to do this, since that code may
+            # adjust (mangle) the index mtime and ctime -- producing
+            # fake values which must not end up in a .bupm.  However,
+            # it looks like that shouldn't be possible:  (1) When
+            # "save" validates the index entry, it always reads the
+            # metadata from the filesytem. (2) Metadata is only
+            # read/used from the index if hashvalid is true. (3)
+            # "faked" entries will be stale(), and so we'll invalidate
+            # them below.
+            meta.ctime = meta.mtime = meta.atime = 0
+            update(msw.store(meta))
+
+    def harvest(path, pst, update):
+        pending.append((harvester.submit(path, statinfo=pst), update))
+        finish_harvest(meta_window)
+
+    def finish_existing(cur, path, need_repack):
+        if not (cur.flags & index.IX_HASHVALID):
+            if fake_hash:
+                cur.gitmode, cur.sha = fake_hash(path)
+                cur.flags |= index.IX_HASHVALID
+                need_repack = True
+        if opt.fake_invalid:
+            cur.invalidate()
+            need_repack = True
+        if need_repack:
+            cur.repack()
+
     total = 0
     bup_dir = os.path.abspath(git.repo())
     index_start = time.time()
@@ -115,62 +163,33 @@ def update_index(top, excluded_paths, exclude_rxs, xdev_exceptions, out=None):
                 rig.cur.set_deleted()
                 rig.cur.repack()
                 if rig.cur.nlink > 1 and not stat.S_ISDIR(rig.cur.mode):
-                    hlinks.del_path(rig.cur.name)
+                    hlinks.del_path(rig.cur.name, rig.cur.dev, rig.cur.ino)
             rig.next()
 
         if rig.cur and rig.cur.name == path:    # paths that already existed
-            need_repack = False
-            if(rig.cur.stale(pst, tstart, check_device=opt.check_device)):
-                try:
-                    meta = metadata.from_path(path, statinfo=pst)
-                except (OSError, IOError) as e:
-                    add_error(e)
-                    rig.next()
-                    continue
-                if not stat.S_ISDIR(rig.cur.mode) and rig.cur.nlink > 1:
-                    hlinks.del_path(rig.cur.name)
-                if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
-                    hlinks.add_path(path, pst.st_dev, pst.st_ino)
-                # Clear these so they don't bloat the store -- they're
-                # already in the index (since they vary a lot and they're
-                # fixed length).  If you've noticed "tmax", you might
-                # wonder why it's OK to do this, since that code may
-                # adjust (mangle) the index mtime and ctime -- producing
-                # fake values which must not end up in a .bupm.  However,
-                # it looks like that shouldn't be possible:  (1) When
-                # "save" validates the index entry, it always reads the
-                # metadata from the filesytem. (2) Metadata is only
-                # read/used from the index if hashvalid is true. (3)
-                # "faked" entries will be stale(), and so we'll invalidate
-                # them below.
-                meta.ctime = meta.mtime = meta.atime = 0
-                meta_ofs = msw.store(meta)
-                rig.cur.update_from_stat(pst, meta_ofs)
-                rig.cur.invalidate()
-                need_repack = True
-            if not (rig.cur.flags & index.IX_HASHVALID):
-                if fake_hash:
-                    rig.cur.gitmode, rig.cur.sha = fake_hash(path)
-                    rig.cur.flags |= index.IX_HASHVALID
-                    need_repack = True
-            if opt.fake_invalid:
-                rig.cur.invalidate()
-                need_repack = True
-            if need_repack:
-                rig.cur.repack()
+            cur = rig.cur
+            if cur.stale(pst, tstart, check_device=opt.check_device):
+                def update_existing(meta_ofs, cur=cur, path=path, pst=pst):
+                    if not stat.S_ISDIR(cur.mode) and cur.nlink > 1:
+                        hlinks.del_path(cur.name, cur.dev, cur.ino)
+                    if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
+                        hlinks.add_path(path, pst.st_dev, pst.st_ino)
+                    cur.update_from_stat(pst, meta_ofs)
+                    cur.invalidate()
+                    finish_existing(cur, path, need_repack=True)
+                harvest(path, pst, update_existing)
+            else:
+                finish_existing(cur, path, need_repack=False)
             rig.next()
         else:  # new paths
-            try:
-                meta = metadata.from_path(path, statinfo=pst)
-            except (OSError, IOError) as e:
-                add_error(e)
-                continue
-            # See same assignment to 0, above, for rationale.
-            meta.atime = meta.mtime = meta.ctime = 0
-            meta_ofs = msw.store(meta)
-            wi.add(path, pst, meta_ofs, hashgen=fake_hash)
-            if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
-                hlinks.add_path(path, pst.st_dev, pst.st_ino)
+            def add_new(meta_ofs, path=path, pst=pst):
+                wi.add(path, pst, meta_ofs, hashgen=fake_hash)
+                if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
+                    hlinks.add_path(path, pst.st_dev, pst.st_ino)
+            harvest(path, pst, add_new)
+
+    finish_harvest()
+    harvester.close()
 
     elapsed = time.time() - index_start
     paths_per_sec = total / elapsed if elapsed else 0
@@ -228,6 +247,7 @@ exclude-rx= skip paths matching the unanchored regex (may be repeated)
 exclude-rx-from= skip --exclude-rx patterns in file (may be repeated)
 v,verbose  increase log output (can be used more than once)
 x,xdev,one-file-system  don't cross filesystem boundaries
+meta-threads= number of threads collecting file metadata concurrently [0]
 """
 o = options.Options(optspec)
 (opt, flags, extra) = o.parse(sys.argv[1:])
@@ -245,6 +265,8 @@ if opt.fake_valid and opt.fake_invalid:
     o.fatal('--fake-valid is incompatible with --fake-invalid')
 if opt.clear and opt.indexfile:
     o.fatal('cannot clear an external index (via -f)')
+if opt.meta_threads < 0:
+    o.fatal('--meta-threads must not be negative')
 
 # FIXME: remove this once we account for timestamp races, i.e. index;
 # touch new-file; index.  It's possible for this to happen quickly
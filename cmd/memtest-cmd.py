@@ -8,7 +8,7 @@ exec "$bup_python" "$0" ${1+"$@"}
 from __future__ import absolute_import, print_function
 import sys, re, struct, time, resource
 
-from bup import git, bloom, midx, options, _helpers
+from bup import git, metrics, options, _helpers
 from bup.compat import range
 from bup.helpers import handle_ctrl_c
 from bup.io import byte_stream
@@ -117,16 +117,12 @@ for c in range(opt.cycles):
             assert(not m.exists(bin))
     report((c+1)*opt.number, out)
 
-if bloom._total_searches:
-    out.write(b'bloom: %d objects searched in %d steps: avg %.3f steps/object\n'
-              % (bloom._total_searches, bloom._total_steps,
-                 bloom._total_steps*1.0/bloom._total_searches))
-if midx._total_searches:
-    out.write(b'midx: %d objects searched in %d steps: avg %.3f steps/object\n'
-              % (midx._total_searches, midx._total_steps,
-                 midx._total_steps*1.0/midx._total_searches))
-if git._total_searches:
-    out.write(b'idx: %d objects searched in %d steps: avg %.3f steps/object\n'
-              % (git._total_searches, git._total_steps,
-                 git._total_steps*1.0/git._total_searches))
+stats = metrics.snapshot()
+for kind in ('bloom', 'midx', 'idx'):
+    searches = stats.get(kind + '.probes')
+    if searches:
+        steps = stats.get(kind + '.steps', 0)
+        out.write(b'%s: %d objects searched in %d steps: avg %.3f steps/object\n'
+                  % (kind.encode('ascii'), searches, steps,
+                     steps * 1.0 / searches))
 out.write(b'Total time: %.3fs\n' % (time.time() - start))
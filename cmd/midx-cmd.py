@@ -7,19 +7,15 @@ exec "$bup_python" "$0" ${1+"$@"}
 
 from __future__ import absolute_import, print_function
 from binascii import hexlify
-import glob, math, os, resource, struct, sys, tempfile
+import glob, os, sys
 
-from bup import options, git, midx, _helpers, xstat
-from bup.compat import argv_bytes, hexstr, range
-from bup.helpers import (Sha1, add_error, atomically_replaced_file, debug1, fdatasync,
-                         handle_ctrl_c, log, mmap_readwrite, qprogress,
-                         saved_errors, unlink)
+from bup import options, git, midx
+from bup.compat import argv_bytes, hexstr
+from bup.helpers import (Sha1, add_error, debug1, handle_ctrl_c, log, qprogress,
+                         saved_errors)
 from bup.io import byte_stream, path_msg
 
 
-PAGE_SIZE=4096
-SHA_PER_PAGE=PAGE_SIZE/20.
-
 optspec = """
 bup midx [options...] <idxnames...>
 --
@@ -32,23 +28,6 @@ max-files= maximum number of idx files to open at once [-1]
 d,dir=     directory containing idx/midx files
 """
 
-merge_into = _helpers.merge_into
-
-
-def _group(l, count):
-    for i in range(0, len(l), count):
-        yield l[i:i+count]
-
-
-def max_files():
-    mf = min(resource.getrlimit(resource.RLIMIT_NOFILE))
-    if mf > 32:
-        mf -= 20  # just a safety margin
-    else:
-        mf -= 6   # minimum safety margin
-    return mf
-
-
 def check_midx(name):
     nicename = git.repo_rel(name)
     log('Checking %s.\n' % path_msg(nicename))
@@ -93,25 +72,13 @@ def _do_midx(outdir, outfilename, infilenames, prefixstr):
         sum = hexlify(Sha1(b'\0'.join(infilenames)).digest())
         outfilename = b'%s/midx-%s.midx' % (outdir, sum)
     
-    inp = []
+    ixs = []
     total = 0
-    allfilenames = []
-    midxs = []
     try:
         for name in infilenames:
             ix = git.open_idx(name)
-            midxs.append(ix)
-            inp.append((
-                ix.map,
-                len(ix),
-                ix.sha_ofs,
-                isinstance(ix, midx.PackMidx) and ix.which_ofs or 0,
-                len(allfilenames),
-            ))
-            for n in ix.idxnames:
-                allfilenames.append(os.path.basename(n))
+            ixs.append(ix)
             total += len(ix)
-        inp.sort(reverse=True, key=lambda x: x[0][x[2] : x[2] + 20])
 
         if not _first: _first = outdir
         dirprefix = (_first != outdir) and git.repo_rel(outdir) + b': ' or b''
@@ -123,44 +90,12 @@ def _do_midx(outdir, outfilename, infilenames, prefixstr):
             debug1('midx: nothing to do.\n')
             return
 
-        pages = int(total/SHA_PER_PAGE) or 1
-        bits = int(math.ceil(math.log(pages, 2)))
-        entries = 2**bits
-        debug1('midx: table size: %d (%d bits)\n' % (entries*4, bits))
-
-        unlink(outfilename)
-        with atomically_replaced_file(outfilename, 'wb') as f:
-            f.write(b'MIDX')
-            f.write(struct.pack('!II', midx.MIDX_VERSION, bits))
-            assert(f.tell() == 12)
-
-            f.truncate(12 + 4*entries + 20*total + 4*total)
-            f.flush()
-            fdatasync(f.fileno())
-
-            fmap = mmap_readwrite(f, close=False)
-            count = merge_into(fmap, bits, total, inp)
-            del fmap # Assume this calls msync() now.
-            f.seek(0, os.SEEK_END)
-            f.write(b'\0'.join(allfilenames))
+        midx.write(outfilename, ixs)
     finally:
-        for ix in midxs:
+        for ix in ixs:
             if isinstance(ix, midx.PackMidx):
                 ix.close()
-        midxs = None
-        inp = None
-
-
-    # This is just for testing (if you enable this, don't clear inp above)
-    if 0:
-        p = midx.PackMidx(outfilename)
-        assert(len(p.idxnames) == len(infilenames))
-        log(repr(p.idxnames) + '\n')
-        assert(len(p) == total)
-        for pe, e in p, git.idxmerge(inp, final_progress=False):
-            pin = next(pi)
-            assert(i == pin)
-            assert(p.exists(i))
+        ixs = None
 
     return total, outfilename
 
@@ -172,76 +107,21 @@ def do_midx(outdir, outfilename, infilenames, prefixstr, prout):
 
 
 def do_midx_dir(path, outfilename, prout):
-    already = {}
-    sizes = {}
-    if opt.force and not opt.auto:
-        midxs = []   # don't use existing midx files
-    else:
-        midxs = glob.glob(b'%s/*.midx' % path)
-        contents = {}
-        for mname in midxs:
-            m = git.open_idx(mname)
-            contents[mname] = [(b'%s/%s' % (path,i)) for i in m.idxnames]
-            sizes[mname] = len(m)
-                    
-        # sort the biggest+newest midxes first, so that we can eliminate
-        # smaller (or older) redundant ones that come later in the list
-        midxs.sort(key=lambda ix: (-sizes[ix], -xstat.stat(ix).st_mtime))
-        
-        for mname in midxs:
-            any = 0
-            for iname in contents[mname]:
-                if not already.get(iname):
-                    already[iname] = 1
-                    any = 1
-            if not any:
-                debug1('%r is redundant\n' % mname)
-                unlink(mname)
-                already[mname] = 1
-
-    midxs = [k for k in midxs if not already.get(k)]
-    idxs = [k for k in glob.glob(b'%s/*.idx' % path) if not already.get(k)]
-
-    for iname in idxs:
-        i = git.open_idx(iname)
-        sizes[iname] = len(i)
-
-    all = [(sizes[n],n) for n in (midxs + idxs)]
-    
-    # FIXME: what are the optimal values?  Does this make sense?
-    DESIRED_HWM = opt.force and 1 or 5
-    DESIRED_LWM = opt.force and 1 or 2
-    existed = dict((name,1) for sz,name in all)
-    debug1('midx: %d indexes; want no more than %d.\n' 
-           % (len(all), DESIRED_HWM))
-    if len(all) <= DESIRED_HWM:
-        debug1('midx: nothing to do.\n')
-    while len(all) > DESIRED_HWM:
-        all.sort()
-        part1 = [name for sz,name in all[:len(all)-DESIRED_LWM+1]]
-        part2 = all[len(all)-DESIRED_LWM+1:]
-        all = list(do_midx_group(path, outfilename, part1)) + part2
-        if len(all) > DESIRED_HWM:
-            debug1('\nStill too many indexes (%d > %d).  Merging again.\n'
-                   % (len(all), DESIRED_HWM))
-
+    # The --auto/--force policy lives in git.PackMaintainer, which also
+    # keeps the midx files up to date when a pack is finished.
+    existed = set(glob.glob(b'%s/*.midx' % path)
+                  + glob.glob(b'%s/*.idx' % path))
+    maintainer = git.PackMaintainer(path)
+    names = maintainer.update_midx(force=opt.force,
+                                   ignore_midx=opt.force and not opt.auto,
+                                   outfilename=outfilename,
+                                   max_files=opt.max_files)
     if opt['print']:
-        for sz,name in all:
-            if not existed.get(name):
+        for name in names:
+            if name not in existed:
                 prout.write(name + b'\n')
 
 
-def do_midx_group(outdir, outfilename, infiles):
-    groups = list(_group(infiles, opt.max_files))
-    gprefix = ''
-    for n,sublist in enumerate(groups):
-        if len(groups) != 1:
-            gprefix = 'Group %d: ' % (n+1)
-        rv = _do_midx(outdir, outfilename, sublist, gprefix)
-        if rv:
-            yield rv
-
-
 handle_ctrl_c()
 
 o = options.Options(optspec)
@@ -257,7 +137,7 @@ if opt.check and (not extra and not opt.auto):
 git.check_repo_or_die()
 
 if opt.max_files < 0:
-    opt.max_files = max_files()
+    opt.max_files = midx.max_files()
 assert(opt.max_files >= 5)
 
 extra = [argv_bytes(x) for x in extra]
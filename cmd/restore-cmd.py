@@ -7,9 +7,9 @@ exec "$bup_python" "$0" ${1+"$@"}
 
 from __future__ import absolute_import
 from stat import S_ISDIR
-import copy, errno, os, sys, stat, re
+import copy, errno, os, sys, stat, re, time
 
-from bup import options, git, metadata, vfs
+from bup import options, git, metadata, metrics, vfs
 from bup._helpers import write_sparsely
 from bup.compat import argv_bytes, fsencode, wrap_main
 from bup.helpers import (add_error, chunkyreader, die_if_errors, handle_ctrl_c,
@@ -34,6 +34,7 @@ map-group=  given OLD=NEW, restore OLD group as NEW group
 map-uid=    given OLD=NEW, restore OLD uid as NEW uid
 map-gid=    given OLD=NEW, restore OLD gid as NEW gid
 q,quiet     don't show progress meter
+stats=      dump performance statistics to stderr (format: json) at exit and on SIGUSR1
 """
 
 total_restored = 0
@@ -137,19 +138,46 @@ def hardlink_if_possible(fullname, item, top, hardlinks):
     target_versions.append((fullname, item))
     return False
 
+_fetch_time = metrics.histogram('restore.fetch')
+_write_time = metrics.histogram('restore.write')
+_written_bytes = metrics.counter('restore.written_bytes')
+
+def _timed_chunks(it):
+    """Yield the blocks from the iterator it, recording how long each
+    took to retrieve."""
+    while True:
+        start = time.time()
+        b = next(it, None)
+        _fetch_time.record(time.time() - start)
+        if b is None:
+            return
+        yield b
+
 def write_file_content(repo, dest_path, vfs_file):
     with vfs.fopen(repo, vfs_file) as inf:
         with open(dest_path, 'wb') as outf:
-            for b in chunkyreader(inf):
+            for b in _timed_chunks(chunkyreader(inf)):
+                start = time.time()
                 outf.write(b)
+                _write_time.record(time.time() - start)
+                _written_bytes.value += len(b)
 
 def write_file_content_sparsely(repo, dest_path, vfs_file):
     with vfs.fopen(repo, vfs_file) as inf:
         outfd = os.open(dest_path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o600)
         try:
             trailing_zeros = 0;
-            for b in chunkyreader(inf):
-                trailing_zeros = write_sparsely(outfd, b, 512, trailing_zeros)
+            for b in _timed_chunks(inf.chunks()):
+                start = time.time()
+                if b is vfs.zero_chunk:
+                    # Nothing to scan, and nothing to write until the
+                    # next non-zero data (or the end) anyway.
+                    trailing_zeros += len(b)
+                else:
+                    trailing_zeros = write_sparsely(outfd, b, 512,
+                                                    trailing_zeros)
+                _write_time.record(time.time() - start)
+                _written_bytes.value += len(b)
             pos = os.lseek(outfd, trailing_zeros, os.SEEK_END)
             os.ftruncate(outfd, pos)
         finally:
@@ -231,6 +259,8 @@ def main():
         opt.remote = argv_bytes(opt.remote)
     if opt.outdir:
         opt.outdir = argv_bytes(opt.outdir)
+    if opt.stats and not metrics.enable_stats(opt.stats):
+        o.fatal('unsupported --stats format %r' % opt.stats)
     
     git.check_repo_or_die()
 
@@ -7,11 +7,13 @@ exec "$bup_python" "$0" ${1+"$@"}
 
 from __future__ import absolute_import, print_function
 from binascii import hexlify
+from collections import deque
 from errno import EACCES
 from io import BytesIO
 import os, sys, stat, time, math
 
-from bup import hashsplit, git, options, index, client, metadata, hlinkdb
+from bup import hashsplit, git, options, index, client, metadata, metrics
+from bup import hlinkdb
 from bup.compat import argv_bytes, environ
 from bup.hashsplit import GIT_MODE_TREE, GIT_MODE_FILE, GIT_MODE_SYMLINK
 from bup.helpers import (add_error, grafted_path_components, handle_ctrl_c,
@@ -40,6 +42,9 @@ strip      strips the path to every filename given
 strip-path= path-prefix to be stripped when saving
 graft=     a graft point *old_path*=*new_path* (can be used more than once)
 #,compress=  set compression level to # (0-9, 9 is highest) [1]
+auto-compress  choose the compression level for each file from its observed ratio
+meta-threads= number of threads collecting file metadata concurrently [0]
+stats=     dump performance statistics to stderr (format: json) at exit and on SIGUSR1
 """
 o = options.Options(optspec)
 (opt, flags, extra) = o.parse(sys.argv[1:])
@@ -53,6 +58,9 @@ if opt.remote:
 if opt.strip_path:
     opt.strip_path = argv_bytes(opt.strip_path)
 
+if opt.stats and not metrics.enable_stats(opt.stats):
+    o.fatal('unsupported --stats format %r' % opt.stats)
+
 git.check_repo_or_die()
 if not (opt.tree or opt.commit or opt.name):
     o.fatal("use one or more of -t, -c, -n")
@@ -63,6 +71,8 @@ extra = [argv_bytes(x) for x in extra]
 
 opt.progress = (istty2 and not opt.quiet)
 opt.smaller = parse_num(opt.smaller or 0)
+if opt.meta_threads < 0:
+    o.fatal('--meta-threads must not be negative')
 if opt.bwlimit:
     client.bwlimit = parse_num(opt.bwlimit)
 
@@ -109,11 +119,20 @@ if opt.remote or is_reverse:
         log('error: %s' % e)
         sys.exit(1)
     oldref = refname and cli.read_ref(refname) or None
-    w = cli.new_packwriter(compression_level=opt.compress)
+    w = cli.new_packwriter(compression_level=opt.compress,
+                           auto_compression=opt.auto_compress)
 else:
     cli = None
     oldref = refname and git.read_ref(refname) or None
-    w = git.PackWriter(compression_level=opt.compress)
+    w = git.PackWriter(compression_level=opt.compress,
+                       auto_compression=opt.auto_compress)
+
+try:
+    hashsplit.set_split_method(cli.config_get(b'bup.split.files') if cli
+                               else git.git_config_get(b'bup.split.files'))
+except ValueError as e:
+    log('error: bup.split.files: %s\n' % e)
+    sys.exit(1)
 
 handle_ctrl_c()
 
@@ -139,6 +158,33 @@ parts = [] # Current archive position (stack of dir names).
 shalists = [] # Hashes for each dir in paths.
 metalists = [] # Metadata for each dir in paths.
 
+# With --meta-threads, the metadata for saved files is collected by
+# the harvester, and a metalist item's metadata may be (get_meta,
+# path) until it's resolved.  That happens when the directory is
+# finished, or, as with bup index, once more than meta_window
+# submissions are outstanding, so the harvester's queue stays bounded.
+harvester = metadata.Harvester(opt.meta_threads)
+meta_window = 16 * opt.meta_threads
+pending_meta = deque()  # (metalist, index) for each outstanding item
+
+def _harvested(get_meta, path):
+    global lastskip_name
+    try:
+        return get_meta()
+    except (OSError, IOError) as e:
+        add_error(e)
+        lastskip_name = path
+        return None
+
+def _resolve_meta(metalist, i):
+    key, meta = metalist[i]
+    if isinstance(meta, tuple):
+        metalist[i] = (key, _harvested(*meta))
+
+def _finish_harvest(limit):
+    while len(pending_meta) > limit:
+        _resolve_meta(*pending_meta.popleft())
+
 
 def _push(part, metadata):
     # Enter a new archive directory -- make it the current directory.
@@ -154,14 +200,21 @@ def _pop(force_tree, dir_metadata=None):
     shalist = shalists.pop()
     metalist = metalists.pop()
     if metalist and not force_tree:
+        if opt.meta_threads:
+            # Resolve them in place, since pending_meta may refer to them.
+            for i in range(len(metalist)):
+                _resolve_meta(metalist, i)
         if dir_metadata: # Override the original metadata pushed for this dir.
             metalist = [(b'', dir_metadata)] + metalist[1:]
+        if opt.meta_threads:
+            metalist = [x for x in metalist if x[1]]
         sorted_metalist = sorted(metalist, key = lambda x : x[0])
         metadata = b''.join([m[1].encode() for m in sorted_metalist])
         metadata_f = BytesIO(metadata)
         mode, id = hashsplit.split_to_blob_or_tree(w.new_blob, w.new_tree,
                                                    [metadata_f],
-                                                   keep_boundaries=False)
+                                                   keep_boundaries=False,
+                                                   write_tree=w.new_encoded_tree)
         shalist.append((mode, b'.bupm', id))
     # FIXME: only test if collision is possible (i.e. given --strip, etc.)?
     if force_tree:
@@ -404,10 +457,13 @@ for (transname,ent) in r.filter(extra, wantrecurse=wantrecurse_during):
                 add_error(e)
                 lastskip_name = ent.name
             else:
+                w.compression.start_stream()
                 try:
-                    (mode, id) = hashsplit.split_to_blob_or_tree(
-                                            w.new_blob, w.new_tree, [f],
-                                            keep_boundaries=False)
+                    with metrics.timed('save.file'):
+                        (mode, id) = hashsplit.split_to_blob_or_tree(
+                                                w.new_blob, w.new_tree, [f],
+                                                keep_boundaries=False,
+                                                write_tree=w.new_encoded_tree)
                 except (IOError, OSError) as e:
                     add_error('%s: %s' % (ent.name, e))
                     lastskip_name = ent.name
@@ -436,14 +492,17 @@ for (transname,ent) in r.filter(extra, wantrecurse=wantrecurse_during):
             shalists[-1].append(git_info)
             sort_key = git.shalist_item_sort_key((ent.mode, file, id))
             hlink = find_hardlink_target(hlink_db, ent)
-            try:
-                meta = metadata.from_path(ent.name, hardlink_target=hlink,
-                                          normalized=True)
-            except (OSError, IOError) as e:
-                add_error(e)
-                lastskip_name = ent.name
+            harvest = (harvester.submit(ent.name, hardlink_target=hlink,
+                                        normalized=True),
+                       ent.name)
+            if opt.meta_threads:
+                metalists[-1].append((sort_key, harvest))
+                pending_meta.append((metalists[-1], len(metalists[-1]) - 1))
+                _finish_harvest(meta_window)
             else:
-                metalists[-1].append((sort_key, meta))
+                meta = _harvested(*harvest)
+                if meta:
+                    metalists[-1].append((sort_key, meta))
 
     if exists and wasmissing:
         count += oldsize
@@ -481,8 +540,11 @@ if opt.commit or name:
         out.write(hexlify(commit))
         out.write(b'\n')
 
+harvester.close()
 msr.close()
 w.close()  # must close before we can update the ref
+if opt.verbose:
+    log(w.compression.summary())
         
 if opt.name:
     if cli:
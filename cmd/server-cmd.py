@@ -9,11 +9,12 @@ from __future__ import absolute_import
 from binascii import hexlify, unhexlify
 import os, sys, struct, subprocess
 
-from bup import options, git, vfs, vint
+from bup import options, git, metrics, vfs, vint
 from bup.compat import environ, hexstr
 from bup.git import MissingObject
 from bup.helpers import (Conn, debug1, debug2, linereader, lines_until_sentinel,
                          log)
+from bup.inflight import Inflight
 from bup.io import byte_stream, path_msg
 from bup.repo import LocalRepo
 
@@ -21,6 +22,7 @@ from bup.repo import LocalRepo
 suspended_w = None
 dumb_server_mode = False
 repo = None
+inflight = None
 
 def do_help(conn, junk):
     conn.write(b'Commands:\n    %s\n' % b'\n    '.join(sorted(commands)))
@@ -35,7 +37,7 @@ def _set_mode():
 
 
 def _init_session(reinit_with_new_repopath=None):
-    global repo
+    global repo, inflight
     if reinit_with_new_repopath is None and git.repodir:
         if not repo:
             repo = LocalRepo()
@@ -43,6 +45,9 @@ def _init_session(reinit_with_new_repopath=None):
     git.check_repo_or_die(reinit_with_new_repopath)
     if repo:
         repo.close()
+    if inflight:
+        inflight.close()
+    inflight = None
     repo = LocalRepo()
     # OK. we now know the path is a proper repository. Record this path in the
     # environment so that subprocesses inherit it and know where to operate.
@@ -84,6 +89,20 @@ def send_index(conn, name):
     conn.ok()
 
 
+def _inflight():
+    """Return the repository's table of the objects that concurrent
+    sessions are writing, or None if it's not available."""
+    global inflight
+    if inflight is None:
+        try:
+            inflight = Inflight(git.repo(b'bup-inflight'))
+        except (IOError, OSError) as ex:
+            log('bup server: not sharing objects with other sessions: %s\n'
+                % ex)
+            inflight = False
+    return inflight or None
+
+
 def receive_objects_v2(conn, junk):
     global suspended_w
     _init_session()
@@ -95,7 +114,7 @@ def receive_objects_v2(conn, junk):
         if dumb_server_mode:
             w = git.PackWriter(objcache_maker=None)
         else:
-            w = git.PackWriter()
+            w = git.PackWriter(inflight=_inflight())
     while 1:
         ns = conn.read(4)
         if not ns:
@@ -138,6 +157,8 @@ def receive_objects_v2(conn, junk):
                     conn.write(b'index %s\n' % name)
                     suggested.add(name)
                 continue
+            if w.borrow_inflight(shar, buf):
+                continue
         nw, crc = w._raw_write((buf,), sha=shar)
         _check(w, crcr, crc, 'object read: expected crc %d, got %d\n')
     # NOTREACHED
@@ -156,6 +177,19 @@ def read_ref(conn, refname):
     conn.ok()
 
 
+def config_get(conn, name):
+    _init_session()
+    # Only reveal bup's own settings; anything else reads as unset,
+    # rather than ending the session.
+    if name.startswith(b'bup.'):
+        r = git.git_config_get(name)
+    else:
+        debug1('bup server: config-get %r is not a bup setting\n' % name)
+        r = None
+    conn.write(b'%s\n' % r.strip() if r else b'')
+    conn.ok()
+
+
 def update_ref(conn, refname):
     _init_session()
     newval = conn.readline().strip()
@@ -181,14 +215,12 @@ def cat_batch(conn, dummy):
     _init_session()
     cat_pipe = git.cp()
     # For now, avoid potential deadlock by just reading them all
-    for ref in tuple(lines_until_sentinel(conn, b'\n', Exception)):
-        ref = ref[:-1]
-        it = cat_pipe.get(ref)
-        info = next(it)
-        if not info[0]:
+    refs = tuple(x[:-1] for x in lines_until_sentinel(conn, b'\n', Exception))
+    for oidx, typ, size, it in cat_pipe.get_many(refs):
+        if not oidx:
             conn.write(b'missing\n')
             continue
-        conn.write(b'%s %s %d\n' % info)
+        conn.write(b'%s %s %d\n' % (oidx, typ, size))
         for buf in it:
             conn.write(buf)
     conn.ok()
@@ -263,12 +295,16 @@ def resolve(conn, args):
 
 optspec = """
 bup server
+--
+stats=  dump performance statistics to stderr (format: json) at exit and on SIGUSR1
 """
 o = options.Options(optspec)
 (opt, flags, extra) = o.parse(sys.argv[1:])
 
 if extra:
     o.fatal('no arguments expected')
+if opt.stats and not metrics.enable_stats(opt.stats):
+    o.fatal('unsupported --stats format %r' % opt.stats)
 
 debug2('bup server: reading from stdin.\n')
 
@@ -281,6 +317,7 @@ commands = {
     b'send-index': send_index,
     b'receive-objects-v2': receive_objects_v2,
     b'read-ref': read_ref,
+    b'config-get': config_get,
     b'update-ref': update_ref,
     b'join': join,
     b'cat': join,  # apocryphal alias
@@ -306,10 +343,15 @@ for _line in lr:
     if cmd == b'quit':
         break
     else:
+        name = cmd
         cmd = commands.get(cmd)
         if cmd:
-            cmd(conn, rest)
+            with metrics.timed('server.' + name.decode('ascii')):
+                cmd(conn, rest)
         else:
             raise Exception('unknown server command: %r\n' % line)
 
+if inflight:
+    inflight.close()
+
 debug1('bup server: done\n')
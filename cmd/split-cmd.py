@@ -125,24 +125,21 @@ else:
                                  max_pack_size=max_pack_size,
                                  max_pack_objects=max_pack_objects)
 
+if pack_writer:
+    try:
+        hashsplit.set_split_method(
+            cli.config_get(b'bup.split.files') if cli
+            else git.git_config_get(b'bup.split.files'))
+    except ValueError as e:
+        log('error: bup.split.files: %s\n' % e)
+        sys.exit(1)
+
 input = byte_stream(sys.stdin)
 
 if opt.git_ids:
     # the input is actually a series of git object ids that we should retrieve
     # and split.
-    #
-    # This is a bit messy, but basically it converts from a series of
-    # CatPipe.get() iterators into a series of file-type objects.
-    # It would be less ugly if either CatPipe.get() returned a file-like object
-    # (not very efficient), or split_to_shalist() expected an iterator instead
-    # of a file.
     cp = git.CatPipe()
-    class IterToFile:
-        def __init__(self, it):
-            self.it = iter(it)
-        def read(self, size):
-            v = next(self.it, None)
-            return v or b''
     def read_ids():
         while 1:
             line = input.readline()
@@ -156,7 +153,7 @@ if opt.git_ids:
             except KeyError as e:
                 add_error('error: %s' % e)
                 continue
-            yield IterToFile(it)
+            yield hashsplit.IterReader(it)
     files = read_ids()
 else:
     # the input either comes from a series of files or from stdin.
@@ -165,10 +162,12 @@ else:
 if pack_writer:
     new_blob = pack_writer.new_blob
     new_tree = pack_writer.new_tree
+    write_tree = pack_writer.new_encoded_tree
 elif opt.blobs or opt.tree:
     # --noop mode
     new_blob = lambda content: git.calc_hash(b'blob', content)
     new_tree = lambda shalist: git.calc_hash(b'tree', git.tree_encode(shalist))
+    write_tree = lambda content: git.calc_hash(b'tree', content)
 
 sys.stdout.flush()
 out = byte_stream(sys.stdout)
@@ -185,13 +184,15 @@ elif opt.tree or opt.commit or opt.name:
         mode, sha = \
             hashsplit.split_to_blob_or_tree(new_blob, new_tree, files,
                                             keep_boundaries=opt.keep_boundaries,
-                                            progress=prog)
+                                            progress=prog,
+                                            write_tree=write_tree)
         splitfile_name = git.mangle_name(b'data', hashsplit.GIT_MODE_FILE, mode)
         shalist = [(mode, splitfile_name, sha)]
     else:
         shalist = hashsplit.split_to_shalist(
                       new_blob, new_tree, files,
-                      keep_boundaries=opt.keep_boundaries, progress=prog)
+                      keep_boundaries=opt.keep_boundaries, progress=prog,
+                      write_tree=write_tree)
     tree = new_tree(shalist)
 else:
     last = 0
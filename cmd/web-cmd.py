@@ -6,8 +6,10 @@ exec "$bup_python" "$0" ${1+"$@"}
 # end of bup preamble
 
 from __future__ import absolute_import, print_function
+from calendar import timegm
 from collections import namedtuple
-import mimetypes, os, posixpath, signal, stat, sys, time, urllib, webbrowser
+from email.utils import parsedate
+import mimetypes, os, posixpath, re, signal, stat, sys, time, urllib, webbrowser
 
 from bup import options, git, vfs
 from bup.helpers import (chunkyreader, debug1, format_filesize, handle_ctrl_c,
@@ -20,6 +22,7 @@ try:
     from tornado import gen
     from tornado.httpserver import HTTPServer
     from tornado.ioloop import IOLoop
+    from tornado.iostream import StreamClosedError
     from tornado.netutil import bind_unix_socket
     import tornado.web
 except ImportError:
@@ -34,7 +37,56 @@ handle_ctrl_c()
 
 
 def http_date_from_utc_ns(utc_ns):
-    return time.strftime('%a, %d %b %Y %H:%M:%S', time.gmtime(utc_ns / 10**9))
+    return time.strftime('%a, %d %b %Y %H:%M:%S GMT',
+                         time.gmtime(utc_ns / 10**9))
+
+
+def _utc_secs_from_http_date(date):
+    """Return the seconds since the epoch for the HTTP date, or None if
+    it can't be parsed."""
+    t = parsedate(date)
+    return timegm(t) if t else None
+
+
+_byte_range_rx = re.compile(r'^bytes=\s*(\d*)\s*-\s*(\d*)\s*$')
+
+def _parse_range(header, size):
+    """Return the (start, end) (end exclusive) byte range requested by
+    the HTTP Range header for a file of the given size, None if the
+    header should be ignored (it's invalid, or asks for more than one
+    range), or False if the range is unsatisfiable."""
+    m = _byte_range_rx.match(header)
+    if not m:
+        return None
+    first, last = m.groups()
+    if not first:
+        if not last:
+            return None
+        # Suffix range: the last N bytes.
+        n = int(last)
+        if not n or not size:
+            return False
+        return max(0, size - n), size
+    start = int(first)
+    if last and int(last) < start:
+        return None
+    if start >= size:
+        return False
+    return start, min(int(last) + 1, size) if last else size
+
+
+def _etag_matches(header, etag):
+    """Return true if the If-None-Match header includes etag (a quoted
+    entity tag), ignoring any weak indicators."""
+    if header.strip() == '*':
+        return True
+    for tag in header.split(','):
+        tag = tag.strip()
+        if tag.startswith('W/'):
+            tag = tag[2:]
+        if tag == etag:
+            return True
+    return False
 
 
 def _compute_breadcrumbs(path, show_hidden=False):
@@ -140,7 +192,9 @@ class BupRequestHandler(tornado.web.RequestHandler):
         if stat.S_ISDIR(mode):
             self._list_directory(path, res)
         else:
-            self._get_file(self.repo, path, res)
+            # Return the future so the request isn't finished until
+            # the whole file has been sent.
+            return self._get_file(self.repo, path, res)
 
     def _list_directory(self, path, resolution):
         """Helper to produce a directory listing.
@@ -167,6 +221,32 @@ class BupRequestHandler(tornado.web.RequestHandler):
             dir_contents=_dir_contents(self.repo, resolution,
                                        show_hidden=show_hidden))
 
+    # How much to hand to tornado before waiting for it to be sent.
+    write_window = 1024 * 1024
+
+    def _not_modified(self, etag, mtime_secs):
+        """Return true if the request's conditional headers indicate
+        that the client already has the current content."""
+        headers = self.request.headers
+        if 'If-None-Match' in headers:
+            return _etag_matches(headers['If-None-Match'], etag)
+        if 'If-Modified-Since' in headers:
+            since = _utc_secs_from_http_date(headers['If-Modified-Since'])
+            return since is not None and mtime_secs <= since
+        return False
+
+    def _requested_range(self, etag, last_modified, size):
+        """Return the requested range as per _parse_range(), taking
+        If-Range into account."""
+        headers = self.request.headers
+        if 'Range' not in headers:
+            return None
+        # If-Range requires an exact (strong) match.
+        if_range = headers.get('If-Range', '').strip()
+        if if_range and if_range not in (etag, last_modified):
+            return None
+        return _parse_range(headers['Range'], size)
+
     @gen.coroutine
     def _get_file(self, repo, path, resolved):
         """Process a request on a file.
@@ -178,17 +258,48 @@ class BupRequestHandler(tornado.web.RequestHandler):
         file_item = vfs.augment_item_meta(repo, file_item, include_size=True)
         meta = file_item.meta
         ctype = self._guess_type(path)
-        self.set_header("Last-Modified", http_date_from_utc_ns(meta.mtime))
-        self.set_header("Content-Type", ctype)
-        
-        self.set_header("Content-Length", str(meta.size))
         assert len(file_item.oid) == 20
-        self.set_header("Etag", file_item.oid.encode('hex'))
-        if self.request.method != 'HEAD':
+        # The oid identifies the content, so it's a strong validator.
+        etag = '"%s"' % file_item.oid.encode('hex')
+        last_modified = http_date_from_utc_ns(meta.mtime)
+        self.set_header("Last-Modified", last_modified)
+        self.set_header("Etag", etag)
+        self.set_header("Accept-Ranges", "bytes")
+        if self._not_modified(etag, meta.mtime // 10**9):
+            self.set_status(304)
+            raise gen.Return()
+
+        size = meta.size
+        start, end = 0, size
+        byte_range = self._requested_range(etag, last_modified, size)
+        if byte_range is False:
+            self.set_status(416)
+            self.set_header("Content-Range", "bytes */%d" % size)
+            raise gen.Return()
+        if byte_range:
+            start, end = byte_range
+            self.set_status(206)
+            self.set_header("Content-Range",
+                            "bytes %d-%d/%d" % (start, end - 1, size))
+        self.set_header("Content-Type", ctype)
+        self.set_header("Content-Length", str(end - start))
+        if self.request.method != 'HEAD' and end > start:
             with vfs.fopen(self.repo, file_item) as f:
-                it = chunkyreader(f)
-                for blob in chunkyreader(f):
+                f.seek(start)
+                pending = 0
+                for blob in chunkyreader(f, end - start):
                     self.write(blob)
+                    pending += len(blob)
+                    if pending >= self.write_window:
+                        # Don't queue more than write_window bytes
+                        # ahead of the client.
+                        pending = 0
+                        try:
+                            yield self.flush()
+                        except StreamClosedError:
+                            debug1('bup-web: client for %s went away\n'
+                                   % path)
+                            raise gen.Return()
         raise gen.Return()
 
     def _guess_type(self, path):
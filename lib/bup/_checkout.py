@@ -0,0 +1,3 @@
+COMMIT='68c071204b287840cb0424ca1d67297702c3677f'
+NAMES='(tag: 68c0712)'
+DATE='2026-10-19 05:06:10 +0000'
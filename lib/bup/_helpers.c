@@ -74,6 +74,7 @@ typedef struct {
 // cstr_argf: for byte vectors without null characters (e.g. paths)
 // rbuf_argf: for read-only byte vectors
 // wbuf_argf: for mutable byte vectors
+// rbufobj_argf: for read-only byte vectors via a Py_buffer (e.g. memoryviews)
 
 #if PY_MAJOR_VERSION < 3
 static state_t state;
@@ -81,11 +82,13 @@ static state_t state;
 #  define cstr_argf "s"
 #  define rbuf_argf "s#"
 #  define wbuf_argf "s*"
+#  define rbufobj_argf "s*"
 #else
 #  define get_state(x) ((state_t *) PyModule_GetState(x))
 #  define cstr_argf "y"
 #  define rbuf_argf "y#"
 #  define wbuf_argf "y*"
+#  define rbufobj_argf "y*"
 #endif // PY_MAJOR_VERSION >= 3
 
 
@@ -275,42 +278,48 @@ static PyObject *bup_bytescmp(PyObject *self, PyObject *args)
 
 static PyObject *bup_cat_bytes(PyObject *self, PyObject *args)
 {
-    unsigned char *bufx = NULL, *bufy = NULL;
+    unsigned char *bufx = NULL;
     Py_ssize_t bufx_len, bufx_ofs, bufx_n;
-    Py_ssize_t bufy_len, bufy_ofs, bufy_n;
+    Py_buffer bufy;  // Could be a (reused) bytearray, cf. hashsplit.Buf
+    Py_ssize_t bufy_ofs, bufy_n;
     if (!PyArg_ParseTuple(args,
                           rbuf_argf "nn"
-                          rbuf_argf "nn",
+                          rbufobj_argf "nn",
                           &bufx, &bufx_len, &bufx_ofs, &bufx_n,
-                          &bufy, &bufy_len, &bufy_ofs, &bufy_n))
+                          &bufy, &bufy_ofs, &bufy_n))
 	return NULL;
+
+    PyObject *result = NULL;
+    const Py_ssize_t bufy_len = bufy.len;
     if (bufx_ofs < 0)
-        return PyErr_Format(PyExc_ValueError, "negative x offset");
-    if (bufx_n < 0)
-        return PyErr_Format(PyExc_ValueError, "negative x extent");
-    if (bufx_ofs > bufx_len)
-        return PyErr_Format(PyExc_ValueError, "x offset greater than length");
-    if (bufx_n > bufx_len - bufx_ofs)
-        return PyErr_Format(PyExc_ValueError, "x extent past end of buffer");
-
-    if (bufy_ofs < 0)
-        return PyErr_Format(PyExc_ValueError, "negative y offset");
-    if (bufy_n < 0)
-        return PyErr_Format(PyExc_ValueError, "negative y extent");
-    if (bufy_ofs > bufy_len)
-        return PyErr_Format(PyExc_ValueError, "y offset greater than length");
-    if (bufy_n > bufy_len - bufy_ofs)
-        return PyErr_Format(PyExc_ValueError, "y extent past end of buffer");
-
-    if (bufy_n > PY_SSIZE_T_MAX - bufx_n)
-        return PyErr_Format(PyExc_OverflowError, "result length too long");
-
-    PyObject *result = PyBytes_FromStringAndSize(NULL, bufx_n + bufy_n);
-    if (!result)
-        return PyErr_NoMemory();
-    char *buf = PyBytes_AS_STRING(result);
-    memcpy(buf, bufx + bufx_ofs, bufx_n);
-    memcpy(buf + bufx_n, bufy + bufy_ofs, bufy_n);
+        PyErr_Format(PyExc_ValueError, "negative x offset");
+    else if (bufx_n < 0)
+        PyErr_Format(PyExc_ValueError, "negative x extent");
+    else if (bufx_ofs > bufx_len)
+        PyErr_Format(PyExc_ValueError, "x offset greater than length");
+    else if (bufx_n > bufx_len - bufx_ofs)
+        PyErr_Format(PyExc_ValueError, "x extent past end of buffer");
+    else if (bufy_ofs < 0)
+        PyErr_Format(PyExc_ValueError, "negative y offset");
+    else if (bufy_n < 0)
+        PyErr_Format(PyExc_ValueError, "negative y extent");
+    else if (bufy_ofs > bufy_len)
+        PyErr_Format(PyExc_ValueError, "y offset greater than length");
+    else if (bufy_n > bufy_len - bufy_ofs)
+        PyErr_Format(PyExc_ValueError, "y extent past end of buffer");
+    else if (bufy_n > PY_SSIZE_T_MAX - bufx_n)
+        PyErr_Format(PyExc_OverflowError, "result length too long");
+    else
+    {
+        result = PyBytes_FromStringAndSize(NULL, bufx_n + bufy_n);
+        if (result)
+        {
+            char *buf = PyBytes_AS_STRING(result);
+            memcpy(buf, bufx + bufx_ofs, bufx_n);
+            memcpy(buf + bufx_n, (char *) bufy.buf + bufy_ofs, bufy_n);
+        }
+    }
+    PyBuffer_Release(&bufy);
     return result;
 }
 
@@ -429,12 +438,33 @@ static PyObject *record_sparse_zeros(unsigned long long *new_pending,
 }
 
 
+// The zero scans below examine a word (or four) at a time, and only
+// fall back to bytes near the edges of a run.  Loading via memcpy
+// avoids alignment and aliasing trouble, and compiles to plain loads.
+
+typedef size_t zword;
+
+static inline zword load_zword(const byte * const p)
+{
+    zword w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+
 static byte* find_not_zero(const byte * const start, const byte * const end)
 {
     // Return a pointer to first non-zero byte between start and end,
     // or end if there isn't one.
     assert(start <= end);
-    const unsigned char *cur = start;
+    const ptrdiff_t w = sizeof(zword);
+    const byte *cur = start;
+    while (end - cur >= 4 * w
+           && (load_zword(cur) | load_zword(cur + w)
+               | load_zword(cur + 2 * w) | load_zword(cur + 3 * w)) == 0)
+        cur += 4 * w;
+    while (end - cur >= w && load_zword(cur) == 0)
+        cur += w;
     while (cur < end && *cur == 0)
         cur++;
     return (byte *) cur;
@@ -447,14 +477,17 @@ static byte* find_trailing_zeros(const byte * const start,
     // Return a pointer to the start of any trailing run of zeros, or
     // end if there isn't one.
     assert(start <= end);
-    if (start == end)
-        return (byte *) end;
-    const byte * cur = end;
-    while (cur > start && *--cur == 0) {}
-    if (*cur == 0)
-        return (byte *) cur;
-    else
-        return (byte *) (cur + 1);
+    const ptrdiff_t w = sizeof(zword);
+    const byte *cur = end;
+    while (cur - start >= 4 * w
+           && (load_zword(cur - w) | load_zword(cur - 2 * w)
+               | load_zword(cur - 3 * w) | load_zword(cur - 4 * w)) == 0)
+        cur -= 4 * w;
+    while (cur - start >= w && load_zword(cur - w) == 0)
+        cur -= w;
+    while (cur > start && *(cur - 1) == 0)
+        cur--;
+    return (byte *) cur;
 }
 
 
@@ -597,6 +630,28 @@ static PyObject *bup_write_sparsely(PyObject *self, PyObject *args)
 }
 
 
+static PyObject *leading_zeros(PyObject *self, PyObject *args)
+{
+    // Accept the same buffer types as splitbuf(), since hashsplit
+    // passes us the same views.
+    const byte *start = NULL;
+    Py_ssize_t len = 0;
+    if (PY_MAJOR_VERSION > 2)
+    {
+        Py_buffer buf;
+        if (!PyArg_ParseTuple(args, "y*", &buf))
+            return NULL;
+        start = buf.buf;
+        len = find_not_zero(start, start + buf.len) - start;
+        PyBuffer_Release(&buf);
+        return PyLong_FromSsize_t(len);
+    }
+    if (!PyArg_ParseTuple(args, "t#", &start, &len))
+        return NULL;
+    return PyLong_FromSsize_t(find_not_zero(start, start + len) - start);
+}
+
+
 static PyObject *selftest(PyObject *self, PyObject *args)
 {
     if (!PyArg_ParseTuple(args, ""))
@@ -614,7 +669,8 @@ static PyObject *blobbits(PyObject *self, PyObject *args)
 }
 
 
-static PyObject *splitbuf(PyObject *self, PyObject *args)
+static PyObject *split_with(PyObject *args,
+                            int (*find_ofs)(const unsigned char *, int, int *))
 {
     // We stick to buffers in python 2 because they appear to be
     // substantially smaller than memoryviews, and because
@@ -627,7 +683,7 @@ static PyObject *splitbuf(PyObject *self, PyObject *args)
         if (!PyArg_ParseTuple(args, "y*", &buf))
             return NULL;
         assert(buf.len <= INT_MAX);
-        out = bupsplit_find_ofs(buf.buf, buf.len, &bits);
+        out = find_ofs(buf.buf, buf.len, &bits);
         PyBuffer_Release(&buf);
     }
     else
@@ -637,13 +693,25 @@ static PyObject *splitbuf(PyObject *self, PyObject *args)
         if (!PyArg_ParseTuple(args, "t#", &buf, &len))
             return NULL;
         assert(len <= INT_MAX);
-        out = bupsplit_find_ofs(buf, len, &bits);
+        out = find_ofs(buf, len, &bits);
     }
     if (out) assert(bits >= BUP_BLOBBITS);
     return Py_BuildValue("ii", out, bits);
 }
 
 
+static PyObject *splitbuf(PyObject *self, PyObject *args)
+{
+    return split_with(args, bupsplit_find_ofs);
+}
+
+
+static PyObject *gear_splitbuf(PyObject *self, PyObject *args)
+{
+    return split_with(args, bupsplit_gear_find_ofs);
+}
+
+
 static PyObject *bitmatch(PyObject *self, PyObject *args)
 {
     unsigned char *buf1 = NULL, *buf2 = NULL;
@@ -721,13 +789,20 @@ static void to_bloom_address_bitmask5(const unsigned char *buf,
     *bitmask = 1 << bit;
 }
 
+// Since bloom_add() releases the GIL, several threads may be adding
+// to the same filter at once, in which case the bits must be set
+// atomically (which is noticeably slower).
 #define BLOOM_SET_BIT(name, address, otype) \
-static void name(unsigned char *bloom, const unsigned char *buf, const int nbits)\
+static void name(unsigned char *bloom, const unsigned char *buf, const int nbits,\
+                 const int atomic)\
 {\
     unsigned char bitmask;\
     otype v;\
     address(buf, nbits, &v, &bitmask);\
-    bloom[BLOOM2_HEADERLEN+v] |= bitmask;\
+    if (atomic)\
+        __atomic_fetch_or(&bloom[BLOOM2_HEADERLEN+v], bitmask, __ATOMIC_RELAXED);\
+    else\
+        bloom[BLOOM2_HEADERLEN+v] |= bitmask;\
 }
 BLOOM_SET_BIT(bloom_set_bit4, to_bloom_address_bitmask4, uint64_t)
 BLOOM_SET_BIT(bloom_set_bit5, to_bloom_address_bitmask5, uint32_t)
@@ -748,9 +823,9 @@ BLOOM_GET_BIT(bloom_get_bit5, to_bloom_address_bitmask5, uint32_t)
 static PyObject *bloom_add(PyObject *self, PyObject *args)
 {
     Py_buffer bloom, sha;
-    int nbits = 0, k = 0;
-    if (!PyArg_ParseTuple(args, wbuf_argf wbuf_argf "ii",
-                          &bloom, &sha, &nbits, &k))
+    int nbits = 0, k = 0, atomic = 0;
+    if (!PyArg_ParseTuple(args, wbuf_argf wbuf_argf "ii|i",
+                          &bloom, &sha, &nbits, &k, &atomic))
         return NULL;
 
     PyObject *result = NULL;
@@ -764,8 +839,10 @@ static PyObject *bloom_add(PyObject *self, PyObject *args)
             goto clean_and_return;
         unsigned char *cur = sha.buf;
         unsigned char *end;
+        Py_BEGIN_ALLOW_THREADS
         for (end = cur + sha.len; cur < end; cur += 20/k)
-            bloom_set_bit5(bloom.buf, cur, nbits);
+            bloom_set_bit5(bloom.buf, cur, nbits, atomic);
+        Py_END_ALLOW_THREADS
     }
     else if (k == 4)
     {
@@ -773,8 +850,10 @@ static PyObject *bloom_add(PyObject *self, PyObject *args)
             goto clean_and_return;
         unsigned char *cur = sha.buf;
         unsigned char *end = cur + sha.len;
+        Py_BEGIN_ALLOW_THREADS
         for (; cur < end; cur += 20/k)
-            bloom_set_bit4(bloom.buf, cur, nbits);
+            bloom_set_bit4(bloom.buf, cur, nbits, atomic);
+        Py_END_ALLOW_THREADS
     }
     else
         goto clean_and_return;
@@ -839,6 +918,340 @@ static PyObject *bloom_contains(PyObject *self, PyObject *args)
 }
 
 
+static PyObject *bloom_contains_many(PyObject *self, PyObject *args)
+{
+    Py_buffer bloom, shas;
+    int nbits = 0, k = 0;
+    if (!PyArg_ParseTuple(args, wbuf_argf rbufobj_argf "ii",
+                          &bloom, &shas, &nbits, &k))
+        return NULL;
+
+    PyObject *result = NULL;
+
+    if (shas.len % 20 != 0 || (k != 4 && k != 5)
+        || (k == 5 && nbits > 29) || (k == 4 && nbits > 37))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid bloom parameters");
+        goto clean_and_return;
+    }
+
+    const Py_ssize_t n = shas.len / 20;
+    result = PyByteArray_FromStringAndSize(NULL, n);
+    if (!result)
+        goto clean_and_return;
+    char *found = PyByteArray_AS_STRING(result);
+    const unsigned char *sha = shas.buf;
+    Py_ssize_t i;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n; i++, sha += 20)
+    {
+        const unsigned char *cur, *end = sha + 20;
+        found[i] = 1;
+        for (cur = sha; cur < end; cur += 20/k)
+            if (k == 5 ? !bloom_get_bit5(bloom.buf, cur, nbits)
+                : !bloom_get_bit4(bloom.buf, cur, nbits))
+            {
+                found[i] = 0;
+                break;
+            }
+    }
+    Py_END_ALLOW_THREADS
+
+ clean_and_return:
+    PyBuffer_Release(&bloom);
+    PyBuffer_Release(&shas);
+    return result;
+}
+
+
+// A git pack .idx (or similar) table: a big-endian 256 entry fanout
+// table, and the sorted 20-byte hashes, stride bytes apart.
+struct idx_table {
+    const unsigned char *map;
+    Py_ssize_t fanout_ofs;
+    Py_ssize_t sha_ofs;
+    int stride;
+    uint32_t nsha;
+};
+
+static uint32_t _idx_fanout(const struct idx_table *t, int i)
+{
+    uint32_t v;
+    if (i < 0)
+        return 0;
+    memcpy(&v, t->map + t->fanout_ofs + i * 4, 4);
+    return ntohl(v);
+}
+
+static int _init_idx_table(struct idx_table *t, const Py_buffer *map,
+                           Py_ssize_t fanout_ofs, Py_ssize_t sha_ofs,
+                           int stride)
+{
+    if (fanout_ofs < 0 || sha_ofs < 0 || stride < 20
+        || fanout_ofs > map->len - 256 * 4)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid idx table layout");
+        return 0;
+    }
+    t->map = map->buf;
+    t->fanout_ofs = fanout_ofs;
+    t->sha_ofs = sha_ofs;
+    t->stride = stride;
+    t->nsha = _idx_fanout(t, 255);
+    if (sha_ofs > map->len
+        || t->nsha > (map->len - sha_ofs) / stride)
+    {
+        PyErr_SetString(PyExc_ValueError, "idx table extends past the end");
+        return 0;
+    }
+    return 1;
+}
+
+// Return the index of sha in t, or -1, and add the number of binary
+// search steps (including the fanout lookup) to *steps.
+static Py_ssize_t _idx_search(const struct idx_table *t,
+                              const unsigned char *sha, long *steps)
+{
+    uint32_t start = _idx_fanout(t, sha[0] - 1);
+    uint32_t end = _idx_fanout(t, sha[0]);
+    if (end > t->nsha)
+        end = t->nsha;
+    ++*steps;
+    while (start < end)
+    {
+        ++*steps;
+        const uint32_t mid = start + (end - start) / 2;
+        const int c = memcmp(t->map + t->sha_ofs + (Py_ssize_t) mid * t->stride,
+                             sha, 20);
+        if (c < 0)
+            start = mid + 1;
+        else if (c > 0)
+            end = mid;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+static PyObject *idx_find(PyObject *self, PyObject *args)
+{
+    Py_buffer map;
+    Py_ssize_t fanout_ofs, sha_ofs;
+    int stride;
+    unsigned char *sha = NULL;
+    Py_ssize_t len = 0;
+    if (!PyArg_ParseTuple(args, rbufobj_argf "nni" rbuf_argf,
+                          &map, &fanout_ofs, &sha_ofs, &stride, &sha, &len))
+        return NULL;
+
+    PyObject *result = NULL;
+    struct idx_table t;
+    if (!_init_idx_table(&t, &map, fanout_ofs, sha_ofs, stride))
+        goto clean_and_return;
+    if (len != 20)
+    {
+        PyErr_SetString(PyExc_ValueError, "hash must be 20 bytes");
+        goto clean_and_return;
+    }
+    long steps = 0;
+    const Py_ssize_t i = _idx_search(&t, sha, &steps);
+    if (i < 0)
+        result = Py_BuildValue("Ol", Py_None, steps);
+    else
+        result = Py_BuildValue("nl", i, steps);
+
+ clean_and_return:
+    PyBuffer_Release(&map);
+    return result;
+}
+
+static PyObject *idx_find_many(PyObject *self, PyObject *args)
+{
+    Py_buffer map, shas;
+    Py_ssize_t fanout_ofs, sha_ofs;
+    int stride;
+    if (!PyArg_ParseTuple(args, rbufobj_argf "nni" rbufobj_argf,
+                          &map, &fanout_ofs, &sha_ofs, &stride, &shas))
+        return NULL;
+
+    PyObject *result = NULL, *indexes = NULL;
+    struct idx_table t;
+    if (!_init_idx_table(&t, &map, fanout_ofs, sha_ofs, stride))
+        goto clean_and_return;
+    if (shas.len % 20 != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "hashes must be 20 bytes each");
+        goto clean_and_return;
+    }
+    const Py_ssize_t n = shas.len / 20;
+    indexes = PyList_New(n);
+    if (!indexes)
+        goto clean_and_return;
+    long steps = 0;
+    Py_ssize_t i;
+    for (i = 0; i < n; i++)
+    {
+        const Py_ssize_t found =
+            _idx_search(&t, (unsigned char *) shas.buf + i * 20, &steps);
+        PyObject *x;
+        if (found < 0)
+        {
+            x = Py_None;
+            Py_INCREF(x);
+        }
+        else
+        {
+            x = PyLong_FromSsize_t(found);
+            if (!x)
+                goto clean_and_return;
+        }
+        PyList_SET_ITEM(indexes, i, x);
+    }
+    result = Py_BuildValue("Ol", indexes, steps);
+
+ clean_and_return:
+    Py_XDECREF(indexes);
+    PyBuffer_Release(&map);
+    PyBuffer_Release(&shas);
+    return result;
+}
+
+static PyObject *idx_shas(PyObject *self, PyObject *args)
+{
+    Py_buffer map;
+    Py_ssize_t sha_ofs, n;
+    int stride;
+    if (!PyArg_ParseTuple(args, rbufobj_argf "nin",
+                          &map, &sha_ofs, &stride, &n))
+        return NULL;
+
+    PyObject *result = NULL;
+    if (sha_ofs < 0 || stride < 20 || n < 0 || sha_ofs > map.len
+        || n > (map.len - sha_ofs) / stride)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid idx table layout");
+        goto clean_and_return;
+    }
+    result = PyBytes_FromStringAndSize(NULL, n * 20);
+    if (!result)
+        goto clean_and_return;
+    unsigned char *dest = (unsigned char *) PyBytes_AS_STRING(result);
+    const unsigned char *src = (unsigned char *) map.buf + sha_ofs;
+    Py_ssize_t i;
+    for (i = 0; i < n; i++, dest += 20, src += stride)
+        memcpy(dest, src, 20);
+
+ clean_and_return:
+    PyBuffer_Release(&map);
+    return result;
+}
+
+
+// The inflight table (cf. bup.inflight) is a header followed by an
+// append-only array of (sha, tag) records.  Writers reserve a record
+// by atomically incrementing the header's next counter, and publish
+// it by storing its nonzero tag last, so readers never need a lock.
+#define INFLIGHT_HEADERLEN 64
+#define INFLIGHT_CAPACITY_OFS 12
+#define INFLIGHT_NEXT_OFS 24
+#define INFLIGHT_RECLEN 24
+
+static int _inflight_capacity(Py_buffer *map, uint64_t *capacity)
+{
+    uint32_t cap;
+    if (map->len < INFLIGHT_HEADERLEN || ((uintptr_t) map->buf) % 8 != 0)
+        return 0;
+    memcpy(&cap, (unsigned char *) map->buf + INFLIGHT_CAPACITY_OFS, 4);
+    if ((map->len - INFLIGHT_HEADERLEN) / INFLIGHT_RECLEN < cap)
+        return 0;
+    *capacity = cap;
+    return 1;
+}
+
+static PyObject *inflight_append(PyObject *self, PyObject *args)
+{
+    Py_buffer map;
+    unsigned char *sha = NULL;
+    Py_ssize_t len = 0;
+    unsigned int tag;
+    if (!PyArg_ParseTuple(args, wbuf_argf rbuf_argf "I",
+                          &map, &sha, &len, &tag))
+        return NULL;
+
+    PyObject *result = NULL;
+    uint64_t capacity;
+    if (len != 20 || !tag || !_inflight_capacity(&map, &capacity))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid inflight append");
+        goto clean_and_return;
+    }
+    unsigned char *base = map.buf;
+    uint64_t i = __atomic_fetch_add((uint64_t *) (base + INFLIGHT_NEXT_OFS),
+                                    1, __ATOMIC_RELAXED);
+    if (i >= capacity)
+    {
+        result = Py_None;
+        Py_INCREF(result);
+        goto clean_and_return;
+    }
+    unsigned char *rec = base + INFLIGHT_HEADERLEN + i * INFLIGHT_RECLEN;
+    memcpy(rec, sha, 20);
+    __atomic_store_n((uint32_t *) (rec + 20), (uint32_t) tag, __ATOMIC_RELEASE);
+    result = PyLong_FromUnsignedLongLong(i);
+
+ clean_and_return:
+    PyBuffer_Release(&map);
+    return result;
+}
+
+static PyObject *inflight_scan(PyObject *self, PyObject *args)
+{
+    Py_buffer map;
+    unsigned long long start;
+    unsigned int skip_tag;
+    if (!PyArg_ParseTuple(args, wbuf_argf "KI", &map, &start, &skip_tag))
+        return NULL;
+
+    PyObject *result = NULL;
+    unsigned char *shas = NULL;
+    uint64_t capacity;
+    if (!_inflight_capacity(&map, &capacity))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid inflight table");
+        goto clean_and_return;
+    }
+    unsigned char *base = map.buf;
+    uint64_t end = __atomic_load_n((uint64_t *) (base + INFLIGHT_NEXT_OFS),
+                                   __ATOMIC_ACQUIRE);
+    if (end > capacity)
+        end = capacity;
+    if (start > end)
+        start = end;
+    shas = checked_malloc(end - start ? end - start : 1, 20);
+    if (!shas)
+        goto clean_and_return;
+    uint64_t pos;
+    Py_ssize_t n = 0;
+    for (pos = start; pos < end; pos++)
+    {
+        unsigned char *rec = base + INFLIGHT_HEADERLEN + pos * INFLIGHT_RECLEN;
+        uint32_t tag = __atomic_load_n((uint32_t *) (rec + 20),
+                                       __ATOMIC_ACQUIRE);
+        if (!tag)  // Reserved, but not published yet
+            break;
+        if (tag != skip_tag)
+            memcpy(shas + 20 * n++, rec, 20);
+    }
+    result = Py_BuildValue(rbuf_argf "K", shas, n * 20,
+                           (unsigned long long) pos);
+
+ clean_and_return:
+    free(shas);
+    PyBuffer_Release(&map);
+    return result;
+}
+
+
 static uint32_t _extract_bits(unsigned char *buf, int nbits)
 {
     uint32_t v, mask;
@@ -1045,7 +1458,6 @@ static PyObject *merge_into(PyObject *self, PyObject *args)
 
 static PyObject *write_idx(PyObject *self, PyObject *args)
 {
-    char *filename = NULL;
     PyObject *py_total, *idx = NULL;
     PyObject *part;
     unsigned int total = 0;
@@ -1056,8 +1468,7 @@ static PyObject *write_idx(PyObject *self, PyObject *args)
     struct sha *sha_ptr;
 
     Py_buffer fmap;
-    if (!PyArg_ParseTuple(args, cstr_argf wbuf_argf "OO",
-                          &filename, &fmap, &idx, &py_total))
+    if (!PyArg_ParseTuple(args, wbuf_argf "OO", &fmap, &idx, &py_total))
 	return NULL;
 
     PyObject *result = NULL;
@@ -1122,13 +1533,6 @@ static PyObject *write_idx(PyObject *self, PyObject *args)
 	}
     }
 
-    int rc = msync(fmap.buf, fmap.len, MS_ASYNC);
-    if (rc != 0)
-    {
-        result = PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
-        goto clean_and_return;
-    }
-
     result = PyLong_FromUnsignedLong(count);
 
  clean_and_return:
@@ -1137,78 +1541,1185 @@ static PyObject *write_idx(PyObject *self, PyObject *args)
 }
 
 
-// I would have made this a lower-level function that just fills in a buffer
-// with random values, and then written those values from python.  But that's
-// about 20% slower in my tests, and since we typically generate random
-// numbers for benchmarking other parts of bup, any slowness in generating
-// random bytes will make our benchmarks inaccurate.  Plus nobody wants
-// pseudorandom bytes much except for this anyway.
-static PyObject *write_random(PyObject *self, PyObject *args)
+struct tree_ent {
+    unsigned int mode;
+    const char *name;
+    Py_ssize_t name_len;
+    const char *sha;
+    Py_ssize_t i;
+};
+
+static inline int _tree_key_char(const struct tree_ent *e, Py_ssize_t i)
 {
-    uint32_t buf[1024/4];
-    int fd = -1, seed = 0, verbose = 0;
-    ssize_t ret;
-    long long len = 0, kbytes = 0, written = 0;
+    // Git sorts directories as if their names ended with a '/'.
+    return i < e->name_len ? (byte) e->name[i] : '/';
+}
 
-    if (!PyArg_ParseTuple(args, "iLii", &fd, &len, &seed, &verbose))
-	return NULL;
-    
-    srandom(seed);
-    
-    for (kbytes = 0; kbytes < len/1024; kbytes++)
-    {
-	unsigned i;
-	for (i = 0; i < sizeof(buf)/sizeof(buf[0]); i++)
-	    buf[i] = random();
-	ret = write(fd, buf, sizeof(buf));
-	if (ret < 0)
-	    ret = 0;
-	written += ret;
-	if (ret < (int)sizeof(buf))
-	    break;
-	if (verbose && kbytes/1024 > 0 && !(kbytes%1024))
-	    fprintf(stderr, "Random: %lld Mbytes\r", kbytes/1024);
-    }
-    
-    // handle non-multiples of 1024
-    if (len % 1024)
+static int _tree_ent_cmp(const void *x, const void *y)
+{
+    const struct tree_ent *a = x, *b = y;
+    const Py_ssize_t a_len = a->name_len + (S_ISDIR(a->mode) ? 1 : 0);
+    const Py_ssize_t b_len = b->name_len + (S_ISDIR(b->mode) ? 1 : 0);
+    Py_ssize_t i = a->name_len < b->name_len ? a->name_len : b->name_len;
+    const int c = memcmp(a->name, b->name, i);
+    if (c)
+        return c;
+    for (; i < a_len && i < b_len; i++)
     {
-	unsigned i;
-	for (i = 0; i < sizeof(buf)/sizeof(buf[0]); i++)
-	    buf[i] = random();
-	ret = write(fd, buf, len % 1024);
-	if (ret < 0)
-	    ret = 0;
-	written += ret;
+        const int ac = _tree_key_char(a, i), bc = _tree_key_char(b, i);
+        if (ac != bc)
+            return ac - bc;
     }
-    
-    if (kbytes/1024 > 0)
-	fprintf(stderr, "Random: %lld Mbytes, done.\n", kbytes/1024);
-    return Py_BuildValue("L", written);
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+    // Keep qsort stable, like sorted() in python.
+    return (a->i > b->i) - (a->i < b->i);
 }
 
-
-static PyObject *random_sha(PyObject *self, PyObject *args)
+static PyObject *tree_encode(PyObject *self, PyObject *args)
 {
-    static int seeded = 0;
-    uint32_t shabuf[20/4];
-    int i;
-    
-    if (!seeded)
-    {
-	assert(sizeof(shabuf) == 20);
-	srandom(time(NULL));
-	seeded = 1;
-    }
-    
-    if (!PyArg_ParseTuple(args, ""))
+    PyObject *py_shalist;
+    if (!PyArg_ParseTuple(args, "O", &py_shalist))
 	return NULL;
-    
-    memset(shabuf, 0, sizeof(shabuf));
-    for (i=0; i < 20/4; i++)
-	shabuf[i] = random();
-    return Py_BuildValue(rbuf_argf, shabuf, 20);
-}
+
+    PyObject *shalist = PySequence_Fast(py_shalist,
+                                        "shalist must be a sequence");
+    if (!shalist)
+        return NULL;
+
+    PyObject *result = NULL;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(shalist);
+    struct tree_ent *ents = checked_malloc(n ? n : 1, sizeof(struct tree_ent));
+    if (!ents)
+        goto clean_and_return;
+
+    Py_ssize_t i, total = 0;
+    for (i = 0; i < n; i++)
+    {
+        struct tree_ent *e = &ents[i];
+        PyObject *py_mode;
+        Py_ssize_t sha_len;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(shalist, i),
+                              "O" rbuf_argf rbuf_argf,
+                              &py_mode, &e->name, &e->name_len,
+                              &e->sha, &sha_len))
+            goto clean_and_return;
+        if (!bup_uint_from_py(&e->mode, py_mode, "mode"))
+            goto clean_and_return;
+        if (!e->mode)
+        {
+            PyErr_Format(PyExc_ValueError, "tree entry has a zero mode");
+            goto clean_and_return;
+        }
+        if (!e->name_len)
+        {
+            PyErr_Format(PyExc_ValueError, "tree entry has an empty name");
+            goto clean_and_return;
+        }
+        if (memchr(e->name, 0, e->name_len))
+        {
+            PyErr_Format(PyExc_ValueError, "tree entry name contains a null");
+            goto clean_and_return;
+        }
+        if (sha_len != sizeof(struct sha))
+        {
+            PyErr_Format(PyExc_ValueError, "tree entry hash is not %d bytes",
+                         (int) sizeof(struct sha));
+            goto clean_and_return;
+        }
+        e->i = i;
+        // Mode (at most 11 octal digits), space, name, null, hash
+        if (e->name_len > PY_SSIZE_T_MAX - total - 33)
+        {
+            PyErr_Format(PyExc_OverflowError, "tree too large");
+            goto clean_and_return;
+        }
+        total += 11 + 1 + e->name_len + 1 + sizeof(struct sha);
+    }
+    qsort(ents, n, sizeof(struct tree_ent), _tree_ent_cmp);
+
+    result = PyBytes_FromStringAndSize(NULL, total);
+    if (!result)
+        goto clean_and_return;
+    char *out = PyBytes_AS_STRING(result);
+    char *cur = out;
+    for (i = 0; i < n; i++)
+    {
+        const struct tree_ent *e = &ents[i];
+        cur += sprintf(cur, "%o ", e->mode);
+        memcpy(cur, e->name, e->name_len);
+        cur += e->name_len;
+        *cur++ = 0;
+        memcpy(cur, e->sha, sizeof(struct sha));
+        cur += sizeof(struct sha);
+    }
+    assert(cur - out <= total);
+    if (_PyBytes_Resize(&result, cur - out) == -1)
+        result = NULL;
+
+ clean_and_return:
+    free(ents);
+    Py_DECREF(shalist);
+    return result;
+}
+
+static PyObject *tree_decode(PyObject *self, PyObject *args)
+{
+    const char *buf = NULL;
+    Py_ssize_t len = 0;
+    if (!PyArg_ParseTuple(args, rbuf_argf, &buf, &len))
+	return NULL;
+
+    PyObject *result = PyList_New(0);
+    if (!result)
+        return NULL;
+
+    const char *cur = buf, * const end = buf + len;
+    while (cur < end)
+    {
+        unsigned int mode = 0;
+        const char *p = cur;
+        for (; p < end && *p >= '0' && *p <= '7'; p++)
+        {
+            if (mode > (UINT_MAX >> 3))
+                goto bad_tree;
+            mode = (mode << 3) | (*p - '0');
+        }
+        if (p == cur || p == end || *p != ' ')
+            goto bad_tree;
+        const char * const name = p + 1;
+        const char * const z = memchr(name, 0, end - name);
+        if (!z || end - (z + 1) < (Py_ssize_t) sizeof(struct sha))
+            goto bad_tree;
+        PyObject *ent = Py_BuildValue("(I" rbuf_argf rbuf_argf ")",
+                                      mode, name, (Py_ssize_t) (z - name),
+                                      z + 1, (Py_ssize_t) sizeof(struct sha));
+        if (!ent)
+            goto fail;
+        const int rc = PyList_Append(result, ent);
+        Py_DECREF(ent);
+        if (rc)
+            goto fail;
+        cur = z + 1 + sizeof(struct sha);
+    }
+    return result;
+
+ bad_tree:
+    PyErr_Format(PyExc_ValueError, "invalid tree entry at offset %zd",
+                 cur - buf);
+ fail:
+    Py_DECREF(result);
+    return NULL;
+}
+
+// The chunk trees of a hashsplit file (cf. hashsplit.split_to_shalist)
+// are built level by level, where stacks is a list of bytearrays, one
+// per level, each holding the entries that haven't been written as a
+// tree yet as (sha, mode, size) records.  Trees are written via a
+// write_tree(content) callback that returns the tree's id.  Each
+// tree names its entries by their hex offsets within it, all padded
+// to the width of its total size, so that they sort properly.
+
+#define CHUNK_REC_LEN 32  // sha, 32-bit mode, 64-bit size
+#define CHUNK_MODE_FILE 0100644  // cf. hashsplit.GIT_MODE_FILE
+#define CHUNK_MODE_TREE 040000
+
+static void _chunk_rec(unsigned char *rec, const unsigned char *sha,
+                       uint32_t mode, uint64_t size)
+{
+    memcpy(rec, sha, 20);
+    memcpy(rec + 20, &mode, 4);
+    memcpy(rec + 24, &size, 8);
+}
+
+static PyObject *_chunk_level(PyObject *stacks, Py_ssize_t i)
+{
+    if (!PyList_Check(stacks))
+    {
+        PyErr_SetString(PyExc_TypeError, "chunk stacks must be a list");
+        return NULL;
+    }
+    while (PyList_GET_SIZE(stacks) <= i)
+    {
+        PyObject *level = PyByteArray_FromStringAndSize(NULL, 0);
+        if (!level)
+            return NULL;
+        const int rc = PyList_Append(stacks, level);
+        Py_DECREF(level);
+        if (rc)
+            return NULL;
+    }
+    PyObject *level = PyList_GET_ITEM(stacks, i);
+    if (!PyByteArray_Check(level)
+        || PyByteArray_GET_SIZE(level) % CHUNK_REC_LEN != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid chunk stack level");
+        return NULL;
+    }
+    return level;  // borrowed
+}
+
+static int _chunk_append(PyObject *level, const unsigned char *recs,
+                         Py_ssize_t n)
+{
+    const Py_ssize_t len = PyByteArray_GET_SIZE(level);
+    if (PyByteArray_Resize(level, len + n * CHUNK_REC_LEN) == -1)
+        return 0;
+    memcpy(PyByteArray_AS_STRING(level) + len, recs, n * CHUNK_REC_LEN);
+    return 1;
+}
+
+static int _chunk_names_width(const unsigned char *recs, Py_ssize_t n,
+                              uint64_t *total)
+{
+    Py_ssize_t i;
+    uint64_t size, sum = 0;
+    for (i = 0; i < n; i++)
+    {
+        memcpy(&size, recs + i * CHUNK_REC_LEN + 24, 8);
+        sum += size;
+    }
+    int width = 1;
+    for (size = sum; size >= 16; size >>= 4)
+        width++;
+    *total = sum;
+    return width;
+}
+
+static PyObject *_chunk_tree_content(const unsigned char *recs,
+                                     Py_ssize_t n, uint64_t *total)
+{
+    const int width = _chunk_names_width(recs, n, total);
+    // Mode (at most 11 octal digits), space, name, null, hash
+    PyObject *result = PyBytes_FromStringAndSize(NULL,
+                                                 n * (13 + width + 20));
+    if (!result)
+        return NULL;
+    char *out = PyBytes_AS_STRING(result);
+    char *cur = out;
+    uint64_t ofs = 0;
+    Py_ssize_t i;
+    for (i = 0; i < n; i++)
+    {
+        const unsigned char *rec = recs + i * CHUNK_REC_LEN;
+        uint32_t mode;
+        uint64_t size;
+        memcpy(&mode, rec + 20, 4);
+        memcpy(&size, rec + 24, 8);
+        cur += sprintf(cur, "%o %0*llx", mode, width, (unsigned long long) ofs);
+        *cur++ = 0;
+        memcpy(cur, rec, 20);
+        cur += 20;
+        ofs += size;
+    }
+    if (_PyBytes_Resize(&result, cur - out) == -1)
+        return NULL;
+    return result;
+}
+
+// Write every level below n (and any full level) as a tree, adding
+// it to the next level up, or just move it up if it has one entry.
+static int _chunk_squish(PyObject *stacks, Py_ssize_t n, PyObject *write_tree,
+                         Py_ssize_t max_per_tree)
+{
+    Py_ssize_t i;
+    for (i = 0; ; i++)
+    {
+        PyObject *level = _chunk_level(stacks, i);
+        if (!level)
+            return 0;
+        const Py_ssize_t count = PyByteArray_GET_SIZE(level) / CHUNK_REC_LEN;
+        if (i >= n && count < max_per_tree)
+            return 1;
+        PyObject *next = _chunk_level(stacks, i + 1);
+        if (!next)
+            return 0;
+        const unsigned char *recs =
+            (unsigned char *) PyByteArray_AS_STRING(level);
+        if (count == 1)
+        {
+            if (!_chunk_append(next, recs, 1))
+                return 0;
+        }
+        else if (count)
+        {
+            uint64_t total;
+            PyObject *content = _chunk_tree_content(recs, count, &total);
+            if (!content)
+                return 0;
+            PyObject *sha = PyObject_CallFunctionObjArgs(write_tree, content,
+                                                         NULL);
+            Py_DECREF(content);
+            if (!sha)
+                return 0;
+            if (!PyBytes_Check(sha) || PyBytes_GET_SIZE(sha) != 20)
+            {
+                Py_DECREF(sha);
+                PyErr_SetString(PyExc_ValueError,
+                                "write_tree didn't return a 20-byte id");
+                return 0;
+            }
+            unsigned char rec[CHUNK_REC_LEN];
+            _chunk_rec(rec, (unsigned char *) PyBytes_AS_STRING(sha),
+                       CHUNK_MODE_TREE, total);
+            Py_DECREF(sha);
+            // The callback could have changed the stacks.
+            if (!(next = _chunk_level(stacks, i + 1)))
+                return 0;
+            if (!_chunk_append(next, rec, 1))
+                return 0;
+            if (!(level = _chunk_level(stacks, i)))
+                return 0;
+        }
+        if (PyByteArray_Resize(level, 0) == -1)
+            return 0;
+    }
+}
+
+static PyObject *chunk_tree_add(PyObject *self, PyObject *args)
+{
+    PyObject *stacks, *py_size, *write_tree;
+    unsigned char *sha = NULL;
+    Py_ssize_t sha_len = 0, level, max_per_tree;
+    if (!PyArg_ParseTuple(args, "O" rbuf_argf "OnOn",
+                          &stacks, &sha, &sha_len, &py_size, &level,
+                          &write_tree, &max_per_tree))
+        return NULL;
+    unsigned PY_LONG_LONG size;
+    if (!bup_ullong_from_py(&size, py_size, "size"))
+        return NULL;
+    if (sha_len != 20)
+        return PyErr_Format(PyExc_ValueError, "chunk id is not 20 bytes");
+    if (max_per_tree < 2)
+        return PyErr_Format(PyExc_ValueError, "max_per_tree is less than 2");
+    PyObject *bottom = _chunk_level(stacks, 0);
+    if (!bottom)
+        return NULL;
+    unsigned char rec[CHUNK_REC_LEN];
+    _chunk_rec(rec, sha, CHUNK_MODE_FILE, size);
+    if (!_chunk_append(bottom, rec, 1))
+        return NULL;
+    if (!_chunk_squish(stacks, level, write_tree, max_per_tree))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *chunk_tree_finish(PyObject *self, PyObject *args)
+{
+    PyObject *stacks, *write_tree;
+    Py_ssize_t max_per_tree;
+    if (!PyArg_ParseTuple(args, "OOn", &stacks, &write_tree, &max_per_tree))
+        return NULL;
+    if (max_per_tree < 2)
+        return PyErr_Format(PyExc_ValueError, "max_per_tree is less than 2");
+    if (!PyList_Check(stacks) || !PyList_GET_SIZE(stacks))
+        return PyErr_Format(PyExc_ValueError, "invalid chunk stacks");
+    if (!_chunk_squish(stacks, PyList_GET_SIZE(stacks) - 1, write_tree,
+                       max_per_tree))
+        return NULL;
+    PyObject *top = _chunk_level(stacks, PyList_GET_SIZE(stacks) - 1);
+    if (!top)
+        return NULL;
+    const unsigned char *recs = (unsigned char *) PyByteArray_AS_STRING(top);
+    const Py_ssize_t n = PyByteArray_GET_SIZE(top) / CHUNK_REC_LEN;
+    uint64_t total;
+    const int width = _chunk_names_width(recs, n, &total);
+    PyObject *result = PyList_New(n);
+    if (!result)
+        return NULL;
+    uint64_t ofs = 0;
+    Py_ssize_t i;
+    for (i = 0; i < n; i++)
+    {
+        const unsigned char *rec = recs + i * CHUNK_REC_LEN;
+        uint32_t mode;
+        uint64_t size;
+        char name[17];
+        memcpy(&mode, rec + 20, 4);
+        memcpy(&size, rec + 24, 8);
+        const int name_len = sprintf(name, "%0*llx", width,
+                                     (unsigned long long) ofs);
+        PyObject *ent = Py_BuildValue("I" rbuf_argf rbuf_argf,
+                                      (unsigned int) mode,
+                                      name, (Py_ssize_t) name_len,
+                                      rec, (Py_ssize_t) 20);
+        if (!ent)
+        {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, ent);
+        ofs += size;
+    }
+    return result;
+}
+
+// Metadata records (.bupm, bupindex.meta), cf. metadata.py and
+// vint.py.  Integers are vuints (V) or vints (v), byte vectors are
+// vuint length prefixed (s), and each record is a vuint tag followed
+// by its data as a byte vector.  A tag of 0 ends the entry.  Anything
+// these functions can't handle (e.g. values that don't fit in 64
+// bits, or malformed input) raises OverflowError, ValueError, or
+// EOFError, and the caller falls back to the Python implementation.
+
+#define META_TAG_END 0
+#define META_TAG_PATH 1
+#define META_TAG_COMMON_V1 2
+#define META_TAG_SYMLINK_TARGET 3
+#define META_TAG_POSIX1E_ACL 4
+#define META_TAG_LINUX_ATTR 6
+#define META_TAG_LINUX_XATTR 7
+#define META_TAG_HARDLINK_TARGET 8
+#define META_TAG_COMMON_V2 9
+#define META_TAG_COMMON_V3 10
+
+#define META_COMMON_FIELDS 13
+
+struct vbuf
+{
+    unsigned char *data;
+    size_t len, cap;
+};
+
+static int vbuf_reserve(struct vbuf *b, size_t n)
+{
+    if (b->cap - b->len >= n)
+        return 1;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap - b->len < n)
+    {
+        if (cap > SIZE_MAX / 2)
+        {
+            PyErr_NoMemory();
+            return 0;
+        }
+        cap *= 2;
+    }
+    unsigned char * const data = realloc(b->data, cap);
+    if (!data)
+    {
+        PyErr_NoMemory();
+        return 0;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+static int vbuf_put_vuint(struct vbuf *b, unsigned long long x)
+{
+    if (!vbuf_reserve(b, 10))
+        return 0;
+    do {
+        const unsigned char seven_bits = x & 0x7f;
+        x >>= 7;
+        b->data[b->len++] = x ? 0x80 | seven_bits : seven_bits;
+    } while (x);
+    return 1;
+}
+
+static int vbuf_put_vint(struct vbuf *b, long long x)
+{
+    // Sign is the second bit of the first byte, which also holds the
+    // low six bits; the rest is a vuint.
+    unsigned long long mag =
+        x < 0 ? -(unsigned long long) x : (unsigned long long) x;
+    const unsigned char sign_and_six_bits = (mag & 0x3f) | (x < 0 ? 0x40 : 0);
+    mag >>= 6;
+    if (!vbuf_reserve(b, 1))
+        return 0;
+    if (!mag)
+    {
+        b->data[b->len++] = sign_and_six_bits;
+        return 1;
+    }
+    b->data[b->len++] = 0x80 | sign_and_six_bits;
+    return vbuf_put_vuint(b, mag);
+}
+
+static int vbuf_put_bvec(struct vbuf *b, const void *data, size_t len)
+{
+    if (!vbuf_put_vuint(b, len) || !vbuf_reserve(b, len))
+        return 0;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 1;
+}
+
+static int vbuf_put_py_bvec(struct vbuf *b, PyObject *py)
+{
+    char *data;
+    Py_ssize_t len;
+    if (PyBytes_AsStringAndSize(py, &data, &len) == -1)
+        return 0;
+    return vbuf_put_bvec(b, data, len);
+}
+
+static int vbuf_put_py_vint(struct vbuf *b, PyObject *py)
+{
+    const long long x = PyLong_AsLongLong(py);
+    if (x == -1 && PyErr_Occurred())
+        return 0;
+    return vbuf_put_vint(b, x);
+}
+
+static int vbuf_put_py_vuint(struct vbuf *b, PyObject *py, const char *name)
+{
+    unsigned long long x;
+    if (!bup_ullong_from_py(&x, py, name))
+        return 0;
+    return vbuf_put_vuint(b, x);
+}
+
+// Append rec to b as a tag record, and clear rec.
+static int meta_put_record(struct vbuf *b, unsigned int tag, struct vbuf *rec)
+{
+    if (!vbuf_put_vuint(b, tag) || !vbuf_put_bvec(b, rec->data, rec->len))
+        return 0;
+    rec->len = 0;
+    return 1;
+}
+
+static int meta_put_common(struct vbuf *rec, PyObject *common)
+{
+    static const char fmt[] = "vvsvsvvVvVvVv";
+    if (!PyTuple_Check(common) || PyTuple_GET_SIZE(common) != META_COMMON_FIELDS)
+    {
+        PyErr_SetString(PyExc_TypeError,
+                        "common metadata must be a 13 element tuple");
+        return 0;
+    }
+    int i;
+    for (i = 0; i < META_COMMON_FIELDS; i++)
+    {
+        PyObject * const x = PyTuple_GET_ITEM(common, i);
+        int ok;
+        switch (fmt[i])
+        {
+        case 'v': ok = vbuf_put_py_vint(rec, x); break;
+        case 'V': ok = vbuf_put_py_vuint(rec, x, "timestamp ns"); break;
+        default: ok = vbuf_put_py_bvec(rec, x); break;
+        }
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+static int meta_put_acl(struct vbuf *rec, PyObject *acl)
+{
+    PyObject * const seq = PySequence_Fast(acl, "posix1e ACL must be a sequence");
+    if (!seq)
+        return 0;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    int ok = 1;
+    if (n != 2 && n != 4)
+    {
+        PyErr_SetString(PyExc_ValueError, "posix1e ACL must have 2 or 4 items");
+        ok = 0;
+    }
+    Py_ssize_t i;
+    for (i = 0; ok && i < n; i++)
+        ok = vbuf_put_py_bvec(rec, PySequence_Fast_GET_ITEM(seq, i));
+    // Two empty strings when there's no default ACL.
+    for (i = n; ok && i < 4; i++)
+        ok = vbuf_put_bvec(rec, "", 0);
+    Py_DECREF(seq);
+    return ok;
+}
+
+static int meta_put_xattrs(struct vbuf *rec, PyObject *xattrs)
+{
+    PyObject * const seq = PySequence_Fast(xattrs, "xattrs must be a sequence");
+    if (!seq)
+        return 0;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    int ok = vbuf_put_vuint(rec, n);
+    Py_ssize_t i;
+    for (i = 0; ok && i < n; i++)
+    {
+        PyObject *name, *value;
+        ok = PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "OO",
+                              &name, &value)
+            && vbuf_put_py_bvec(rec, name)
+            && vbuf_put_py_bvec(rec, value);
+    }
+    Py_DECREF(seq);
+    return ok;
+}
+
+static PyObject *metadata_encode(PyObject *self, PyObject *args)
+{
+    PyObject *path, *common, *symlink_target, *hardlink_target;
+    PyObject *acl, *linux_attr, *xattrs;
+    if (!PyArg_ParseTuple(args, "OOOOOOO", &path, &common, &symlink_target,
+                          &hardlink_target, &acl, &linux_attr, &xattrs))
+        return NULL;
+
+    // As in Metadata.write(), omit any record that would be empty.
+    struct vbuf out = { NULL, 0, 0 }, rec = { NULL, 0, 0 };
+    PyObject *result = NULL;
+    int have;
+    if ((have = PyObject_IsTrue(path)) == -1
+        || (have && !(vbuf_put_py_bvec(&rec, path)
+                      && meta_put_record(&out, META_TAG_PATH, &rec))))
+        goto clean_and_return;
+    if (common != Py_None
+        && !(meta_put_common(&rec, common)
+             && meta_put_record(&out, META_TAG_COMMON_V3, &rec)))
+        goto clean_and_return;
+    if ((have = PyObject_IsTrue(symlink_target)) == -1
+        || (have && !(vbuf_put_vuint(&out, META_TAG_SYMLINK_TARGET)
+                      && vbuf_put_py_bvec(&out, symlink_target))))
+        goto clean_and_return;
+    if ((have = PyObject_IsTrue(hardlink_target)) == -1
+        || (have && !(vbuf_put_vuint(&out, META_TAG_HARDLINK_TARGET)
+                      && vbuf_put_py_bvec(&out, hardlink_target))))
+        goto clean_and_return;
+    if ((have = PyObject_IsTrue(acl)) == -1
+        || (have && !(meta_put_acl(&rec, acl)
+                      && meta_put_record(&out, META_TAG_POSIX1E_ACL, &rec))))
+        goto clean_and_return;
+    if ((have = PyObject_IsTrue(linux_attr)) == -1
+        || (have && !(vbuf_put_py_vuint(&rec, linux_attr, "linux_attr")
+                      && meta_put_record(&out, META_TAG_LINUX_ATTR, &rec))))
+        goto clean_and_return;
+    if ((have = PyObject_IsTrue(xattrs)) == -1
+        || (have && !(meta_put_xattrs(&rec, xattrs)
+                      && meta_put_record(&out, META_TAG_LINUX_XATTR, &rec))))
+        goto clean_and_return;
+    if (!vbuf_put_vuint(&out, META_TAG_END))
+        goto clean_and_return;
+    result = Py_BuildValue(rbuf_argf, out.data, (Py_ssize_t) out.len);
+
+ clean_and_return:
+    free(out.data);
+    free(rec.data);
+    return result;
+}
+
+struct vreader
+{
+    const unsigned char *p, *end;
+};
+
+static int vread_truncated(void)
+{
+    PyErr_SetString(PyExc_EOFError, "encountered EOF while reading vint data");
+    return 0;
+}
+
+static int vread_vuint(struct vreader *r, unsigned long long *x)
+{
+    unsigned long long result = 0;
+    int shift = 0;
+    while (1)
+    {
+        if (r->p == r->end)
+            return vread_truncated();
+        const unsigned char b = *r->p++;
+        const unsigned long long bits = b & 0x7f;
+        if (bits)
+        {
+            if (shift >= 64 || (shift > 57 && bits >> (64 - shift)))
+            {
+                PyErr_SetString(PyExc_OverflowError, "vuint too big");
+                return 0;
+            }
+            result |= bits << shift;
+        }
+        if (!(b & 0x80))
+            break;
+        shift += 7;
+    }
+    *x = result;
+    return 1;
+}
+
+static int vread_vint(struct vreader *r, long long *x)
+{
+    if (r->p == r->end)
+        return vread_truncated();
+    const unsigned char b = *r->p++;
+    const int negative = b & 0x40;
+    unsigned long long mag = b & 0x3f;
+    if (b & 0x80)
+    {
+        unsigned long long rest;
+        if (!vread_vuint(r, &rest))
+            return 0;
+        if (rest >> 57)
+        {
+            PyErr_SetString(PyExc_OverflowError, "vint too big");
+            return 0;
+        }
+        mag |= rest << 6;
+    }
+    if (mag > (unsigned long long) LLONG_MAX + (negative ? 1 : 0))
+    {
+        PyErr_SetString(PyExc_OverflowError, "vint too big");
+        return 0;
+    }
+    *x = negative ? (long long) -mag : (long long) mag;
+    return 1;
+}
+
+static int vread_bvec(struct vreader *r, const unsigned char **data,
+                      size_t *len)
+{
+    unsigned long long n;
+    if (!vread_vuint(r, &n))
+        return 0;
+    if (n > (unsigned long long) (r->end - r->p))
+        return vread_truncated();
+    *data = r->p;
+    *len = n;
+    r->p += n;
+    return 1;
+}
+
+static PyObject *vread_py_bvec(struct vreader *r)
+{
+    const unsigned char *data;
+    size_t len;
+    if (!vread_bvec(r, &data, &len))
+        return NULL;
+    return PyBytes_FromStringAndSize((const char *) data, len);
+}
+
+static PyObject *vread_py_vuint(struct vreader *r)
+{
+    unsigned long long x;
+    if (!vread_vuint(r, &x))
+        return NULL;
+    return PyLong_FromUnsignedLongLong(x);
+}
+
+static PyObject *meta_read_common(struct vreader *r, unsigned int tag)
+{
+    const char *fmt;
+    switch (tag)
+    {
+    case META_TAG_COMMON_V3: fmt = "vvsvsvvVvVvVv"; break;
+    case META_TAG_COMMON_V2: fmt = "vvsvsvvVvVvV"; break;
+    default: fmt = "VVsVsVvVvVvV"; break;
+    }
+    PyObject * const common = PyTuple_New(META_COMMON_FIELDS);
+    if (!common)
+        return NULL;
+    int i;
+    for (i = 0; i < META_COMMON_FIELDS; i++)
+    {
+        PyObject *x;
+        long long v;
+        switch (fmt[i])
+        {
+        case 'v':
+            x = vread_vint(r, &v) ? PyLong_FromLongLong(v) : NULL;
+            break;
+        case 'V': x = vread_py_vuint(r); break;
+        case 's': x = vread_py_bvec(r); break;
+        default: x = PyLong_FromLong(-1); break;  // no size before v3
+        }
+        if (!x)
+        {
+            Py_DECREF(common);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(common, i, x);
+    }
+    return common;
+}
+
+static PyObject *meta_read_acl(struct vreader *r)
+{
+    PyObject * const acl = PyList_New(4);
+    if (!acl)
+        return NULL;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        PyObject * const x = vread_py_bvec(r);
+        if (!x)
+        {
+            Py_DECREF(acl);
+            return NULL;
+        }
+        PyList_SET_ITEM(acl, i, x);
+    }
+    return acl;
+}
+
+static PyObject *meta_read_xattrs(struct vreader *r)
+{
+    unsigned long long n;
+    if (!vread_vuint(r, &n))
+        return NULL;
+    PyObject * const xattrs = PyList_New(0);
+    if (!xattrs)
+        return NULL;
+    for (; n; n--)
+    {
+        PyObject * const name = vread_py_bvec(r);
+        PyObject * const value = name ? vread_py_bvec(r) : NULL;
+        PyObject * const pair = value ? PyTuple_Pack(2, name, value) : NULL;
+        Py_XDECREF(name);
+        Py_XDECREF(value);
+        if (!pair || PyList_Append(xattrs, pair))
+        {
+            Py_XDECREF(pair);
+            Py_DECREF(xattrs);
+            return NULL;
+        }
+        Py_DECREF(pair);
+    }
+    return xattrs;
+}
+
+#define META_FIELDS 7
+
+// Return the (path, common, symlink_target, hardlink_target,
+// posix1e_acl, linux_attr, linux_xattr) fields of the next entry,
+// which must start with tag, or NULL.
+static PyObject *meta_read_entry(struct vreader *r, unsigned long long tag)
+{
+    PyObject * const ent = PyTuple_New(META_FIELDS);
+    if (!ent)
+        return NULL;
+    int i;
+    for (i = 0; i < META_FIELDS; i++)
+    {
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(ent, i, Py_None);
+    }
+    while (tag != META_TAG_END)
+    {
+        const unsigned char *data;
+        size_t len;
+        if (!vread_bvec(r, &data, &len))
+            goto fail;
+        struct vreader rec = { data, data + len };
+        int field = -1;
+        PyObject *value = NULL;
+        switch (tag)
+        {
+        case META_TAG_PATH:
+            field = 0;
+            value = vread_py_bvec(&rec);
+            break;
+        case META_TAG_COMMON_V1:
+        case META_TAG_COMMON_V2:
+        case META_TAG_COMMON_V3:
+            field = 1;
+            value = meta_read_common(&rec, tag);
+            break;
+        case META_TAG_SYMLINK_TARGET:
+        case META_TAG_HARDLINK_TARGET:
+            field = tag == META_TAG_SYMLINK_TARGET ? 2 : 3;
+            value = PyBytes_FromStringAndSize((const char *) data, len);
+            break;
+        case META_TAG_POSIX1E_ACL:
+            field = 4;
+            value = meta_read_acl(&rec);
+            break;
+        case META_TAG_LINUX_ATTR:
+            field = 5;
+            value = vread_py_vuint(&rec);
+            break;
+        case META_TAG_LINUX_XATTR:
+            field = 6;
+            value = meta_read_xattrs(&rec);
+            break;
+        default:  // unknown record, skip it
+            break;
+        }
+        if (field >= 0)
+        {
+            if (!value)
+                goto fail;
+            Py_DECREF(PyTuple_GET_ITEM(ent, field));
+            PyTuple_SET_ITEM(ent, field, value);
+        }
+        if (!vread_vuint(r, &tag))
+            goto fail;
+    }
+    return ent;
+
+ fail:
+    Py_DECREF(ent);
+    return NULL;
+}
+
+static PyObject *metadata_decode(PyObject *self, PyObject *args)
+{
+    const char *buf = NULL;
+    Py_ssize_t len = 0;
+    if (!PyArg_ParseTuple(args, rbuf_argf, &buf, &len))
+	return NULL;
+
+    PyObject *result = PyList_New(0);
+    if (!result)
+        return NULL;
+    struct vreader r = { (const unsigned char *) buf,
+                         (const unsigned char *) buf + len };
+    while (r.p < r.end)
+    {
+        unsigned long long tag;
+        if (!vread_vuint(&r, &tag))
+            goto fail;
+        PyObject *ent;
+        if (tag == META_TAG_END)
+        {
+            Py_INCREF(Py_None);
+            ent = Py_None;
+        }
+        else if (!(ent = meta_read_entry(&r, tag)))
+            goto fail;
+        const int rc = PyList_Append(result, ent);
+        Py_DECREF(ent);
+        if (rc)
+            goto fail;
+    }
+    return result;
+
+ fail:
+    Py_DECREF(result);
+    return NULL;
+}
+
+
+// Generic vint.py codecs, i.e. pack() and unpack() for a string of
+// type characters.  Anything that doesn't fit in 64 bits raises
+// OverflowError, and the caller falls back to the Python
+// implementation.
+
+static int vint_put_value(struct vbuf *b, char type, PyObject *value)
+{
+    switch (type)
+    {
+    case 'V': return vbuf_put_py_vuint(b, value, "vuint");
+    case 'v': return vbuf_put_py_vint(b, value);
+    case 's': return vbuf_put_py_bvec(b, value);
+    }
+    PyErr_Format(PyExc_ValueError, "unknown xpack format string item \"%c\"",
+                 type);
+    return 0;
+}
+
+static PyObject *vint_get_value(struct vreader *r, char type)
+{
+    switch (type)
+    {
+    case 'V': return vread_py_vuint(r);
+    case 'v':
+    {
+        long long x;
+        return vread_vint(r, &x) ? PyLong_FromLongLong(x) : NULL;
+    }
+    case 's': return vread_py_bvec(r);
+    }
+    PyErr_Format(PyExc_ValueError, "unknown xunpack format string item \"%c\"",
+                 type);
+    return NULL;
+}
+
+static PyObject *vint_pack(PyObject *self, PyObject *args)
+{
+    const char *types;
+    Py_ssize_t n_types;
+    PyObject *values;
+    if (!PyArg_ParseTuple(args, "s#O", &types, &n_types, &values))
+        return NULL;
+    PyObject * const seq = PySequence_Fast(values, "values must be a sequence");
+    if (!seq)
+        return NULL;
+    PyObject *result = NULL;
+    struct vbuf out = { NULL, 0, 0 };
+    if (PySequence_Fast_GET_SIZE(seq) != n_types)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "number of arguments does not match format string");
+        goto clean_and_return;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < n_types; i++)
+        if (!vint_put_value(&out, types[i], PySequence_Fast_GET_ITEM(seq, i)))
+            goto clean_and_return;
+    result = PyBytes_FromStringAndSize((const char *) out.data, out.len);
+
+ clean_and_return:
+    free(out.data);
+    Py_DECREF(seq);
+    return result;
+}
+
+// Return a list (or tuple) of the values of a types record read from r.
+static PyObject *vint_get_record(struct vreader *r, const char *types,
+                                 Py_ssize_t n_types, int as_tuple)
+{
+    PyObject * const result = as_tuple ? PyTuple_New(n_types)
+        : PyList_New(n_types);
+    if (!result)
+        return NULL;
+    Py_ssize_t i;
+    for (i = 0; i < n_types; i++)
+    {
+        PyObject * const x = vint_get_value(r, types[i]);
+        if (!x)
+        {
+            Py_DECREF(result);
+            return NULL;
+        }
+        if (as_tuple)
+            PyTuple_SET_ITEM(result, i, x);
+        else
+            PyList_SET_ITEM(result, i, x);
+    }
+    return result;
+}
+
+static int vint_reader_from_args(struct vreader *r, Py_buffer *buf,
+                                 Py_ssize_t ofs)
+{
+    if (ofs < 0 || ofs > buf->len)
+    {
+        PyErr_Format(PyExc_ValueError, "offset %zd outside buffer", ofs);
+        return 0;
+    }
+    r->p = (const unsigned char *) buf->buf + ofs;
+    r->end = (const unsigned char *) buf->buf + buf->len;
+    return 1;
+}
+
+static PyObject *vint_unpack(PyObject *self, PyObject *args)
+{
+    const char *types;
+    Py_ssize_t n_types, ofs = 0;
+    Py_buffer buf;
+    if (!PyArg_ParseTuple(args, "s#" rbufobj_argf "|n",
+                          &types, &n_types, &buf, &ofs))
+        return NULL;
+    PyObject *result = NULL;
+    struct vreader r;
+    if (vint_reader_from_args(&r, &buf, ofs))
+    {
+        PyObject * const values = vint_get_record(&r, types, n_types, 0);
+        if (values)
+        {
+            result = Py_BuildValue("(Nn)", values,
+                                   (Py_ssize_t) (r.p - (const unsigned char *) buf.buf));
+        }
+    }
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+static PyObject *vint_unpack_many(PyObject *self, PyObject *args)
+{
+    const char *types;
+    Py_ssize_t n_types, n, ofs = 0;
+    Py_buffer buf;
+    if (!PyArg_ParseTuple(args, "s#" rbufobj_argf "n|n",
+                          &types, &n_types, &buf, &n, &ofs))
+        return NULL;
+    PyObject *result = NULL;
+    PyObject * const records = PyList_New(0);
+    struct vreader r;
+    if (!records || !vint_reader_from_args(&r, &buf, ofs))
+        goto clean_and_return;
+    // A negative n means "until the end of the buffer".
+    for (; n < 0 ? r.p < r.end : n > 0; n--)
+    {
+        PyObject * const rec = vint_get_record(&r, types, n_types, 1);
+        if (!rec)
+            goto clean_and_return;
+        const int rc = PyList_Append(records, rec);
+        Py_DECREF(rec);
+        if (rc)
+            goto clean_and_return;
+    }
+    result = Py_BuildValue("(On)", records,
+                           (Py_ssize_t) (r.p - (const unsigned char *) buf.buf));
+
+ clean_and_return:
+    Py_XDECREF(records);
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+
+// I would have made this a lower-level function that just fills in a buffer
+// with random values, and then written those values from python.  But that's
+// about 20% slower in my tests, and since we typically generate random
+// numbers for benchmarking other parts of bup, any slowness in generating
+// random bytes will make our benchmarks inaccurate.  Plus nobody wants
+// pseudorandom bytes much except for this anyway.
+static PyObject *write_random(PyObject *self, PyObject *args)
+{
+    uint32_t buf[1024/4];
+    int fd = -1, seed = 0, verbose = 0;
+    ssize_t ret;
+    long long len = 0, kbytes = 0, written = 0;
+
+    if (!PyArg_ParseTuple(args, "iLii", &fd, &len, &seed, &verbose))
+	return NULL;
+    
+    srandom(seed);
+    
+    for (kbytes = 0; kbytes < len/1024; kbytes++)
+    {
+	unsigned i;
+	for (i = 0; i < sizeof(buf)/sizeof(buf[0]); i++)
+	    buf[i] = random();
+	ret = write(fd, buf, sizeof(buf));
+	if (ret < 0)
+	    ret = 0;
+	written += ret;
+	if (ret < (int)sizeof(buf))
+	    break;
+	if (verbose && kbytes/1024 > 0 && !(kbytes%1024))
+	    fprintf(stderr, "Random: %lld Mbytes\r", kbytes/1024);
+    }
+    
+    // handle non-multiples of 1024
+    if (len % 1024)
+    {
+	unsigned i;
+	for (i = 0; i < sizeof(buf)/sizeof(buf[0]); i++)
+	    buf[i] = random();
+	ret = write(fd, buf, len % 1024);
+	if (ret < 0)
+	    ret = 0;
+	written += ret;
+    }
+    
+    if (kbytes/1024 > 0)
+	fprintf(stderr, "Random: %lld Mbytes, done.\n", kbytes/1024);
+    return Py_BuildValue("L", written);
+}
+
+
+static PyObject *random_sha(PyObject *self, PyObject *args)
+{
+    static int seeded = 0;
+    uint32_t shabuf[20/4];
+    int i;
+    
+    if (!seeded)
+    {
+	assert(sizeof(shabuf) == 20);
+	srandom(time(NULL));
+	seeded = 1;
+    }
+    
+    if (!PyArg_ParseTuple(args, ""))
+	return NULL;
+    
+    memset(shabuf, 0, sizeof(shabuf));
+    for (i=0; i < 20/4; i++)
+	shabuf[i] = random();
+    return Py_BuildValue(rbuf_argf, shabuf, 20);
+}
 
 
 static int _open_noatime(const char *filename, int attrs)
@@ -1293,18 +2804,27 @@ static PyObject *bup_get_linux_file_attr(PyObject *self, PyObject *args)
     if (!PyArg_ParseTuple(args, cstr_argf, &path))
         return NULL;
 
+    // Let other threads run (cf. metadata.Harvester) while we wait
+    // on the filesystem.
+    Py_BEGIN_ALLOW_THREADS
     fd = _open_noatime(path, O_NONBLOCK);
-    if (fd == -1)
-        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
-
-    attr = 0;  // Handle int/long mismatch (see above)
-    rc = ioctl(fd, FS_IOC_GETFLAGS, &attr);
-    if (rc == -1)
+    rc = -1;
+    if (fd != -1)
     {
-        close(fd);
-        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        attr = 0;  // Handle int/long mismatch (see above)
+        rc = ioctl(fd, FS_IOC_GETFLAGS, &attr);
+        if (rc == -1)
+        {
+            const int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        }
+        else
+            close(fd);
     }
-    close(fd);
+    Py_END_ALLOW_THREADS
+    if (rc == -1)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
     assert(attr <= UINT_MAX);  // Kernel type is actually int
     return PyLong_FromUnsignedLong(attr);
 }
@@ -1713,6 +3233,17 @@ static PyMethodDef helper_methods[] = {
 	"Return the number of bits in the rolling checksum." },
     { "splitbuf", splitbuf, METH_VARARGS,
 	"Split a list of strings based on a rolling checksum." },
+    { "gear_splitbuf", gear_splitbuf, METH_VARARGS,
+      "Split a buffer like splitbuf(), but via a (FastCDC) gear hash." },
+    { "vint_pack", vint_pack, METH_VARARGS,
+      "Return the vint encoding of the values sequence as per types." },
+    { "vint_unpack", vint_unpack, METH_VARARGS,
+      "Decode a types record from buf at ofs; return (values, end_ofs)." },
+    { "vint_unpack_many", vint_unpack_many, METH_VARARGS,
+      "Decode n (or if n < 0, all) types records (as tuples) from buf at"
+      " ofs; return (records, end_ofs)." },
+    { "leading_zeros", leading_zeros, METH_VARARGS,
+	"Return the number of zero bytes at the start of buf." },
     { "bitmatch", bitmatch, METH_VARARGS,
 	"Count the number of matching prefix bits between two strings." },
     { "firstword", firstword, METH_VARARGS,
@@ -1720,13 +3251,45 @@ static PyMethodDef helper_methods[] = {
     { "bloom_contains", bloom_contains, METH_VARARGS,
 	"Check if a bloom filter of 2^nbits bytes contains an object" },
     { "bloom_add", bloom_add, METH_VARARGS,
-	"Add an object to a bloom filter of 2^nbits bytes" },
+	"Add an object to a bloom filter of 2^nbits bytes, atomically if"
+        " other threads may be adding to it too" },
+    { "bloom_contains_many", bloom_contains_many, METH_VARARGS,
+	"Return a bytearray with a 1 for each hash in a buffer of 20-byte"
+        " hashes that a bloom filter of 2^nbits bytes contains, else 0" },
+    { "idx_find", idx_find, METH_VARARGS,
+	"Return the index of a hash in an idx table and the search steps" },
+    { "idx_find_many", idx_find_many, METH_VARARGS,
+	"Return a list of the index (or None) in an idx table of each hash in"
+        " a buffer of 20-byte hashes, and the total search steps" },
+    { "idx_shas", idx_shas, METH_VARARGS,
+	"Return the n hashes from an idx table as one bytes object" },
+    { "inflight_append", inflight_append, METH_VARARGS,
+	"Publish a hash in an inflight table; return its slot or None if full" },
+    { "inflight_scan", inflight_scan, METH_VARARGS,
+	"Return the hashes published in an inflight table from slot start"
+        " on (as one bytes object), excepting skip_tag's, and the next slot" },
     { "extract_bits", extract_bits, METH_VARARGS,
 	"Take the first 'nbits' bits from 'buf' and return them as an int." },
     { "merge_into", merge_into, METH_VARARGS,
 	"Merges a bunch of idx and midx files into a single midx." },
     { "write_idx", write_idx, METH_VARARGS,
-	"Write a PackIdxV2 file from an idx list of lists of tuples" },
+	"Fill a PackIdxV2 buffer from an idx list of lists of tuples" },
+    { "tree_encode", tree_encode, METH_VARARGS,
+	"Return a git tree object for a sequence of (mode, name, sha) tuples" },
+    { "tree_decode", tree_decode, METH_VARARGS,
+	"Return a list of (mode, name, sha) tuples for a git tree object" },
+    { "chunk_tree_add", chunk_tree_add, METH_VARARGS,
+	"Add a (sha, size, level) chunk to a hashsplit file's chunk tree"
+        " stacks, writing any trees it completes via write_tree(content)" },
+    { "chunk_tree_finish", chunk_tree_finish, METH_VARARGS,
+	"Write the remaining chunk trees in the stacks and return the"
+        " top level (mode, name, sha) shalist" },
+    { "metadata_encode", metadata_encode, METH_VARARGS,
+	"Encode a metadata entry from its (path, common, symlink_target,"
+        " hardlink_target, posix1e_acl, linux_attr, linux_xattr) fields" },
+    { "metadata_decode", metadata_decode, METH_VARARGS,
+	"Return a list of the fields of each metadata entry in a buffer,"
+        " or None for an empty entry" },
     { "write_random", write_random, METH_VARARGS,
 	"Write random bytes to the given file descriptor" },
     { "random_sha", random_sha, METH_VARARGS,
@@ -1859,6 +3422,17 @@ static int setup_module(PyObject *m)
         Py_DECREF(value);
     }
 #endif
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    {
+        PyObject *value;
+        value = INTEGER_TO_PY(SEEK_DATA);
+        PyObject_SetAttrString(m, "SEEK_DATA", value);
+        Py_DECREF(value);
+        value = INTEGER_TO_PY(SEEK_HOLE);
+        PyObject_SetAttrString(m, "SEEK_HOLE", value);
+        Py_DECREF(value);
+    }
+#endif
 #ifdef BUP_HAVE_MINCORE_INCORE
     {
         PyObject *value;
@@ -81,9 +81,9 @@ Brandon Low <lostlogic@lostlogicx.com> 2011-02-04
 """
 
 from __future__ import absolute_import
-import sys, os, math, mmap, struct
+import sys, os, math, mmap, struct, threading
 
-from bup import _helpers
+from bup import _helpers, metrics
 from bup.helpers import (debug1, debug2, log, mmap_read, mmap_readwrite,
                          mmap_readwrite_private, unlink)
 
@@ -93,10 +93,12 @@ MAX_BITS_EACH = 32 # Kinda arbitrary, but 4 bytes per entry is pretty big
 MAX_BLOOM_BITS = {4: 37, 5: 29} # 160/k-log2(8)
 MAX_PFALSE_POSITIVE = 1. # Totally arbitrary, needs benchmarking
 
-_total_searches = 0
-_total_steps = 0
+_probes = metrics.counter('bloom.probes')
+_steps = metrics.counter('bloom.steps')
+_hits = metrics.counter('bloom.hits')
 
 bloom_contains = _helpers.bloom_contains
+bloom_contains_many = _helpers.bloom_contains_many
 bloom_add = _helpers.bloom_add
 
 # FIXME: check bloom create() and ShaBloom handling/ownership of "f".
@@ -109,6 +111,7 @@ class ShaBloom:
         self.name = filename
         self.rwfile = None
         self.map = None
+        self._lock = threading.Lock()
         assert(filename.endswith(b'.bloom'))
         if readwrite:
             assert(expected > 0)
@@ -198,16 +201,21 @@ class ShaBloom:
         k = self.k
         return 100*(1-math.exp(-k*float(n)/m))**k
 
-    def add(self, ids):
-        """Add the hashes in ids (packed binary 20-bytes) to the filter."""
+    def add(self, ids, concurrent=False):
+        """Add the hashes in ids (packed binary 20-bytes) to the filter.
+        Threads may add to the same filter at once if they all specify
+        concurrent."""
         if not self.map:
             raise Exception("Cannot add to closed bloom")
-        self.entries += bloom_add(self.map, ids, self.bits, self.k)
+        n = bloom_add(self.map, ids, self.bits, self.k, concurrent)
+        with self._lock:
+            self.entries += n
 
-    def add_idx(self, ix):
+    def add_idx(self, ix, concurrent=False):
         """Add the object to the filter."""
-        self.add(ix.shatable)
-        self.idxnames.append(os.path.basename(ix.name))
+        self.add(ix.shas(), concurrent=concurrent)
+        with self._lock:
+            self.idxnames.append(os.path.basename(ix.name))
 
     def exists(self, sha):
         """Return nonempty if the object probably exists in the bloom filter.
@@ -216,12 +224,24 @@ class ShaBloom:
         If it returns true, there is a small probability that it exists
         anyway, so you'll have to check it some other way.
         """
-        global _total_searches, _total_steps
-        _total_searches += 1
+        _probes.value += 1
         if not self.map:
             return None
         found, steps = bloom_contains(self.map, sha, self.bits, self.k)
-        _total_steps += steps
+        _steps.value += steps
+        if found:
+            _hits.value += 1
+        return found
+
+    def exists_many(self, shas):
+        """Return a bytearray containing a 1 for each of the shas (a
+        buffer of packed 20-byte hashes) that probably exists in the
+        filter (cf. exists()), and a 0 for the rest."""
+        if not self.map:
+            return bytearray(len(shas) // 20)
+        found = bloom_contains_many(self.map, shas, self.bits, self.k)
+        _probes.value += len(found)
+        _hits.value += found.count(b'\1')
         return found
 
     def __len__(self):
@@ -250,5 +270,57 @@ def create(name, expected, delaywrite=None, f=None, k=None):
     return ShaBloom(name, f=f, readwrite=True, expected=expected)
 
 
+def plan_update(filename, sizes, k=None, force=False):
+    """Decide how to bring the bloom filter in filename up to date
+    with a directory's idx files, given sizes, a dict mapping the name
+    of each of them to its object count.  Return (b, add, count),
+    where add lists the idx files that must be added, containing count
+    objects in all, and b is the existing filter, opened for writing,
+    or None if a new one must be created from all of the idx files.
+    add is empty if the filter is already up to date."""
+    assert k in (None, 4, 5)
+    b = None
+    if os.path.exists(filename) and not force:
+        b = ShaBloom(filename)
+        if not b.valid():
+            debug1("bloom: Existing invalid bloom found, regenerating.\n")
+            b = None
+
+    add = []
+    add_count = rest_count = 0
+    for name, n in sizes.items():
+        if b is not None and os.path.basename(name) in b.idxnames:
+            rest_count += n
+        else:
+            add.append(name)
+            add_count += n
+
+    if not add:
+        debug1("bloom: nothing to do.\n")
+        if b is not None:
+            b.close()
+        return None, [], 0
+
+    if b is not None:
+        if len(b) != rest_count:
+            debug1("bloom: size %d != idx total %d, regenerating\n"
+                   % (len(b), rest_count))
+        elif k is not None and k != b.k:
+            debug1("bloom: new k %d != existing k %d, regenerating\n"
+                   % (k, b.k))
+        elif (b.bits < MAX_BLOOM_BITS[b.k] and
+              b.pfalse_positive(add_count) > MAX_PFALSE_POSITIVE):
+            debug1("bloom: regenerating: adding %d entries gives "
+                   "%.2f%% false positives.\n"
+                   % (add_count, b.pfalse_positive(add_count)))
+        else:
+            b.close()
+            return ShaBloom(filename, readwrite=True, expected=add_count), \
+                add, add_count
+        b.close()
+    # Need all idxs to build from scratch
+    return None, list(sizes), add_count + rest_count
+
+
 def clear_bloom(dir):
     unlink(os.path.join(dir, b'bup.bloom'))
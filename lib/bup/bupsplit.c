@@ -117,6 +117,75 @@ int bupsplit_find_ofs(const unsigned char *buf, int len, int *bits)
 }
 
 
+// The gear hash (cf. "FastCDC", Xia et al., USENIX ATC 2016) shifts
+// the hash left and adds a random value for each byte, so its top
+// bits depend on (roughly) the last 64 bytes.  A chunk ends where the
+// top BUP_BLOBBITS bits are all zero, except that no chunk is shorter
+// than BUP_GEAR_MINSIZE (the bytes before that aren't even hashed),
+// and that "normalized chunking" requires BUP_GEAR_NORMALIZATION more
+// zero bits before BUP_BLOBSIZE and that many fewer after it, which
+// narrows the distribution of chunk sizes around BUP_BLOBSIZE.  Like
+// the rollsum, the number of additional zero bits past BUP_BLOBBITS
+// is reported via bits.
+//
+// The table is generated by splitmix64 from a fixed seed, and must
+// never change, or nothing split before the change will deduplicate
+// against anything split after it.
+
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+static void gear_init(void)
+{
+    uint64_t x = 0x62757073706c6974ULL; // "bupsplit"
+    int i;
+    for (i = 0; i < 256; i++)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+
+int bupsplit_gear_find_ofs(const unsigned char *buf, int len, int *bits)
+{
+    const uint64_t mask_small =
+        ~0ULL << (64 - (BUP_BLOBBITS + BUP_GEAR_NORMALIZATION));
+    const uint64_t mask_large =
+        ~0ULL << (64 - (BUP_BLOBBITS - BUP_GEAR_NORMALIZATION));
+    const int normal = len < BUP_BLOBSIZE ? len : BUP_BLOBSIZE;
+    uint64_t h = 0;
+    int count;
+
+    if (!gear_ready)
+        gear_init();
+    for (count = BUP_GEAR_MINSIZE; count < normal; count++)
+    {
+        h = (h << 1) + gear[buf[count]];
+        if (!(h & mask_small))
+            goto found;
+    }
+    for (; count < len; count++)
+    {
+        h = (h << 1) + gear[buf[count]];
+        if (!(h & mask_large))
+            goto found;
+    }
+    return 0;
+
+ found:
+    if (bits)
+    {
+        const int zeros = h ? __builtin_clzll(h) : 64;
+        *bits = zeros > BUP_BLOBBITS ? zeros : BUP_BLOBBITS;
+    }
+    return count+1;
+}
+
+
 #ifndef BUP_NO_SELFTEST
 #define BUP_SELFTEST_SIZE 100000
 
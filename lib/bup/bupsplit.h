@@ -35,12 +35,15 @@
 #define BUP_BLOBSIZE (1<<BUP_BLOBBITS)
 #define BUP_WINDOWBITS (6)
 #define BUP_WINDOWSIZE (1<<BUP_WINDOWBITS)
+#define BUP_GEAR_MINSIZE (BUP_BLOBSIZE/4)
+#define BUP_GEAR_NORMALIZATION (2)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
     
 int bupsplit_find_ofs(const unsigned char *buf, int len, int *bits);
+int bupsplit_gear_find_ofs(const unsigned char *buf, int len, int *bits);
 int bupsplit_selftest(void);
 
 #ifdef __cplusplus
@@ -3,6 +3,7 @@ from __future__ import print_function
 
 from __future__ import absolute_import
 from binascii import hexlify, unhexlify
+from itertools import islice
 import errno, os, re, struct, sys, time, zlib
 import socket
 
@@ -126,6 +127,7 @@ class Client:
                 raise
 
     def close(self):
+        git.wait_for_maintenance()
         if self.conn and not self._busy:
             self.conn.write(b'quit\n')
         if self.pin:
@@ -248,7 +250,8 @@ class Client:
         self.conn.write(b'send-index %s\n' % name)
         n = struct.unpack('!I', self.conn.read(4))[0]
         assert(n)
-        with atomically_replaced_file(fn, 'wb') as f:
+        with git.PackManifest(self.cachedir).adding_idx(name), \
+             atomically_replaced_file(fn, 'wb') as f:
             count = 0
             progress('Receiving index from server: %d/%d\r' % (count, n))
             for b in chunkyreader(self.conn, n):
@@ -287,14 +290,17 @@ class Client:
         idx = None
         for idx in suggested:
             self.sync_index(idx)
-        git.auto_midx(self.cachedir)
+        # Don't hold up the save (or the server) while the cache's
+        # midx and bloom are updated; close() waits for that.
+        git.auto_midx(self.cachedir, background=True)
         if ob:
             self._busy = ob
             self.conn.write(b'%s\n' % ob)
         return idx
 
     def new_packwriter(self, compression_level=1,
-                       max_pack_size=None, max_pack_objects=None):
+                       max_pack_size=None, max_pack_objects=None,
+                       auto_compression=False):
         self._require_command(b'receive-objects-v2')
         self.check_busy()
         def _set_busy():
@@ -308,7 +314,8 @@ class Client:
                                  ensure_busy = self.ensure_busy,
                                  compression_level=compression_level,
                                  max_pack_size=max_pack_size,
-                                 max_pack_objects=max_pack_objects)
+                                 max_pack_objects=max_pack_objects,
+                                 auto_compression=auto_compression)
 
     def read_ref(self, refname):
         self._require_command(b'read-ref')
@@ -322,6 +329,18 @@ class Client:
         else:
             return None   # nonexistent ref
 
+    def config_get(self, name):
+        """Return the remote repository's value for the git config
+        setting name (in the bup section), or None if it's not set,
+        or if the server can't say."""
+        if b'config-get' not in self._available_commands:
+            return None
+        self.check_busy()
+        self.conn.write(b'config-get %s\n' % name)
+        r = self.conn.readline().strip()
+        self.check_ok()
+        return r or None
+
     def update_ref(self, refname, newval, oldval):
         self._require_command(b'update-ref')
         self.check_busy()
@@ -346,38 +365,58 @@ class Client:
         if e:
             raise KeyError(str(e))
 
-    def cat_batch(self, refs):
+    def cat_batch(self, refs, window=None):
+        """Yield (oidx, type, size, data_iterator) for each ref in refs,
+        in order, or (None, None, None, None) for any ref that
+        doesn't exist.  The refs are sent in cat-batch requests of up
+        to window refs (default git.cat_batch_window), and each
+        request is sent before the results of the previous one are
+        read, so a batch costs about one round trip, not one per ref.
+
+        """
         self._require_command(b'cat-batch')
+        window = window or git.cat_batch_window
         self.check_busy()
+        refs = iter(refs)
+        batch = tuple(islice(refs, window))
+        if not batch:
+            return
         self._busy = b'cat-batch'
         conn = self.conn
-        conn.write(b'cat-batch\n')
-        # FIXME: do we want (only) binary protocol?
-        for ref in refs:
-            assert ref
-            assert b'\n' not in ref
-            conn.write(ref)
+        def request(batch):
+            conn.write(b'cat-batch\n')
+            # FIXME: do we want (only) binary protocol?
+            for ref in batch:
+                assert ref
+                assert b'\n' not in ref
+                conn.write(ref)
+                conn.write(b'\n')
             conn.write(b'\n')
-        conn.write(b'\n')
-        for ref in refs:
-            info = conn.readline()
-            if info == b'missing\n':
-                yield None, None, None, None
-                continue
-            if not (info and info.endswith(b'\n')):
-                raise ClientError('Hit EOF while looking for object info: %r'
-                                  % info)
-            oidx, oid_t, size = info.split(b' ')
-            size = int(size)
-            cr = chunkyreader(conn, size)
-            yield oidx, oid_t, size, cr
-            detritus = next(cr, None)
-            if detritus:
-                raise ClientError('unexpected leftover data ' + repr(detritus))
-        # FIXME: confusing
-        not_ok = self.check_ok()
-        if not_ok:
-            raise not_ok
+        request(batch)
+        while batch:
+            next_batch = tuple(islice(refs, window))
+            if next_batch:
+                request(next_batch)
+            for ref in batch:
+                info = conn.readline()
+                if info == b'missing\n':
+                    yield None, None, None, None
+                    continue
+                if not (info and info.endswith(b'\n')):
+                    raise ClientError('Hit EOF while looking for object info: %r'
+                                      % info)
+                oidx, oid_t, size = info.split(b' ')
+                size = int(size)
+                cr = chunkyreader(conn, size)
+                yield oidx, oid_t, size, cr
+                detritus = next(cr, None)
+                if detritus:
+                    raise ClientError('unexpected leftover data ' + repr(detritus))
+            # FIXME: confusing
+            not_ok = self.check_ok()
+            if not_ok:
+                raise not_ok
+            batch = next_batch
         self._not_busy()
 
     def refs(self, patterns=None, limit_to_heads=False, limit_to_tags=False):
@@ -488,12 +527,14 @@ class PackWriter_Remote(git.PackWriter):
                  ensure_busy,
                  compression_level=1,
                  max_pack_size=None,
-                 max_pack_objects=None):
+                 max_pack_objects=None,
+                 auto_compression=False):
         git.PackWriter.__init__(self,
                                 objcache_maker=objcache_maker,
                                 compression_level=compression_level,
                                 max_pack_size=max_pack_size,
-                                max_pack_objects=max_pack_objects)
+                                max_pack_objects=max_pack_objects,
+                                auto_compression=auto_compression)
         self.file = conn
         self.filename = b'remote socket'
         self.suggest_packs = suggest_packs
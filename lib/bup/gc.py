@@ -4,7 +4,7 @@ from binascii import hexlify, unhexlify
 from os.path import basename
 import glob, os, subprocess, sys, tempfile
 
-from bup import bloom, git, midx
+from bup import bloom, git, metrics, midx
 from bup.compat import hexstr, range
 from bup.git import MissingObject, walk_object
 from bup.helpers import Nonlocal, log, progress, qprogress
@@ -165,10 +165,9 @@ def sweep(live_objects, existing_count, cat_pipe, threshold, compression,
                       % ((float(collect_count) / existing_count) * 100))
         idx = git.open_idx(idx_name)
 
-        idx_live_count = 0
-        for sha in idx:
-            if live_objects.exists(sha):
-                idx_live_count += 1
+        shas = idx.shas()
+        live = live_objects.exists_many(shas)
+        idx_live_count = live.count(b'\1')
 
         collect_count += idx_live_count
         if idx_live_count == 0:
@@ -189,11 +188,13 @@ def sweep(live_objects, existing_count, cat_pipe, threshold, compression,
         if verbosity:
             log('rewriting %s (%.2f%% live)\n' % (basename(idx_name),
                                                   live_frac * 100))
-        for sha in idx:
-            if live_objects.exists(sha):
-                item_it = cat_pipe.get(hexlify(sha))
-                _, typ, _ = next(item_it)
-                writer.just_write(sha, typ, b''.join(item_it))
+        i = live.find(b'\1')
+        while i >= 0:
+            sha = bytes(shas[i * 20 : (i + 1) * 20])
+            item_it = cat_pipe.get(hexlify(sha))
+            _, typ, _ = next(item_it)
+            writer.just_write(sha, typ, b''.join(item_it))
+            i = live.find(b'\1', i + 1)
 
         ns.stale_files.append(idx_name)
         ns.stale_files.append(idx_name[:-3] + b'pack')
@@ -228,8 +229,9 @@ def bup_gc(threshold=10, compression=1, verbosity=0):
             log('nothing to collect\n')
     else:
         try:
-            live_objects = find_live_objects(existing_count, cat_pipe,
-                                             verbosity=verbosity)
+            with metrics.timed('gc.find_live'):
+                live_objects = find_live_objects(existing_count, cat_pipe,
+                                                 verbosity=verbosity)
         except MissingObject as ex:
             log('bup: missing object %r \n' % hexstr(ex.oid))
             sys.exit(1)
@@ -246,8 +248,9 @@ def bup_gc(threshold=10, compression=1, verbosity=0):
             expirelog = subprocess.Popen(expirelog_cmd, env=git._gitenv())
             git._git_wait(b' '.join(expirelog_cmd), expirelog)
             if verbosity: log('removing unreachable data\n')
-            sweep(live_objects, existing_count, cat_pipe,
-                  threshold, compression,
-                  verbosity)
+            with metrics.timed('gc.sweep'):
+                sweep(live_objects, existing_count, cat_pipe,
+                      threshold, compression,
+                      verbosity)
         finally:
             live_objects.close()
@@ -5,13 +5,15 @@ interact with the Git data structures.
 
 from __future__ import absolute_import, print_function
 import errno, os, sys, zlib, time, subprocess, struct, stat, re, tempfile, glob
+import fcntl, threading
 from array import array
 from binascii import hexlify, unhexlify
-from collections import namedtuple
+from collections import deque, namedtuple
+from contextlib import contextmanager
 from itertools import islice
 from numbers import Integral
 
-from bup import _helpers, compat, hashsplit, path, midx, bloom, xstat
+from bup import _helpers, compat, hashsplit, metrics, midx, bloom, xstat
 from bup.compat import (buffer,
                         byte_int, bytes_from_byte, bytes_from_uint,
                         environ,
@@ -24,7 +26,7 @@ from bup.helpers import (Sha1, add_error, chunkyreader, debug1, debug2,
                          hostname, localtime, log,
                          merge_dict,
                          merge_iter,
-                         mmap_read, mmap_readwrite,
+                         mmap_read,
                          parse_num,
                          progress, qprogress, stat_if_exists,
                          unlink,
@@ -39,8 +41,21 @@ _typemap =  {b'blob': 3, b'tree': 2, b'commit': 1, b'tag': 4}
 _typermap = {v: k for k, v in items(_typemap)}
 
 
-_total_searches = 0
-_total_steps = 0
+_idx_probes = metrics.counter('idx.probes')
+_idx_steps = metrics.counter('idx.steps')
+_exists_calls = metrics.counter('packidxlist.exists')
+_exists_found = metrics.counter('packidxlist.found')
+_bloom_false_positives = metrics.counter('bloom.false_positives')
+_hashed_bytes = metrics.counter('git.hashed_bytes')
+_pack_objects = metrics.counter('pack.objects')
+_pack_raw_bytes = metrics.counter('pack.raw_bytes')
+_pack_written_bytes = metrics.counter('pack.written_bytes')
+_pack_compress_time = metrics.histogram('pack.compress')
+_pack_borrowed = metrics.counter('pack.borrowed')
+_pack_borrowed_written = metrics.counter('pack.borrowed_written')
+_manifest_hits = metrics.counter('packidxlist.manifest_hits')
+_manifest_scans = metrics.counter('packidxlist.scans')
+_cat_latency = metrics.histogram('catpipe.latency')
 
 
 class GitError(Exception):
@@ -188,26 +203,226 @@ def all_packdirs():
     return paths
 
 
-def auto_midx(objdir):
-    args = [path.exe(), b'midx', b'--auto', b'--dir', objdir]
-    try:
-        rv = subprocess.call(args, stdout=open(os.devnull, 'w'))
-    except OSError as e:
-        # make sure 'args' gets printed to help with debugging
-        add_error('%r: exception: %s' % (args, e))
-        raise
-    if rv:
-        add_error('%r: returned %d' % (args, rv))
-
-    args = [path.exe(), b'bloom', b'--dir', objdir]
-    try:
-        rv = subprocess.call(args, stdout=open(os.devnull, 'w'))
-    except OSError as e:
-        # make sure 'args' gets printed to help with debugging
-        add_error('%r: exception: %s' % (args, e))
-        raise
-    if rv:
-        add_error('%r: returned %d' % (args, rv))
+class PackMaintainer:
+    """Keep the midx and bloom files in a pack directory up to date,
+    in-process, the way `bup midx --auto` (which uses update_midx())
+    and `bup bloom` would.
+
+    The object counts (and midx contents) of the files it has opened
+    are remembered across updates, so each update only has to open
+    the files that have appeared since the last one.  That's safe
+    because idx and midx files are named after their contents.
+
+    Updates requested in the background are run by a thread, and
+    requests made while one is running are coalesced into a single
+    later update.  Since other PackIdxLists may be reading the
+    directory meanwhile, background updates leave the removal of
+    redundant midx files to PackIdxList.refresh().
+
+    """
+    HWM = 5
+    LWM = 2
+
+    def __init__(self, objdir):
+        self.dir = objdir
+        self.sizes = {}
+        self.mtimes = {}
+        self.contents = {}
+        self.lock = threading.Lock()
+        self.state_lock = threading.Lock()
+        self.thread = None
+        self.pending = False
+
+    def _scan(self, pattern):
+        """Return the names of the files in the directory matching
+        pattern, opening any new ones to record their sizes."""
+        names = []
+        for name in glob.glob(os.path.join(self.dir, pattern)):
+            if name not in self.sizes:
+                try:
+                    ix = open_idx(name)
+                    self.mtimes[name] = xstat.stat(name).st_mtime
+                except (IOError, OSError) as e:
+                    if e.errno != errno.ENOENT:
+                        raise
+                    continue  # Removed by someone else
+                self.sizes[name] = len(ix)
+                if isinstance(ix, midx.PackMidx):
+                    self.contents[name] = [os.path.join(self.dir, n)
+                                           for n in ix.idxnames]
+                    ix.close()
+            names.append(name)
+        return names
+
+    def _forget(self, names):
+        for name in names:
+            self.sizes.pop(name, None)
+            self.mtimes.pop(name, None)
+            self.contents.pop(name, None)
+
+    def _write_midxs(self, infilenames, force, outfilename, max_files):
+        n = max_files or midx.max_files()
+        for group in (infilenames[i : i + n]
+                      for i in range(0, len(infilenames), n)):
+            ixs = [open_idx(name) for name in group]
+            try:
+                total = sum(len(ix) for ix in ixs)
+                debug1('midx: creating from %d files (%d objects).\n'
+                       % (len(group), total))
+                if len(group) < 2 \
+                   or (force and not total) \
+                   or (not force and total < 1024 and len(group) < 3):
+                    debug1('midx: nothing to do.\n')
+                    continue
+                name = outfilename \
+                    or os.path.join(self.dir, b'midx-%s.midx'
+                                    % hexlify(Sha1(b'\0'.join(group))
+                                              .digest()))
+                midx.write(name, ixs)
+            finally:
+                for ix in ixs:
+                    if isinstance(ix, midx.PackMidx):
+                        ix.close()
+            self._forget([name])
+            self._scan(os.path.basename(name))
+            yield total, name
+
+    def update_midx(self, force=False, ignore_midx=False, outfilename=None,
+                    max_files=None, background=False):
+        """Merge the directory's idx and midx files into new midx
+        files until there are no more than HWM of them (or just one,
+        if force is true), and return the names of the files that
+        remain.  Redundant midx files are removed (unless background
+        is true), and if ignore_midx is true, the existing midx files
+        are ignored.  This is `bup midx --auto` (or `--force`)."""
+        with self.lock:
+            return self._update_midx(force, ignore_midx, outfilename,
+                                     max_files, background)
+
+    def _update_midx(self, force=False, ignore_midx=False, outfilename=None,
+                     max_files=None, background=False):
+        midxs = [] if ignore_midx else self._scan(b'*.midx')
+        idxs = self._scan(b'*.idx')
+        if not ignore_midx:
+            self._forget(set(self.sizes) - set(midxs) - set(idxs))
+
+        # Ignore the smaller (or older) midxes that are made redundant
+        # by bigger (or newer) ones, like PackIdxList.refresh().
+        midxs.sort(key=lambda name: (-self.sizes[name], -self.mtimes[name]))
+        covered = set()
+        redundant = set()
+        for name in midxs:
+            new = set(self.contents[name]) - covered
+            if new:
+                covered |= new
+            else:
+                redundant.add(name)
+        if not background:
+            for name in redundant:
+                debug1('%r is redundant\n' % name)
+                unlink(name)
+            self._forget(redundant)
+
+        all = [(self.sizes[name], name) for name in midxs + idxs
+               if name not in redundant and name not in covered]
+        hwm, lwm = (1, 1) if force else (self.HWM, self.LWM)
+        debug1('midx: %d indexes; want no more than %d.\n' % (len(all), hwm))
+        if len(all) <= hwm:
+            debug1('midx: nothing to do.\n')
+        while len(all) > hwm:
+            all.sort()
+            part1 = [name for sz, name in all[:len(all) - lwm + 1]]
+            part2 = all[len(all) - lwm + 1:]
+            all = list(self._write_midxs(part1, force, outfilename,
+                                         max_files)) + part2
+            if len(all) > hwm:
+                debug1('\nStill too many indexes (%d > %d).  Merging again.\n'
+                       % (len(all), hwm))
+        return [name for sz, name in all]
+
+    def _update_bloom(self):
+        idxs = [name for name in self.sizes if name.endswith(b'.idx')]
+        outfilename = os.path.join(self.dir, b'bup.bloom')
+        b, add, add_count = bloom.plan_update(outfilename,
+                                              dict((name, self.sizes[name])
+                                                   for name in idxs))
+        if not add:
+            return
+        debug1('bloom: %s %d files (%d objects).\n'
+               % (b is None and 'creating from' or 'adding',
+                  len(add), add_count))
+        tfname = None
+        if b is None:
+            tfname = os.path.join(self.dir, b'bup.tmp.bloom')
+            b = bloom.create(tfname, expected=add_count)
+        for name in add:
+            b.add_idx(open_idx(name))
+        b.close()
+        if tfname:
+            os.rename(tfname, outfilename)
+
+    def update(self, background=False):
+        """Bring the midx and bloom files up to date now."""
+        with self.lock:
+            if not os.path.exists(self.dir):
+                return
+            self._update_midx(background=background)
+            self._update_bloom()
+
+    def _update_noting_errors(self, background):
+        # As when this was done by running `bup midx` and `bup bloom`,
+        # a failure shouldn't affect whatever requested the update.
+        try:
+            self.update(background=background)
+        except (IOError, OSError, GitError) as e:
+            add_error('%s: midx/bloom update failed: %s'
+                      % (path_msg(self.dir), e))
+
+    def _run(self):
+        while True:
+            with self.state_lock:
+                if not self.pending:
+                    self.thread = None
+                    return
+                self.pending = False
+            self._update_noting_errors(background=True)
+
+    def request(self, background=False):
+        """Update the midx and bloom files, or if background is true,
+        arrange for a thread to do so soon."""
+        if not background:
+            self._update_noting_errors(background=False)
+            return
+        with self.state_lock:
+            self.pending = True
+            if self.thread:
+                return
+            self.thread = threading.Thread(target=self._run)
+            self.thread.start()
+
+    def wait(self):
+        """Wait for any background update to finish."""
+        thread = self.thread
+        if thread:
+            thread.join()
+
+
+_maintainers = {}
+
+def auto_midx(objdir, background=False):
+    """Update the midx and bloom files in objdir (cf. PackMaintainer),
+    in the background if requested (cf. wait_for_maintenance())."""
+    key = os.path.realpath(objdir)
+    m = _maintainers.get(key)
+    if not m:
+        m = _maintainers[key] = PackMaintainer(objdir)
+    m.request(background=background)
+
+
+def wait_for_maintenance():
+    """Wait for all of the background auto_midx() updates to finish."""
+    for m in list(_maintainers.values()):
+        m.wait()
 
 
 def mangle_name(name, mode, gitmode):
@@ -251,6 +466,7 @@ def demangle_name(name, mode):
 def calc_hash(type, content):
     """Calculate some content's hash in the Git fashion."""
     header = b'%s %d\0' % (type, len(content))
+    _hashed_bytes.value += len(content)
     sum = Sha1(header)
     sum.update(content)
     return sum.digest()
@@ -267,38 +483,21 @@ def shalist_item_sort_key(ent):
 
 def tree_encode(shalist):
     """Generate a git tree object from (mode,name,hash) tuples."""
-    shalist = sorted(shalist, key = shalist_item_sort_key)
-    l = []
-    for (mode,name,bin) in shalist:
-        assert(mode)
-        assert(mode+0 == mode)
-        assert(name)
-        assert(len(bin) == 20)
-        s = b'%o %s\0%s' % (mode,name,bin)
-        assert s[0] != b'0'  # 0-padded octal is not acceptable in a git tree
-        l.append(s)
-    return b''.join(l)
+    return _helpers.tree_encode(shalist)
 
 
 def tree_decode(buf):
     """Generate a list of (mode,name,hash) from the git tree object in buf."""
-    ofs = 0
-    while ofs < len(buf):
-        z = buf.find(b'\0', ofs)
-        assert(z > ofs)
-        spl = buf[ofs:z].split(b' ', 1)
-        assert(len(spl) == 2)
-        mode,name = spl
-        sha = buf[z+1:z+1+20]
-        ofs = z+1+20
-        yield (int(mode, 8), name, sha)
+    return iter(_helpers.tree_decode(buf))
 
 
-def _encode_packobj(type, content, compression_level=1):
-    if compression_level not in (0, 1, 2, 3, 4, 5, 6, 7, 8, 9):
-        raise ValueError('invalid compression level %s' % compression_level)
+def _check_compression_level(level):
+    if level not in (0, 1, 2, 3, 4, 5, 6, 7, 8, 9):
+        raise ValueError('invalid compression level %s' % level)
+
+
+def _encode_packobj_header(type, sz):
     szout = b''
-    sz = len(content)
     szbits = (sz & 0x0f) | (_typemap[type]<<4)
     sz >>= 4
     while 1:
@@ -308,12 +507,96 @@ def _encode_packobj(type, content, compression_level=1):
             break
         szbits = sz & 0x7f
         sz >>= 7
+    return szout
+
+
+def _encode_packobj(type, content, compression_level=1):
+    _check_compression_level(compression_level)
     z = zlib.compressobj(compression_level)
-    yield szout
+    yield _encode_packobj_header(type, len(content))
     yield z.compress(content)
     yield z.flush()
 
 
+# A blob is deflated a sample at a time, and if the first sample
+# doesn't shrink to less than this fraction of its size, the blob is
+# assumed to be incompressible (media, archives, encrypted data, ...)
+# and stored at level 0 instead.
+_compression_probe_len = 1024
+_compression_probe_max_ratio = 0.95
+# How much of a stream auto mode looks at before choosing its level.
+_compression_auto_sample_len = 256 * 1024
+
+
+class PackCompression:
+    """Choose a compression level for each object written to a pack.
+
+    Blobs are probed as they're deflated (see _deflate_probed()), and
+    stored at level 0 when deflate doesn't help.  In auto mode, the
+    ratio observed at the start of each stream (see start_stream())
+    picks the level for the rest of that stream, after which the
+    stream's blobs are no longer probed.
+    """
+    def __init__(self, level=1, auto=False):
+        _check_compression_level(level)
+        self.level = level
+        self.auto = auto
+        self.objects = self.stored = 0
+        self.bytes_in = self.bytes_out = 0
+        self.start_stream()
+
+    def start_stream(self):
+        """Forget the ratio observed for the current stream (i.e. file)."""
+        self._stream_in = self._stream_out = 0
+        self._stream_level = None
+
+    def _deflate_probed(self, content):
+        z = zlib.compressobj(self.level)
+        head = z.compress(content[:_compression_probe_len])
+        head += z.flush(zlib.Z_SYNC_FLUSH)
+        if len(head) >= _compression_probe_len * _compression_probe_max_ratio:
+            z = zlib.compressobj(0)
+            return 0, [z.compress(content), z.flush()]
+        rest = buffer(content, _compression_probe_len)
+        return self.level, [head, z.compress(rest), z.flush()]
+
+    def encode(self, type, content):
+        """Return the pack encoding of content as a list of bytes."""
+        level = self.level
+        if self._stream_level is not None:
+            level = self._stream_level
+        if type == b'blob' and level \
+           and self._stream_level is None \
+           and len(content) > _compression_probe_len:
+            level, data = self._deflate_probed(content)
+        else:
+            z = zlib.compressobj(level)
+            data = [z.compress(content), z.flush()]
+        nin = len(content)
+        nout = sum(len(x) for x in data)
+        self.objects += 1
+        self.bytes_in += nin
+        self.bytes_out += nout
+        if level == 0 and self.level:
+            self.stored += 1
+        if self.auto and type == b'blob' and self._stream_level is None:
+            self._stream_in += nin
+            self._stream_out += nout
+            if self._stream_in >= _compression_auto_sample_len:
+                ratio = self._stream_out / float(self._stream_in)
+                if ratio >= _compression_probe_max_ratio:
+                    self._stream_level = 0
+                else:
+                    self._stream_level = self.level
+        data.insert(0, _encode_packobj_header(type, nin))
+        return data
+
+    def summary(self):
+        return ('compression: %d objects, %d stored uncompressed,'
+                ' %d bytes -> %d bytes\n'
+                % (self.objects, self.stored, self.bytes_in, self.bytes_out))
+
+
 def _encode_looseobj(type, content, compression_level=1):
     z = zlib.compressobj(compression_level)
     yield z.compress(b'%s %d\0' % (type, len(content)))
@@ -369,26 +652,24 @@ class PackIdx:
             return want_source and os.path.basename(self.name) or True
         return None
 
+    def exists_many(self, hashes):
+        """Return a list containing the index in this idx of each of the
+        hashes (a buffer of packed 20-byte hashes), or None for those
+        that don't exist."""
+        _idx_probes.value += len(hashes) // 20
+        idxs, steps = _helpers.idx_find_many(self.map, self.fanout_ofs,
+                                             self.hash_ofs, self.stride,
+                                             hashes)
+        _idx_steps.value += steps
+        return idxs
+
     def _idx_from_hash(self, hash):
-        global _total_searches, _total_steps
-        _total_searches += 1
+        _idx_probes.value += 1
         assert(len(hash) == 20)
-        b1 = byte_int(hash[0])
-        start = self.fanout[b1-1] # range -1..254
-        end = self.fanout[b1] # range 0..255
-        want = hash
-        _total_steps += 1  # lookup table is a step
-        while start < end:
-            _total_steps += 1
-            mid = start + (end - start) // 2
-            v = self._idx_to_hash(mid)
-            if v < want:
-                start = mid+1
-            elif v > want:
-                end = mid
-            else: # got it!
-                return mid
-        return None
+        idx, steps = _helpers.idx_find(self.map, self.fanout_ofs,
+                                       self.hash_ofs, self.stride, hash)
+        _idx_steps.value += steps
+        return idx
 
 
 class PackIdxV1(PackIdx):
@@ -398,12 +679,16 @@ class PackIdxV1(PackIdx):
         self.idxnames = [self.name]
         self.map = mmap_read(f)
         # Min size for 'L' is 4, which is sufficient for struct's '!I'
-        self.fanout = array('L', struct.unpack('!256I', self.map))
+        self.fanout = array('L', struct.unpack_from('!256I', self.map))
         self.fanout.append(0)  # entry "-1"
         self.nsha = self.fanout[255]
         self.sha_ofs = 256 * 4
         # Avoid slicing shatable for individual hashes (very high overhead)
         self.shatable = buffer(self.map, self.sha_ofs, self.nsha * 24)
+        # Where _helpers.idx_find() et al. should look
+        self.fanout_ofs = 0
+        self.hash_ofs = self.sha_ofs + 4
+        self.stride = 24
 
     def __len__(self):
         return int(self.nsha)  # int() from long for python 2
@@ -425,6 +710,11 @@ class PackIdxV1(PackIdx):
         for ofs in range(start, start + 24 * self.nsha, 24):
             yield self.map[ofs : ofs + 20]
 
+    def shas(self):
+        """Return all of the hashes, in order, as one buffer of packed
+        20-byte hashes."""
+        return _helpers.idx_shas(self.map, self.hash_ofs, 24, self.nsha)
+
 
 class PackIdxV2(PackIdx):
     """Object representation of a Git pack index (version 2) file."""
@@ -442,6 +732,10 @@ class PackIdxV2(PackIdx):
         self.ofs64table_ofs = self.ofstable_ofs + self.nsha * 4
         # Avoid slicing this for individual hashes (very high overhead)
         self.shatable = buffer(self.map, self.sha_ofs, self.nsha*20)
+        # Where _helpers.idx_find() et al. should look
+        self.fanout_ofs = 8
+        self.hash_ofs = self.sha_ofs
+        self.stride = 20
 
     def __len__(self):
         return int(self.nsha)  # int() from long for python 2
@@ -468,6 +762,149 @@ class PackIdxV2(PackIdx):
         for ofs in range(start, start + 20 * self.nsha, 20):
             yield self.map[ofs : ofs + 20]
 
+    def shas(self):
+        """Return all of the hashes, in order, as one buffer of packed
+        20-byte hashes."""
+        return self.shatable
+
+
+class PackManifest:
+    """The idx and midx files that a PackIdxList uses for a directory,
+    with their object counts and the number of idx files each covers,
+    recorded in dir/bup.manifest so that later PackIdxLists can skip
+    scanning the directory (and opening every midx to see which idx
+    files it covers).
+
+    The manifest is only current while the directory's mtime (and
+    inode) match the ones recorded in it, so anything that adds or
+    removes a file there makes it stale, and the next PackIdxList
+    rescans the directory and rewrites it.  The manifest's always
+    rewritten in place (so doing that doesn't change the mtime), while
+    holding a flock on it, and has a trailing checksum so that readers,
+    which don't lock, can detect a partial write.
+
+    Anything that adds an idx file should do so via adding_idx(),
+    which keeps a current manifest current (as PackWriter and the
+    client's index cache do).  Otherwise, a file added within the
+    same filesystem timestamp tick as the manifest's last update could
+    be missed.  Missing a new midx is harmless (the idx files it
+    covers are still listed), and removing a listed file just makes
+    the manifest stale when PackIdxList can't open it.  If the
+    manifest can't be written, it's left empty (and so never current),
+    and PackIdxList just scans the directory.
+
+    """
+    HEADER = struct.Struct('!8sIqqI')
+    ENTRY = struct.Struct('!qII')    # objects, idx files covered, name length
+    MAGIC = b'BUPMANI\0'
+    VERSION = 2
+
+    def __init__(self, dir):
+        self.dir = dir
+        self.name = os.path.join(dir, b'bup.manifest')
+
+    def stamp(self):
+        st = xstat.stat(self.dir)
+        return st.st_ino, st.st_mtime
+
+    def read(self):
+        """Return a list of (name, objects, idx_files_covered) tuples
+        for the files in the manifest, if it's current, else None."""
+        try:
+            with open(self.name, 'rb') as f:
+                data = f.read()
+        except IOError as e:
+            if e.errno == errno.ENOENT:
+                return None
+            raise
+        if len(data) < self.HEADER.size + 20 \
+           or Sha1(data[:-20]).digest() != data[-20:]:
+            return None
+        magic, version, ino, mtime, count = self.HEADER.unpack_from(data)
+        if magic != self.MAGIC or version != self.VERSION:
+            return None
+        if (ino, mtime) != self.stamp():
+            return None
+        entries = []
+        ofs = self.HEADER.size
+        for i in range(count):
+            objects, covers, namelen = self.ENTRY.unpack_from(data, ofs)
+            ofs += self.ENTRY.size
+            entries.append((data[ofs : ofs + namelen], objects, covers))
+            ofs += namelen
+        return entries
+
+    def lock(self):
+        """Return the manifest, opened for writing, once it's been
+        locked, or None if it's not writable.  The lock is held until
+        the file is closed."""
+        try:
+            fd = os.open(self.name, os.O_RDWR | os.O_CREAT, 0o666)
+        except OSError as e:
+            if e.errno in (errno.EACCES, errno.EPERM, errno.EROFS):
+                return None
+            raise
+        try:
+            f = os.fdopen(fd, 'r+b')
+        except:
+            os.close(fd)
+            raise
+        try:
+            fcntl.flock(f.fileno(), fcntl.LOCK_EX)
+        except:
+            f.close()
+            raise
+        return f
+
+    @contextmanager
+    def adding_idx(self, idxname, objects=None):
+        """Return a context manager within which the idx file
+        idxname, containing objects (default: however many it turns
+        out to have), should be moved into the directory.  If the
+        manifest was current beforehand, it will include the idx
+        afterward."""
+        f = self.lock()
+        try:
+            entries = f and self.read()
+            yield
+            if entries is not None:
+                if idxname not in (name for name, n, covers in entries):
+                    if objects is None:
+                        objects = len(open_idx(os.path.join(self.dir,
+                                                            idxname)))
+                    entries.append((idxname, objects, 1))
+                self.write(f, self.stamp(), entries)
+        finally:
+            if f:
+                f.close()
+
+    def write(self, f, stamp, entries):
+        """Replace the content of f, as returned by lock(), with
+        entries (cf. read()), as of the directory's stamp().  Return
+        False, leaving f empty if possible, if that can't be done."""
+        try:
+            data = [self.HEADER.pack(self.MAGIC, self.VERSION,
+                                     stamp[0], stamp[1], len(entries))]
+            for name, objects, covers in entries:
+                data.append(self.ENTRY.pack(objects, covers, len(name)))
+                data.append(name)
+            data = b''.join(data)
+            f.seek(0)
+            f.write(data + Sha1(data).digest())
+            f.truncate()
+            f.flush()
+            return True
+        except (struct.error, IOError, OSError) as e:
+            debug1('%s: cannot write manifest: %s\n'
+                   % (path_msg(self.name), e))
+        try:
+            f.seek(0)
+            f.truncate()
+            f.flush()
+        except (IOError, OSError):
+            pass
+        return False
+
 
 _mpi_count = 0
 class PackIdxList:
@@ -496,24 +933,26 @@ class PackIdxList:
 
     def exists(self, hash, want_source=False):
         """Return nonempty if the object exists in the index files."""
-        global _total_searches
-        _total_searches += 1
+        _exists_calls.value += 1
         if hash in self.also:
             return True
+        bloom_hit = False
         if self.do_bloom and self.bloom:
             if self.bloom.exists(hash):
                 self.do_bloom = False
+                bloom_hit = True
             else:
-                _total_searches -= 1  # was counted by bloom
                 return None
         for i in range(len(self.packs)):
             p = self.packs[i]
-            _total_searches -= 1  # will be incremented by sub-pack
             ix = p.exists(hash, want_source=want_source)
             if ix:
                 # reorder so most recently used packs are searched first
                 self.packs = [p] + self.packs[:i] + self.packs[i+1:]
+                _exists_found.value += 1
                 return ix
+        if bloom_hit:
+            _bloom_false_positives.value += 1
         self.do_bloom = True
         return None
 
@@ -532,63 +971,14 @@ class PackIdxList:
         self.bloom = None # Always reopen the bloom as it may have been relaced
         self.do_bloom = False
         skip_midx = skip_midx or self.ignore_midx
-        d = dict((p.name, p) for p in self.packs
-                 if not skip_midx or not isinstance(p, midx.PackMidx))
         if os.path.exists(self.dir):
-            if not skip_midx:
-                midxl = []
-                for ix in self.packs:
-                    if isinstance(ix, midx.PackMidx):
-                        for name in ix.idxnames:
-                            d[os.path.join(self.dir, name)] = ix
-                for full in glob.glob(os.path.join(self.dir,b'*.midx')):
-                    if not d.get(full):
-                        mx = midx.PackMidx(full)
-                        (mxd, mxf) = os.path.split(mx.name)
-                        broken = False
-                        for n in mx.idxnames:
-                            if not os.path.exists(os.path.join(mxd, n)):
-                                log(('warning: index %s missing\n'
-                                     '  used by %s\n')
-                                    % (path_msg(n), path_msg(mxf)))
-                                broken = True
-                        if broken:
-                            mx.close()
-                            del mx
-                            unlink(full)
-                        else:
-                            midxl.append(mx)
-                midxl.sort(key=lambda ix:
-                           (-len(ix), -xstat.stat(ix.name).st_mtime))
-                for ix in midxl:
-                    any_needed = False
-                    for sub in ix.idxnames:
-                        found = d.get(os.path.join(self.dir, sub))
-                        if not found or isinstance(found, PackIdx):
-                            # doesn't exist, or exists but not in a midx
-                            any_needed = True
-                            break
-                    if any_needed:
-                        d[ix.name] = ix
-                        for name in ix.idxnames:
-                            d[os.path.join(self.dir, name)] = ix
-                    elif not ix.force_keep:
-                        debug1('midx: removing redundant: %s\n'
-                               % path_msg(os.path.basename(ix.name)))
-                        ix.close()
-                        unlink(ix.name)
-            for full in glob.glob(os.path.join(self.dir, b'*.idx')):
-                if not d.get(full):
-                    try:
-                        ix = open_idx(full)
-                    except GitError as e:
-                        add_error(e)
-                        continue
-                    d[full] = ix
+            if skip_midx:
+                self.packs = self._scan(skip_midx)
+            else:
+                self.packs = self._refresh_from_manifest()
             bfull = os.path.join(self.dir, b'bup.bloom')
             if self.bloom is None and os.path.exists(bfull):
                 self.bloom = bloom.ShaBloom(bfull)
-            self.packs = list(set(d.values()))
             self.packs.sort(reverse=True, key=lambda x: len(x))
             if self.bloom and self.bloom.valid() and len(self.bloom) >= len(self):
                 self.do_bloom = True
@@ -597,6 +987,110 @@ class PackIdxList:
         debug1('PackIdxList: using %d index%s.\n'
             % (len(self.packs), len(self.packs)!=1 and 'es' or ''))
 
+    def _open_listed(self, entries):
+        """Return the open idx and midx files listed in the manifest
+        entries, or None if entries is None or any of them is gone."""
+        if entries is None:
+            return None
+        known = dict((p.name, p) for p in self.packs)
+        packs = []
+        for name, objects, covers in entries:
+            full = os.path.join(self.dir, name)
+            ix = known.get(full)
+            if not ix:
+                try:
+                    ix = open_idx(full)
+                except (IOError, OSError) as e:
+                    if e.errno != errno.ENOENT:
+                        raise
+                    return None
+                except GitError:
+                    return None
+            packs.append(ix)
+        _manifest_hits.value += 1
+        return packs
+
+    def _refresh_from_manifest(self):
+        manifest = PackManifest(self.dir)
+        packs = self._open_listed(manifest.read())
+        if packs is not None:
+            return packs
+        f = manifest.lock()
+        try:
+            # Someone else may have rebuilt it while we waited.
+            packs = f and self._open_listed(manifest.read())
+            if packs is None:
+                stamp = manifest.stamp()
+                packs = self._scan(skip_midx=False)
+                if f:
+                    manifest.write(f, stamp,
+                                   [(os.path.basename(p.name), len(p),
+                                     len(p.idxnames)) for p in packs])
+        finally:
+            if f:
+                f.close()
+        return packs
+
+    def _scan(self, skip_midx):
+        """Return the idx and midx files that cover every idx in the
+        directory, removing any broken or redundant midx files."""
+        _manifest_scans.value += 1
+        d = dict((p.name, p) for p in self.packs
+                 if not skip_midx or not isinstance(p, midx.PackMidx))
+        idxfiles = glob.glob(os.path.join(self.dir, b'*.idx'))
+        if not skip_midx:
+            present = set(idxfiles)
+            midxl = []
+            for ix in self.packs:
+                if isinstance(ix, midx.PackMidx):
+                    for name in ix.idxnames:
+                        d[os.path.join(self.dir, name)] = ix
+            for full in glob.glob(os.path.join(self.dir,b'*.midx')):
+                if not d.get(full):
+                    mx = midx.PackMidx(full)
+                    mxf = os.path.basename(mx.name)
+                    broken = False
+                    for n in mx.idxnames:
+                        if os.path.join(self.dir, n) not in present:
+                            log(('warning: index %s missing\n'
+                                 '  used by %s\n')
+                                % (path_msg(n), path_msg(mxf)))
+                            broken = True
+                    if broken:
+                        mx.close()
+                        del mx
+                        unlink(full)
+                    else:
+                        midxl.append(mx)
+            midxl.sort(key=lambda ix:
+                       (-len(ix), -xstat.stat(ix.name).st_mtime))
+            for ix in midxl:
+                any_needed = False
+                for sub in ix.idxnames:
+                    found = d.get(os.path.join(self.dir, sub))
+                    if not found or isinstance(found, PackIdx):
+                        # doesn't exist, or exists but not in a midx
+                        any_needed = True
+                        break
+                if any_needed:
+                    d[ix.name] = ix
+                    for name in ix.idxnames:
+                        d[os.path.join(self.dir, name)] = ix
+                elif not ix.force_keep:
+                    debug1('midx: removing redundant: %s\n'
+                           % path_msg(os.path.basename(ix.name)))
+                    ix.close()
+                    unlink(ix.name)
+        for full in idxfiles:
+            if not d.get(full):
+                try:
+                    ix = open_idx(full)
+                except GitError as e:
+                    add_error(e)
+                    continue
+                d[full] = ix
+        return list(set(d.values()))
+
     def add(self, hash):
         """Insert an additional object in the list."""
         self.also.add(hash)
@@ -646,7 +1140,8 @@ class PackWriter:
     """Writes Git objects inside a pack file."""
     def __init__(self, objcache_maker=_make_objcache, compression_level=1,
                  run_midx=True, on_pack_finish=None,
-                 max_pack_size=None, max_pack_objects=None, repo_dir=None):
+                 max_pack_size=None, max_pack_objects=None, repo_dir=None,
+                 auto_compression=False, inflight=None):
         self.repo_dir = repo_dir or repo()
         self.file = None
         self.parentfd = None
@@ -656,7 +1151,14 @@ class PackWriter:
         self.idx = None
         self.objcache_maker = objcache_maker
         self.objcache = None
+        # Objects another writer sharing the inflight table is writing,
+        # mapped to the (offset, size) of their raw data in borrowfile.
+        self.inflight = inflight
+        self.borrowed = None
+        self.borrowfile = None
         self.compression_level = compression_level
+        self.compression = PackCompression(compression_level,
+                                           auto=auto_compression)
         self.run_midx=run_midx
         self.on_pack_finish = on_pack_finish
         if not max_pack_size:
@@ -718,8 +1220,12 @@ class PackWriter:
         nw = len(oneblob)
         crc = zlib.crc32(oneblob) & 0xffffffff
         self._update_idx(sha, crc, nw)
+        if self.inflight:
+            self.inflight.add(sha)
         self.outbytes += nw
         self.count += 1
+        _pack_objects.value += 1
+        _pack_written_bytes.value += nw
         return nw, crc
 
     def _update_idx(self, sha, crc, size):
@@ -733,9 +1239,11 @@ class PackWriter:
             log('>')
         if not sha:
             sha = calc_hash(type, content)
-        size, crc = self._raw_write(_encode_packobj(type, content,
-                                                    self.compression_level),
-                                    sha=sha)
+        start = time.time()
+        datalist = self.compression.encode(type, content)
+        _pack_compress_time.record(time.time() - start)
+        _pack_raw_bytes.value += len(content)
+        size, crc = self._raw_write(datalist, sha=sha)
         if self.outbytes >= self.max_pack_size \
            or self.count >= self.max_pack_objects:
             self.breakpoint()
@@ -759,6 +1267,43 @@ class PackWriter:
         self._require_objcache()
         return self.objcache.exists(id, want_source=want_source)
 
+    def borrow_inflight(self, sha, data):
+        """Return true if another writer sharing self.inflight is
+        already writing sha, after setting aside the raw pack data, so
+        that the object can still be written by close() if that writer
+        never finishes its pack."""
+        if not self.inflight or not self.inflight.exists(sha):
+            return False
+        if self.borrowed is None:
+            self.borrowed = {}
+            self.borrowfile = tempfile.TemporaryFile(
+                dir=os.path.join(self.repo_dir, b'objects'))
+        if sha not in self.borrowed:
+            f = self.borrowfile
+            f.seek(0, os.SEEK_END)
+            self.borrowed[sha] = (f.tell(), len(data))
+            f.write(data)
+            _pack_borrowed.value += 1
+        return True
+
+    def _write_borrowed(self):
+        """Write every borrowed object that isn't in a finished pack."""
+        borrowed, f = self.borrowed, self.borrowfile
+        if not borrowed:
+            return
+        self.borrowed = self.borrowfile = None
+        try:
+            self._require_objcache()
+            self.objcache.refresh()
+            for sha, (ofs, size) in sorted(borrowed.items(),
+                                           key=lambda x: x[1][0]):
+                if not self.objcache.exists(sha):
+                    f.seek(ofs)
+                    self._raw_write((f.read(size),), sha=sha)
+                    _pack_borrowed_written.value += 1
+        finally:
+            f.close()
+
     def just_write(self, sha, type, content):
         """Write an object to the pack file without checking for duplication."""
         self._write(sha, type, content)
@@ -783,6 +1328,11 @@ class PackWriter:
         content = tree_encode(shalist)
         return self.maybe_write(b'tree', content)
 
+    def new_encoded_tree(self, content):
+        """Create a tree object in the pack from its tree_encode()d
+        content."""
+        return self.maybe_write(b'tree', content)
+
     def new_commit(self, tree, parent,
                    author, adate_sec, adate_tz,
                    committer, cdate_sec, cdate_tz,
@@ -808,6 +1358,9 @@ class PackWriter:
 
     def abort(self):
         """Remove the pack file from disk."""
+        if self.borrowfile:
+            self.borrowfile.close()
+            self.borrowed = self.borrowfile = None
         f = self.file
         if f:
             pfd = self.parentfd
@@ -824,6 +1377,7 @@ class PackWriter:
                     os.close(pfd)
 
     def _end(self, run_midx=True):
+        self._write_borrowed()
         f = self.file
         if not f: return None
         self.file = None
@@ -855,8 +1409,11 @@ class PackWriter:
                                   b'objects/pack/pack-' +  obj_list_sha)
         if os.path.exists(self.filename + b'.map'):
             os.unlink(self.filename + b'.map')
-        os.rename(self.filename + b'.pack', nameprefix + b'.pack')
-        os.rename(self.filename + b'.idx', nameprefix + b'.idx')
+        manifest = PackManifest(os.path.join(self.repo_dir, b'objects/pack'))
+        with manifest.adding_idx(os.path.basename(nameprefix + b'.idx'),
+                                 self.count):
+            os.rename(self.filename + b'.pack', nameprefix + b'.pack')
+            os.rename(self.filename + b'.idx', nameprefix + b'.idx')
         try:
             os.fsync(self.parentfd)
         finally:
@@ -883,38 +1440,23 @@ class PackWriter:
 
         # Length: header + fan-out + shas-and-crcs + overflow-offsets
         index_len = 8 + (4 * 256) + (28 * self.count) + (8 * ofs64_count)
-        idx_map = None
-        idx_f = open(filename, 'w+b')
-        try:
-            idx_f.truncate(index_len)
-            fdatasync(idx_f.fileno())
-            idx_map = mmap_readwrite(idx_f, close=False)
-            try:
-                count = _helpers.write_idx(filename, idx_map, idx, self.count)
-                assert(count == self.count)
-                idx_map.flush()
-            finally:
-                idx_map.close()
-        finally:
-            idx_f.close()
-
-        idx_f = open(filename, 'a+b')
+        # Build the whole index in memory so that both checksums can
+        # be computed without reading anything back from disk.
+        idx_buf = bytearray(index_len)
+        count = _helpers.write_idx(idx_buf, idx, self.count)
+        assert(count == self.count)
+
+        obj_list_sum = Sha1(buffer(idx_buf, 8 + 4*256, 20*self.count))
+        namebase = hexlify(obj_list_sum.digest())
+        idx_sum = Sha1(idx_buf)
+        idx_sum.update(packbin)
+
+        idx_f = open(filename, 'wb')
         try:
+            idx_f.write(idx_buf)
             idx_f.write(packbin)
-            idx_f.seek(0)
-            idx_sum = Sha1()
-            b = idx_f.read(8 + 4*256)
-            idx_sum.update(b)
-
-            obj_list_sum = Sha1()
-            for b in chunkyreader(idx_f, 20*self.count):
-                idx_sum.update(b)
-                obj_list_sum.update(b)
-            namebase = hexlify(obj_list_sum.digest())
-
-            for b in chunkyreader(idx_f):
-                idx_sum.update(b)
             idx_f.write(idx_sum.digest())
+            idx_f.flush()
             fdatasync(idx_f.fileno())
             return namebase
         finally:
@@ -1188,6 +1730,9 @@ class _AbortableIter:
         self.abort()
 
 
+# The default number of requests CatPipe.get_many() keeps outstanding.
+cat_batch_window = 64
+
 class CatPipe:
     """Link to 'git cat-file' that is used to retrieve blob data."""
     def __init__(self, repo_dir = None):
@@ -1231,9 +1776,11 @@ class CatPipe:
         assert ref.find(b'\r') < 0
         assert not ref.startswith(b'-')
         self.inprogress = ref
+        start = time.time()
         self.p.stdin.write(ref + b'\n')
         self.p.stdin.flush()
         hdr = self.p.stdout.readline()
+        _cat_latency.record(time.time() - start)
         if hdr.endswith(b' missing\n'):
             self.inprogress = None
             yield None, None, None
@@ -1256,6 +1803,72 @@ class CatPipe:
             it.abort()
             raise
 
+    def get_many(self, refs, window=None):
+        """Yield (oidx, type, size, data_iterator) for each ref in refs,
+        in order, or (None, None, None, None) for any ref that
+        doesn't exist.  Up to window requests (default
+        cat_batch_window) are written to git ahead of the results, so
+        the refs don't each cost a full round trip.  Any data the
+        caller doesn't consume is discarded before the next result.
+
+        """
+        window = window or cat_batch_window
+        # Keep the unanswered requests well within a pipe buffer so
+        # that writing them can't block while git waits for us to
+        # read its output.
+        assert 0 < window <= 1024
+        if not self.p or self.p.poll() != None:
+            self.restart()
+        assert(self.p)
+        poll_result = self.p.poll()
+        assert(poll_result == None)
+        if self.inprogress:
+            log('get_many: starting batch while %r is open\n'
+                % self.inprogress)
+        assert(not self.inprogress)
+        self.inprogress = b'<batch>'
+        refs = iter(refs)
+        pending = deque()
+        def request_more():
+            while len(pending) < window:
+                ref = next(refs, None)
+                if ref is None:
+                    break
+                assert ref.find(b'\n') < 0
+                assert ref.find(b'\r') < 0
+                assert not ref.startswith(b'-')
+                self.p.stdin.write(ref + b'\n')
+                pending.append(time.time())
+            self.p.stdin.flush()
+        try:
+            request_more()
+            while pending:
+                requested = pending.popleft()
+                hdr = self.p.stdout.readline()
+                _cat_latency.record(time.time() - requested)
+                if hdr.endswith(b' missing\n'):
+                    yield None, None, None, None
+                else:
+                    info = hdr.split(b' ')
+                    if len(info) != 3 or len(info[0]) != 40:
+                        raise GitError('expected object (id, type, size),'
+                                       ' got %r' % info)
+                    oidx, typ, size = info
+                    size = int(size)
+                    it = chunkyreader(self.p.stdout, size)
+                    yield oidx, typ, size, it
+                    for ignored in it:
+                        pass
+                    readline_result = self.p.stdout.readline()
+                    assert readline_result == b'\n'
+                request_more()
+            self.inprogress = None
+        except:
+            # Includes GeneratorExit, i.e. the caller stopped early,
+            # which leaves the pipe out of sync.
+            self._abort()
+            raise
+
     def _join(self, it):
         _, typ, _ = next(it)
         if typ == b'blob':
@@ -1335,6 +1948,33 @@ WalkItem = namedtuple('WalkItem', ['oid', 'type', 'mode',
 #   ...
 
 
+def _walk_children(typ, data, parent_path, chunk_path, mode):
+    """Return the pending walk entries for everything directly
+    referred to by the commit or tree data."""
+    children = []
+    if typ == b'commit':
+        commit_items = parse_commit(data)
+        for pid in commit_items.parents:
+            children.append((pid, parent_path, chunk_path, mode))
+        children.append((commit_items.tree, parent_path, chunk_path,
+                         hashsplit.GIT_MODE_TREE))
+    elif typ == b'tree':
+        for mode, name, ent_id in tree_decode(data):
+            demangled, bup_type = demangle_name(name, mode)
+            if chunk_path:
+                sub_path = parent_path
+                sub_chunk_path = chunk_path + [name]
+            else:
+                sub_path = parent_path + [name]
+                if bup_type == BUP_CHUNKED:
+                    sub_chunk_path = [b'']
+                else:
+                    sub_chunk_path = chunk_path
+            children.append((hexlify(ent_id), sub_path, sub_chunk_path,
+                             mode))
+    return children
+
+
 def walk_object(get_ref, oidx, stop_at=None, include_data=None):
     """Yield everything reachable from oidx via get_ref (which must behave
     like CatPipe get) as a WalkItem, stopping whenever stop_at(oidx)
@@ -1382,23 +2022,71 @@ def walk_object(get_ref, oidx, stop_at=None, include_data=None):
                        mode=mode,
                        data=(data if include_data else None))
 
-        if typ == b'commit':
-            commit_items = parse_commit(data)
-            for pid in commit_items.parents:
-                pending.append((pid, parent_path, chunk_path, mode))
-            pending.append((commit_items.tree, parent_path, chunk_path,
-                            hashsplit.GIT_MODE_TREE))
-        elif typ == b'tree':
-            for mode, name, ent_id in tree_decode(data):
-                demangled, bup_type = demangle_name(name, mode)
-                if chunk_path:
-                    sub_path = parent_path
-                    sub_chunk_path = chunk_path + [name]
-                else:
-                    sub_path = parent_path + [name]
-                    if bup_type == BUP_CHUNKED:
-                        sub_chunk_path = [b'']
-                    else:
-                        sub_chunk_path = chunk_path
-                pending.append((hexlify(ent_id), sub_path, sub_chunk_path,
-                                mode))
+        pending.extend(_walk_children(typ, data, parent_path, chunk_path,
+                                      mode))
+
+
+def walk_object_batched(get_many, oidx, stop_at=None, include_data=None,
+                        batch_size=None):
+    """Yield the same items as walk_object(), but fetch the objects
+    via get_many (which must behave like CatPipe get_many, or a repo's
+    cat_batch) up to batch_size (default cat_batch_window) at a time,
+    so that a remote source costs a round trip per batch rather than
+    per object.  stop_at is consulted before an object is requested,
+    so only the objects it doesn't reject are ever transferred.
+
+    """
+    batch_size = batch_size or cat_batch_window
+    pending = [(oidx, [], [], None)]
+    while pending:
+        batch = []
+        batch_oids = set()
+        deferred = []
+        while pending and len(batch) < batch_size:
+            ent = pending.pop()
+            oidx, parent_path, chunk_path, mode = ent
+            if oidx in batch_oids:
+                # Let stop_at see it again once this batch has been
+                # handled, i.e. after the caller has seen the first one.
+                deferred.append(ent)
+                continue
+            if stop_at and stop_at(oidx):
+                continue
+            if (not include_data) and mode and stat.S_ISREG(mode):
+                yield WalkItem(oid=unhexlify(oidx), type=b'blob',
+                               chunk_path=chunk_path, path=parent_path,
+                               mode=mode,
+                               data=None)
+                continue
+            batch.append(ent)
+            batch_oids.add(oidx)
+        pending.extend(reversed(deferred))
+        if not batch:
+            continue
+
+        # Read the whole batch before yielding anything so that the
+        # source isn't left mid-request while the caller works.
+        results = []
+        got = get_many([ent[0] for ent in batch])
+        for ent in batch:
+            get_oidx, typ, _, it = next(got)
+            if not get_oidx:
+                raise MissingObject(unhexlify(ent[0]))
+            if typ not in (b'blob', b'commit', b'tree'):
+                raise Exception('unexpected repository object type %r' % typ)
+            data = b''.join(it)
+            if typ == b'blob' and not include_data:
+                data = None
+            results.append((ent, typ, data))
+        assert next(got, None) is None
+
+        children = []
+        for (oidx, parent_path, chunk_path, mode), typ, data in results:
+            yield WalkItem(oid=unhexlify(oidx), type=typ,
+                           chunk_path=chunk_path, path=parent_path,
+                           mode=mode,
+                           data=(data if include_data else None))
+            children.extend(_walk_children(typ, data, parent_path,
+                                           chunk_path, mode))
+        # Keep the walk roughly depth first, like walk_object().
+        pending.extend(children)
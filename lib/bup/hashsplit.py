@@ -1,14 +1,22 @@
 
 from __future__ import absolute_import
-import io, math, os
+import errno, io, math, os, stat, time
 
-from bup import _helpers, compat, helpers
+from bup import _helpers, compat, helpers, metrics
 from bup._helpers import cat_bytes
 from bup.compat import buffer, py_maj
 from bup.helpers import sc_page_size
 
 
 _fmincore = getattr(helpers, 'fmincore', None)
+_input_bytes = metrics.counter('hashsplit.input_bytes')
+_hole_bytes = metrics.counter('hashsplit.hole_bytes')
+_read_time = metrics.histogram('hashsplit.read')
+_chunks = metrics.counter('hashsplit.chunks')
+_zero_chunks = metrics.counter('hashsplit.zero_chunks')
+_split_bytes = metrics.counter('hashsplit.split_bytes')
+_seek_data = getattr(_helpers, 'SEEK_DATA', None)
+_seek_hole = getattr(_helpers, 'SEEK_HOLE', None)
 
 BLOB_MAX = 8192*4   # 8192 is the "typical" blob size for bupsplit
 BLOB_READ_SIZE = 1024*1024
@@ -16,10 +24,22 @@ MAX_PER_TREE = 256
 progress_callback = None
 fanout = 16
 
+# How file content is divided into chunks (cf. set_split_method()).
+# This has to stay the same within a repository, or the chunks won't
+# match, so it's recorded in the repository's bup.split.files setting.
+split_methods = {b'legacy': 'splitbuf',
+                 b'fastcdc': 'gear_splitbuf'}
+split_method = b'legacy'
+
 GIT_MODE_FILE = 0o100644
 GIT_MODE_TREE = 0o40000
 GIT_MODE_SYMLINK = 0o120000
 
+# Neither split method ever splits within a run of zeros that starts
+# at a chunk boundary, so any such run is cut into BLOB_MAX blobs of
+# zeros, all of which are this object (cf. _hashsplit_iter()).
+_zero_blob = None
+
 # The purpose of this type of buffer is to avoid copying on peek(), get(),
 # and eat().  We do copy the buffer contents on put(), but that should
 # be ok if we always only put() large amounts of data at a time.
@@ -28,11 +48,14 @@ class Buf:
         self.data = b''
         self.start = 0
 
-    def put(self, s):
-        if s:
+    def put(self, s, n=None):
+        """Append the first n bytes (default all) of s, which may be a
+        bytearray that's reused once put() returns."""
+        if n is None:
+            n = len(s)
+        if n:
             remaining = len(self.data) - self.start
-            self.data = cat_bytes(self.data, self.start, remaining,
-                                  s, 0, len(s))
+            self.data = cat_bytes(self.data, self.start, remaining, s, 0, n)
             self.start = 0
             
     def peek(self, count):
@@ -100,64 +123,223 @@ def _uncache_ours_upto(fd, offset, first_region, remaining_regions):
     return (rstart, rlen)
 
 
-def readfile_iter(files, progress=None):
+def _lseek_or_none(fd, ofs, whence):
+    try:
+        return os.lseek(fd, ofs, whence)
+    except OSError as e:
+        if e.errno == errno.ENXIO: # ofs is at or past the end of fd
+            return None
+        raise
+
+
+def _may_have_holes(f, fd):
+    """Return true if f is a regular file that may have holes we can
+    find with SEEK_HOLE."""
+    if _seek_hole is None or not hasattr(f, 'seek'):
+        return False
+    st = os.fstat(fd)
+    return stat.S_ISREG(st.st_mode) and st.st_blocks * 512 < st.st_size
+
+
+def _sparse_readinto(f, fd, block):
+    """Read f into block, as per _readinto(), but produce the zeros in
+    any holes without reading them."""
+    zeros = None
+    ofs = 0
+    while True:
+        data = _lseek_or_none(fd, ofs, _seek_data)
+        if data is None: # Nothing but (perhaps) a trailing hole
+            data = max(ofs, os.fstat(fd).st_size)
+        while ofs < data:
+            n = min(data - ofs, len(block))
+            if zeros is None:
+                zeros = b'\0' * len(block)
+            block[:n] = zeros[:n]
+            _hole_bytes.value += n
+            yield n
+            ofs += n
+        hole = _lseek_or_none(fd, ofs, _seek_hole)
+        f.seek(ofs)
+        if hole is None or hole <= ofs:
+            break
+        while ofs < hole:
+            n = _fill(f, memoryview(block)[:min(hole - ofs, len(block))])
+            if not n:
+                return
+            ofs += n
+            yield n
+    # Read whatever's left (if the file has grown) as usual.
+    for n in _readinto(f, block):
+        yield n
+
+
+def _fill(f, view):
+    """Read from f into the memoryview until it's full or f reaches
+    EOF, and return the number of bytes read.  Short reads are normal
+    for pipes and sockets, and for raw files."""
+    n = 0
+    while n < len(view):
+        count = f.readinto(view[n:])
+        if not count:
+            break
+        n += count
+    return n
+
+
+def _readinto(f, block):
+    """Read f into block (a bytearray), filling it unless f reaches
+    EOF, and yield the number of bytes read each time.  The block is
+    reused, so the caller must consume its content before the next
+    iteration.  This keeps memory use bounded for a stream (e.g. a
+    pipe from a database dump), and means nothing more is read from it
+    until the chunker has consumed what it has."""
+    if not hasattr(f, 'readinto'):
+        while True:
+            b = f.read(len(block))
+            if not b:
+                return
+            n = len(b)
+            block[:n] = b
+            yield n
+    view = memoryview(block)
+    while True:
+        n = _fill(f, view)
+        if not n:
+            return
+        yield n
+
+
+def _readinto_iter(files, block, progress=None):
+    """Read each of the files into block in turn, as per _readinto()."""
     for filenum,f in enumerate(files):
         ofs = 0
-        b = ''
+        n = 0
         fd = rpr = rstart = rlen = None
-        if _fmincore and hasattr(f, 'fileno'):
+        reads = None
+        if hasattr(f, 'fileno'):
             try:
                 fd = f.fileno()
             except io.UnsupportedOperation:
                 pass
-            if fd:
+            if fd and _may_have_holes(f, fd):
+                reads = _sparse_readinto(f, fd, block)
+            if fd and _fmincore:
                 mcore = _fmincore(fd)
                 if mcore:
                     max_chunk = max(1, (8 * 1024 * 1024) / sc_page_size)
                     rpr = _nonresident_page_regions(mcore, helpers.MINCORE_INCORE,
                                                     max_chunk)
                     rstart, rlen = next(rpr, (None, None))
+        if not reads:
+            reads = _readinto(f, block)
         while 1:
             if progress:
-                progress(filenum, len(b))
-            b = f.read(BLOB_READ_SIZE)
-            ofs += len(b)
+                progress(filenum, n)
+            start = time.time()
+            n = next(reads, 0)
+            _read_time.record(time.time() - start)
+            _input_bytes.value += n
+            ofs += n
             if rpr:
                 rstart, rlen = _uncache_ours_upto(fd, ofs, (rstart, rlen), rpr)
-            if not b:
+            if not n:
                 break
-            yield b
+            yield n
         if rpr:
             rstart, rlen = _uncache_ours_upto(fd, ofs, (rstart, rlen), rpr)
 
 
-def _splitbuf(buf, basebits, fanbits):
+def readfile_iter(files, progress=None):
+    block = bytearray(BLOB_READ_SIZE)
+    for n in _readinto_iter(files, block, progress):
+        yield bytes(block[:n])
+
+
+class IterReader:
+    """A binary, read-only file-like object that produces the bytes
+    from an iterator of bytes-like chunks (e.g. CatPipe.get()), and
+    never holds more than one chunk."""
+    def __init__(self, it):
+        self.it = iter(it)
+        self.chunk = b''
+        self.ofs = 0
+
+    def _next_chunk(self):
+        while self.ofs >= len(self.chunk):
+            chunk = next(self.it, None)
+            if chunk is None:
+                self.chunk, self.ofs = b'', 0
+                return False
+            self.chunk, self.ofs = chunk, 0
+        return True
+
+    def readinto(self, b):
+        if not self._next_chunk():
+            return 0
+        n = min(len(b), len(self.chunk) - self.ofs)
+        b[:n] = self.chunk[self.ofs:self.ofs + n]
+        self.ofs += n
+        return n
+
+    def read(self, size=-1):
+        result = []
+        while size:
+            if not self._next_chunk():
+                break
+            end = len(self.chunk) if size < 0 \
+                  else min(len(self.chunk), self.ofs + size)
+            result.append(self.chunk[self.ofs:end])
+            if size > 0:
+                size -= end - self.ofs
+            self.ofs = end
+        return b''.join(result)
+
+
+def set_split_method(name):
+    """Split files via the split_methods name (e.g. a repository's
+    bup.split.files setting), or legacy if name is None.  Raise
+    ValueError if the method is unknown."""
+    global split_method
+    name = (name or b'legacy').strip()
+    if name not in split_methods:
+        raise ValueError('unknown split method %r' % name)
+    split_method = name
+
+
+def _splitbuf(buf, basebits, fanbits, splitbuf):
+    # Only look at BLOB_MAX bytes at a time, since any split past that
+    # would be cut back to BLOB_MAX anyway.
     while 1:
-        b = buf.peek(buf.used())
-        (ofs, bits) = _helpers.splitbuf(b)
+        b = buf.peek(min(buf.used(), BLOB_MAX))
+        if len(b) == BLOB_MAX and _helpers.leading_zeros(b) == BLOB_MAX:
+            buf.eat(BLOB_MAX)
+            yield _zero_blob, 0
+            continue
+        (ofs, bits) = splitbuf(b)
         if ofs:
-            if ofs > BLOB_MAX:
-                ofs = BLOB_MAX
-                level = 0
-            else:
-                level = (bits-basebits)//fanbits  # integer division
+            level = (bits-basebits)//fanbits  # integer division
             buf.eat(ofs)
             yield buffer(b, 0, ofs), level
+        elif len(b) == BLOB_MAX:
+            # limit max blob size
+            yield buf.get(BLOB_MAX), 0
         else:
             break
-    while buf.used() >= BLOB_MAX:
-        # limit max blob size
-        yield buf.get(BLOB_MAX), 0
 
 
 def _hashsplit_iter(files, progress):
+    global _zero_blob
     assert(BLOB_READ_SIZE > BLOB_MAX)
+    if not _zero_blob or len(_zero_blob) != BLOB_MAX:
+        _zero_blob = b'\0' * BLOB_MAX
     basebits = _helpers.blobbits()
     fanbits = int(math.log(fanout or 128, 2))
+    splitbuf = getattr(_helpers, split_methods[split_method])
     buf = Buf()
-    for inblock in readfile_iter(files, progress):
-        buf.put(inblock)
-        for buf_and_level in _splitbuf(buf, basebits, fanbits):
+    block = bytearray(BLOB_READ_SIZE)
+    for n in _readinto_iter(files, block, progress):
+        buf.put(block, n)
+        for buf_and_level in _splitbuf(buf, basebits, fanbits, splitbuf):
             yield buf_and_level
     if buf.used():
         yield buf.get(buf.used()), 0
@@ -186,9 +368,20 @@ def hashsplit_iter(files, keep_boundaries, progress):
 total_split = 0
 def split_to_blobs(makeblob, files, keep_boundaries, progress):
     global total_split
+    zero_sha = None
     for (blob, level) in hashsplit_iter(files, keep_boundaries, progress):
-        sha = makeblob(blob)
+        if blob is _zero_blob:
+            # Every full size run of zeros is the same blob, so only
+            # hash and store it once.
+            if not zero_sha:
+                zero_sha = makeblob(blob)
+            sha = zero_sha
+            _zero_chunks.value += 1
+        else:
+            sha = makeblob(blob)
         total_split += len(blob)
+        _chunks.value += 1
+        _split_bytes.value += len(blob)
         if progress_callback:
             progress_callback(len(blob))
         yield (sha, len(blob), level)
@@ -207,23 +400,12 @@ def _make_shalist(l):
     return (shalist, total)
 
 
-def _squish(maketree, stacks, n):
-    i = 0
-    while i < n or len(stacks[i]) >= MAX_PER_TREE:
-        while len(stacks) <= i+1:
-            stacks.append([])
-        if len(stacks[i]) == 1:
-            stacks[i+1] += stacks[i]
-        elif stacks[i]:
-            (shalist, size) = _make_shalist(stacks[i])
-            tree = maketree(shalist)
-            stacks[i+1].append((GIT_MODE_TREE, tree, size))
-        stacks[i] = []
-        i += 1
-
-
 def split_to_shalist(makeblob, maketree, files,
-                     keep_boundaries, progress=None):
+                     keep_boundaries, progress=None, write_tree=None):
+    """Split files into blobs via makeblob, and unless fanout is 0,
+    those into a tree of trees (cf. _helpers.chunk_tree_add()), and
+    return the top level shalist.  The trees are written via
+    write_tree(content) if given, else via maketree(shalist)."""
     sl = split_to_blobs(makeblob, files, keep_boundaries, progress)
     assert(fanout != 0)
     if not fanout:
@@ -232,20 +414,20 @@ def split_to_shalist(makeblob, maketree, files,
             shal.append((GIT_MODE_FILE, sha, size))
         return _make_shalist(shal)[0]
     else:
-        stacks = [[]]
+        if not write_tree:
+            write_tree = lambda content: maketree(_helpers.tree_decode(content))
+        stacks = [bytearray()]
+        add = _helpers.chunk_tree_add
         for (sha,size,level) in sl:
-            stacks[0].append((GIT_MODE_FILE, sha, size))
-            _squish(maketree, stacks, level)
-        #log('stacks: %r\n' % [len(i) for i in stacks])
-        _squish(maketree, stacks, len(stacks)-1)
-        #log('stacks: %r\n' % [len(i) for i in stacks])
-        return _make_shalist(stacks[-1])[0]
+            add(stacks, sha, size, level, write_tree, MAX_PER_TREE)
+        return _helpers.chunk_tree_finish(stacks, write_tree, MAX_PER_TREE)
 
 
 def split_to_blob_or_tree(makeblob, maketree, files,
-                          keep_boundaries, progress=None):
+                          keep_boundaries, progress=None, write_tree=None):
     shalist = list(split_to_shalist(makeblob, maketree,
-                                    files, keep_boundaries, progress))
+                                    files, keep_boundaries, progress,
+                                    write_tree=write_tree))
     if len(shalist) == 1:
         return (shalist[0][0], shalist[0][2])
     elif len(shalist) == 0:
@@ -1,8 +1,10 @@
 
 from __future__ import absolute_import
-import errno, os, tempfile
+import errno, hashlib, os, struct, tempfile
 
 from bup import compat
+from bup.compat import range
+from bup.helpers import fdatasync, mmap_read
 
 if compat.py_maj > 2:
     import pickle
@@ -10,18 +12,101 @@ else:
     import cPickle as pickle
 
 
+# The database is an open-addressed hash table (linear probing, power
+# of two slots) mapping each "dev:ino" node to the paths associated
+# with it.  Each slot refers to the node's paths, joined by NULs, in
+# the data area that follows the table.  Changes are kept in memory
+# until the save is committed, and then the affected slots are
+# rewritten in place, so a commit costs time proportional to the
+# changes.  The whole file is only rewritten (via a rename) when the
+# table gets too full or too much of the data area is garbage.  Older
+# indexes stored a pickled dict instead, which is converted by the
+# next save.
+#
+# An in-place update appends the new path lists and then a journal,
+# which holds the new slots and header, to the data area, and syncs
+# them.  The commit then points the header at the journal, rewrites
+# the slots, and finally writes the new header.  While a journal is
+# pending, readers (and the next writer, if the commit never
+# finished) take the slots it lists from the journal rather than the
+# table, which may be half written.  Since the table can change under
+# a reader's map, lookups check that the header (which carries a
+# checksum and a generation count) hasn't changed while they ran.
+
+HLINK_HDR = b'BUPHL\0\0\2'
+HLINK_FIELDS_SIG = ('!'
+                    '8s'  # magic
+                    'Q'   # generation
+                    'Q'   # slots
+                    'Q'   # used slots
+                    'Q'   # deleted slots
+                    'Q'   # data length
+                    'Q'   # live data length
+                    'Q')  # journal offset (0 if none)
+HLINK_SIG = HLINK_FIELDS_SIG + '20s'  # sha1 of the preceding fields
+HLINK_HDRLEN = struct.calcsize(HLINK_SIG)
+HLINK_SLOT_SIG = ('!'
+                  'Q'     # dev
+                  'Q'     # ino
+                  'Q'     # paths offset (in the data area)
+                  'I'     # paths length
+                  'I')    # state
+HLINK_SLOTLEN = struct.calcsize(HLINK_SLOT_SIG)
+# The journal is a count, that many (slot index, slot) entries, the
+# new header, and the sha1 of all of those.
+HLINK_JOURNAL_SIG = '!Q'
+HLINK_JOURNAL_SLOT_SIG = '!Q' + HLINK_SLOT_SIG[1:]
+HLINK_JOURNAL_SLOTLEN = struct.calcsize(HLINK_JOURNAL_SLOT_SIG)
+
+_SLOT_EMPTY, _SLOT_USED, _SLOT_DELETED = 0, 1, 2
+
+_min_slots = 1024
+_max_garbage = 1 << 20
+_max_lookup_attempts = 100
+
+def _slot_hash(dev, ino):
+    h = (ino * 0x9e3779b97f4a7c15 + dev) & 0xffffffffffffffff
+    return h ^ (h >> 29)
+
+def _pack_header(generation, slots, used, deleted, data_len, live_len,
+                 journal):
+    hdr = struct.pack(HLINK_FIELDS_SIG, HLINK_HDR, generation, slots,
+                      used, deleted, data_len, live_len, journal)
+    return hdr + hashlib.sha1(hdr).digest()
+
+def _unpack_header(hdr):
+    """Return the fields (after the magic) of the header hdr, or None
+    if it's damaged."""
+    if len(hdr) != HLINK_HDRLEN or not hdr.startswith(HLINK_HDR):
+        return None
+    if hashlib.sha1(hdr[:-20]).digest() != hdr[-20:]:
+        return None
+    fields = struct.unpack(HLINK_SIG, hdr)[1:-1]
+    slots = fields[1]
+    if not slots or slots & (slots - 1):
+        return None
+    return fields
+
+
 class Error(Exception):
     pass
 
 class HLinkDB:
     def __init__(self, filename):
-        # Map a "dev:ino" node to a list of paths associated with that node.
-        self._node_paths = {}
-        # Map a path to a "dev:ino" node.
-        self._path_node = {}
         self._filename = filename
         self._save_prepared = None
         self._tmpname = None
+        self._file = self._map = self._hdr = None
+        self._generation = 0
+        self._slots = self._used = self._deleted = 0
+        self._data_len = self._live_len = 0
+        # The slots (index to slot values) listed by a pending journal,
+        # and where the journal ends.
+        self._pending = None
+        self._journal_end = 0
+        # Map each changed (dev, ino) node to its new list of paths.
+        self._changes = {}
+        self._slot_updates = None
         f = None
         try:
             f = open(filename, 'rb')
@@ -31,50 +116,315 @@ class HLinkDB:
             else:
                 raise
         if f:
-            try:
-                self._node_paths = pickle.load(f)
-            finally:
-                f.close()
-                f = None
-        # Set up the reverse hard link index.
-        for node, paths in compat.items(self._node_paths):
-            for path in paths:
-                self._path_node[path] = node
+            if f.read(len(HLINK_HDR)) == HLINK_HDR:
+                self._load(f)
+            else:
+                try:
+                    f.seek(0)
+                    self._load_pickle(f)
+                finally:
+                    f.close()
+                    f = None
+
+    def _load(self, f):
+        try:
+            f.seek(0)
+            hdr = f.read(HLINK_HDRLEN)
+            if not self._set_state(f, hdr):
+                raise Error('%r is corrupt' % self._filename)
+            self._map = mmap_read(f, close=False)
+        except:
+            f.close()
+            raise
+        self._file = f
+
+    def _set_state(self, f, hdr):
+        """Adopt the state described by the header hdr, and by the
+        journal it refers to (if any), which are read from f.  Return
+        False (leaving the current state alone) if either is damaged."""
+        fields = _unpack_header(hdr)
+        if not fields:
+            return False
+        generation, slots, used, deleted, data_len, live_len, journal = fields
+        pending = None
+        journal_end = 0
+        if journal:
+            f.seek(journal)
+            count = f.read(struct.calcsize(HLINK_JOURNAL_SIG))
+            if len(count) != struct.calcsize(HLINK_JOURNAL_SIG):
+                return False
+            n = struct.unpack(HLINK_JOURNAL_SIG, count)[0]
+            body = f.read(n * HLINK_JOURNAL_SLOTLEN + HLINK_HDRLEN)
+            check = f.read(20)
+            if len(body) != n * HLINK_JOURNAL_SLOTLEN + HLINK_HDRLEN \
+               or hashlib.sha1(count + body).digest() != check:
+                return False
+            fields = _unpack_header(body[-HLINK_HDRLEN:])
+            if not fields or fields[1] != slots:
+                return False
+            generation, slots, used, deleted, data_len, live_len = fields[:-1]
+            pending = {}
+            for k in range(n):
+                entry = struct.unpack_from(HLINK_JOURNAL_SLOT_SIG, body,
+                                           k * HLINK_JOURNAL_SLOTLEN)
+                pending[entry[0]] = entry[1:]
+            journal_end = f.tell()
+        size = os.fstat(f.fileno()).st_size
+        if size < HLINK_HDRLEN + slots * HLINK_SLOTLEN + data_len \
+           or (used + deleted) * 2 > slots:
+            return False
+        self._hdr = hdr
+        self._generation, self._slots = generation, slots
+        self._used, self._deleted = used, deleted
+        self._data_len, self._live_len = data_len, live_len
+        self._pending, self._journal_end = pending, journal_end
+        return True
+
+    def _refresh(self, hdr):
+        """Catch up with the changes a writer has made since the header
+        was last read; return False if hdr (or its journal) is damaged,
+        which it may briefly appear to be while it's being written."""
+        if not self._set_state(self._file, hdr):
+            return False
+        if len(self._map) < os.fstat(self._file.fileno()).st_size:
+            self._map.close()
+            self._map = mmap_read(self._file, close=False)
+        return True
+
+    def _close(self):
+        if self._map:
+            self._map.close()
+            self._map = None
+        if self._file:
+            self._file.close()
+            self._file = None
+
+    def _load_pickle(self, f):
+        # The old format, a dict mapping "dev:ino" to a list of paths.
+        for node, paths in compat.items(pickle.load(f)):
+            dev, ino = node.split(':')
+            self._changes[(int(dev), int(ino))] = list(paths)
+
+    def _find(self, dev, ino, pending=None):
+        """Return the index of the slot for (dev, ino), or of the
+        first free slot where it belongs, and the slot's values.  Any
+        slots in pending (a dict mapping slot index to slot values)
+        override the ones on disk."""
+        mask = self._slots - 1
+        i = _slot_hash(dev, ino) & mask
+        free = None
+        m = self._map
+        pending = pending or self._pending
+        while True:
+            slot = pending and pending.get(i)
+            if not slot:
+                slot = struct.unpack_from(HLINK_SLOT_SIG, m,
+                                          HLINK_HDRLEN + i * HLINK_SLOTLEN)
+            state = slot[4]
+            if state == _SLOT_EMPTY:
+                if free is None:
+                    return i, slot
+                return free
+            if state == _SLOT_DELETED:
+                if free is None:
+                    free = i, slot
+            elif slot[0] == dev and slot[1] == ino:
+                return i, slot
+            i = (i + 1) & mask
+
+    def _stored_paths(self, dev, ino):
+        if not self._map:
+            return []
+        for attempt in range(_max_lookup_attempts):
+            hdr = self._map[:HLINK_HDRLEN]
+            if hdr != self._hdr and not self._refresh(hdr):
+                continue
+            i, (s_dev, s_ino, ofs, n, state) = self._find(dev, ino)
+            if state != _SLOT_USED or s_dev != dev or s_ino != ino:
+                paths = []
+            else:
+                start = HLINK_HDRLEN + self._slots * HLINK_SLOTLEN + ofs
+                paths = self._map[start:start + n].split(b'\0')
+            if self._map[:HLINK_HDRLEN] == hdr:
+                return paths
+        raise Error('%r is corrupt' % self._filename)
+
+    def _paths(self, dev, ino):
+        paths = self._changes.get((dev, ino))
+        if paths is not None:
+            return paths
+        return self._stored_paths(dev, ino)
+
+    def _write_all(self, f, nodes):
+        """Write a complete database containing nodes, a list of
+        ((dev, ino), paths) pairs, to f."""
+        slots = _min_slots
+        while slots < 4 * len(nodes):
+            slots *= 2
+        mask = slots - 1
+        table = [None] * slots
+        data = []
+        data_len = 0
+        for (dev, ino), paths in nodes:
+            blob = b'\0'.join(paths)
+            i = _slot_hash(dev, ino) & mask
+            while table[i]:
+                i = (i + 1) & mask
+            table[i] = struct.pack(HLINK_SLOT_SIG, dev, ino, data_len,
+                                   len(blob), _SLOT_USED)
+            data.append(blob)
+            data_len += len(blob)
+        empty = b'\0' * HLINK_SLOTLEN
+        f.write(_pack_header(self._generation + 1, slots, len(nodes), 0,
+                             data_len, data_len, 0))
+        for slot in table:
+            f.write(slot or empty)
+        for blob in data:
+            f.write(blob)
+
+    def _all_nodes(self):
+        """Yield ((dev, ino), paths) for every node with paths."""
+        changes = self._changes
+        if self._map:
+            data_start = HLINK_HDRLEN + self._slots * HLINK_SLOTLEN
+            pending = self._pending or {}
+            for i in range(self._slots):
+                dev, ino, ofs, n, state = pending.get(i) or \
+                    struct.unpack_from(HLINK_SLOT_SIG, self._map,
+                                       HLINK_HDRLEN + i * HLINK_SLOTLEN)
+                if state == _SLOT_USED and (dev, ino) not in changes:
+                    start = data_start + ofs
+                    yield (dev, ino), self._map[start:start + n].split(b'\0')
+        for node, paths in compat.items(changes):
+            if paths:
+                yield node, paths
+
+    def _prepare_update(self):
+        """Append the changed path lists and the journal to the data
+        area, and return the (slot index, packed slot) updates, the
+        header referring to the journal, the new header, and the new
+        length of the file, or None if the whole database should be
+        rewritten instead."""
+        if not self._map:
+            return None
+        used, deleted = self._used, self._deleted
+        live_len, data_len = self._live_len, self._data_len
+        data_start = HLINK_HDRLEN + self._slots * HLINK_SLOTLEN
+        if self._pending is not None:
+            # Carry the unfinished commit's slots forward, and leave its
+            # journal (now garbage) alone until this one is written.
+            data_len = self._journal_end - data_start
+        append_at = data_start + data_len
+        updates = dict(self._pending or {})
+        blobs = []
+        for (dev, ino), paths in compat.items(self._changes):
+            i, (s_dev, s_ino, ofs, n, state) = self._find(dev, ino, updates)
+            found = state == _SLOT_USED and s_dev == dev and s_ino == ino
+            if found:
+                live_len -= n
+            if paths:
+                blob = b'\0'.join(paths)
+                if not found:
+                    if state == _SLOT_DELETED:
+                        deleted -= 1
+                    used += 1
+                slot = dev, ino, data_len, len(blob), _SLOT_USED
+                blobs.append(blob)
+                data_len += len(blob)
+                live_len += len(blob)
+            elif found:
+                used -= 1
+                deleted += 1
+                slot = 0, 0, 0, 0, _SLOT_DELETED
+            else:
+                continue
+            if (used + deleted) * 2 > self._slots:
+                return None
+            updates[i] = slot
+        if not used or data_len - live_len > max(live_len, _max_garbage):
+            return None
+        updates = sorted(compat.items(updates))
+        journal = data_start + data_len
+        hdr = _pack_header(self._generation + 1, self._slots, used, deleted,
+                           data_len, live_len, 0)
+        record = b''.join([struct.pack(HLINK_JOURNAL_SIG, len(updates))]
+                          + [struct.pack(HLINK_JOURNAL_SLOT_SIG, i, *slot)
+                             for i, slot in updates]
+                          + [hdr])
+        with open(self._filename, 'r+b') as f:
+            f.seek(append_at)
+            for blob in blobs:
+                f.write(blob)
+            f.write(record)
+            f.write(hashlib.sha1(record).digest())
+            f.truncate()
+            f.flush()
+            fdatasync(f.fileno())
+        begin = _pack_header(self._generation, self._slots, self._used,
+                             self._deleted, self._data_len, self._live_len,
+                             journal)
+        return ([(i, struct.pack(HLINK_SLOT_SIG, *slot)) for i, slot in updates],
+                begin, hdr, journal)
 
     def prepare_save(self):
         """ Commit all of the relevant data to disk.  Do as much work
         as possible without actually making the changes visible."""
         if self._save_prepared:
             raise Error('save of %r already in progress' % self._filename)
-        if self._node_paths:
-            (dir, name) = os.path.split(self._filename)
-            (ffd, self._tmpname) = tempfile.mkstemp(b'.tmp', name, dir)
-            try:
-                try:
-                    f = os.fdopen(ffd, 'wb', 65536)
-                except:
-                    os.close(ffd)
-                    raise
-                try:
-                    pickle.dump(self._node_paths, f, 2)
-                finally:
-                    f.close()
-                    f = None
-            except:
-                tmpname = self._tmpname
-                self._tmpname = None
-                os.unlink(tmpname)
-                raise
+        if self._changes or self._pending is not None:
+            self._slot_updates = self._prepare_update()
+            if not self._slot_updates:
+                nodes = list(self._all_nodes())
+                if nodes:
+                    (dir, name) = os.path.split(self._filename)
+                    (ffd, self._tmpname) = tempfile.mkstemp(b'.tmp', name, dir)
+                    try:
+                        try:
+                            f = os.fdopen(ffd, 'wb', 65536)
+                        except:
+                            os.close(ffd)
+                            raise
+                        try:
+                            self._write_all(f, nodes)
+                            f.flush()
+                            fdatasync(f.fileno())
+                        finally:
+                            f.close()
+                            f = None
+                    except:
+                        tmpname = self._tmpname
+                        self._tmpname = None
+                        os.unlink(tmpname)
+                        raise
         self._save_prepared = True
 
     def commit_save(self):
         if not self._save_prepared:
             raise Error('cannot commit save of %r; no save prepared'
                         % self._filename)
-        if self._tmpname:
+        if self._slot_updates:
+            slot_updates, begin, hdr, end = self._slot_updates
+            with open(self._filename, 'r+b') as f:
+                def write_at(ofs, data):
+                    f.seek(ofs)
+                    f.write(data)
+                    f.flush()
+                def sync():
+                    fdatasync(f.fileno())
+                write_at(0, begin)
+                sync()
+                for i, slot in slot_updates:
+                    write_at(HLINK_HDRLEN + i * HLINK_SLOTLEN, slot)
+                sync()
+                write_at(0, hdr)
+                sync()
+                f.truncate(end)
+            self._slot_updates = None
+        elif self._tmpname:
             os.rename(self._tmpname, self._filename)
             self._tmpname = None
-        else: # No data -- delete _filename if it exists.
+        elif self._changes or self._pending is not None:
+            # No data -- delete _filename if it exists.
             try:
                 os.unlink(self._filename)
             except OSError as e:
@@ -83,44 +433,44 @@ class HLinkDB:
                 else:
                     raise
         self._save_prepared = None
+        self._changes = {}
+        self._close()
+        self._hdr = None
+        self._generation = 0
+        self._slots = self._used = self._deleted = 0
+        self._data_len = self._live_len = 0
+        self._pending = None
+        self._journal_end = 0
+        try:
+            f = open(self._filename, 'rb')
+        except IOError as e:
+            if e.errno != errno.ENOENT:
+                raise
+        else:
+            self._load(f)
 
     def abort_save(self):
         if self._tmpname:
             os.unlink(self._tmpname)
             self._tmpname = None
+        self._slot_updates = None
 
     def __del__(self):
         self.abort_save()
 
     def add_path(self, path, dev, ino):
-        # Assume path is new.
-        node = '%s:%s' % (dev, ino)
-        self._path_node[path] = node
-        link_paths = self._node_paths.get(node)
-        if link_paths and path not in link_paths:
-            link_paths.append(path)
-        else:
-            self._node_paths[node] = [path]
-
-    def _del_node_path(self, node, path):
-        link_paths = self._node_paths[node]
-        link_paths.remove(path)
-        if not link_paths:
-            del self._node_paths[node]
-
-    def change_path(self, path, new_dev, new_ino):
-        prev_node = self._path_node.get(path)
-        if prev_node:
-            self._del_node_path(prev_node, path)
-        self.add_path(new_dev, new_ino, path)
+        paths = self._paths(dev, ino)
+        if path not in paths:
+            self._changes[(dev, ino)] = paths + [path]
 
-    def del_path(self, path):
+    def del_path(self, path, dev, ino):
         # Path may not be in db (if updating a pre-hardlink support index).
-        node = self._path_node.get(path)
-        if node:
-            self._del_node_path(node, path)
-            del self._path_node[path]
+        paths = self._paths(dev, ino)
+        if path in paths:
+            self._changes[(dev, ino)] = [p for p in paths if p != path]
 
     def node_paths(self, dev, ino):
-        node = '%s:%s' % (dev, ino)
-        return self._node_paths[node]
+        paths = self._paths(dev, ino)
+        if not paths:
+            raise KeyError('%s:%s' % (dev, ino))
+        return paths
@@ -1,6 +1,6 @@
 
 from __future__ import absolute_import, print_function
-import errno, os, stat, struct, tempfile
+import errno, hashlib, os, stat, struct, tempfile
 
 from bup import compat, metadata, xstat
 from bup._helpers import UINT_MAX, bytescmp
@@ -66,53 +66,217 @@ class MetaStoreReader:
         return metadata.Metadata.read(self._file)
 
 
+# The hash index beside bupindex.meta is an open-addressed table
+# (linear probing, power of two slots) mapping the sha1 of each
+# encoded metadata record to its offset in the .meta file, so that a
+# MetaStoreWriter can dedup records without reading the .meta file.
+# meta_len is how much of the .meta file the table covers, and
+# meta_check is the sha1 of the (up to) _meta_check_len bytes before
+# meta_len, which catches a .meta file that has been replaced.  The
+# clean flag is cleared while a writer has the table open, and a
+# table that wasn't closed cleanly is rebuilt from the .meta file.
+META_HASH_HDR = b'BUPMHX\0\1'
+META_HASH_SIG = ('!'
+                 '8s'           # magic
+                 'Q'            # meta_len
+                 'Q'            # count
+                 'Q'            # slots
+                 'I'            # clean
+                 '20s')         # meta_check
+META_HASH_HDRLEN = struct.calcsize(META_HASH_SIG)
+META_HASH_SLOT_SIG = '!20sQ'    # sha1, offset + 1 (0 for an empty slot)
+META_HASH_SLOTLEN = struct.calcsize(META_HASH_SLOT_SIG)
+
+_meta_hash_min_slots = 1024
+_meta_check_len = 4096
+
+
+class MetaStoreHashes:
+    def __init__(self, filename):
+        self.filename = filename
+        self.map = None
+        self.meta_len = self.count = self.slots = 0
+        self.meta_check = None
+        try:
+            f = open(filename, 'r+b')
+        except IOError as e:
+            if e.errno != errno.ENOENT:
+                raise
+        else:
+            with f:
+                self._load(f)
+        if not self.map:
+            self.reset()
+        self._write_header(clean=False)
+
+    def _load(self, f):
+        st = os.fstat(f.fileno())
+        if st.st_size < META_HASH_HDRLEN:
+            return
+        hdr = struct.unpack(META_HASH_SIG, f.read(META_HASH_HDRLEN))
+        magic, meta_len, count, slots, clean, meta_check = hdr
+        if magic != META_HASH_HDR or not clean:
+            return
+        if not slots or slots & (slots - 1) or count * 2 > slots:
+            return
+        if st.st_size != META_HASH_HDRLEN + slots * META_HASH_SLOTLEN:
+            return
+        self.map = mmap_readwrite(f, st.st_size, close=False)
+        self.meta_len, self.count, self.slots = meta_len, count, slots
+        self.meta_check = meta_check
+
+    def _create(self, filename, slots):
+        with open(filename, 'w+b') as f:
+            f.truncate(META_HASH_HDRLEN + slots * META_HASH_SLOTLEN)
+            return mmap_readwrite(f, close=False)
+
+    def reset(self):
+        """Discard all of the entries."""
+        if self.map:
+            self.map.close()
+        self.map = self._create(self.filename, _meta_hash_min_slots)
+        self.meta_len = self.count = 0
+        self.slots = _meta_hash_min_slots
+        self.meta_check = None
+
+    def _write_header(self, clean):
+        struct.pack_into(META_HASH_SIG, self.map, 0, META_HASH_HDR,
+                         self.meta_len, self.count, self.slots,
+                         1 if clean else 0, self.meta_check or EMPTY_SHA)
+        self.map.flush()
+
+    def _find(self, digest):
+        """Return the position of digest's slot, or of the empty slot
+        where it belongs, and its offset or None."""
+        mask = self.slots - 1
+        i = struct.unpack_from('!Q', digest)[0] & mask
+        m = self.map
+        while True:
+            pos = META_HASH_HDRLEN + i * META_HASH_SLOTLEN
+            ofs = struct.unpack_from('!Q', m, pos + 20)[0]
+            if not ofs:
+                return pos, None
+            if m[pos:pos + 20] == digest:
+                return pos, ofs - 1
+            i = (i + 1) & mask
+
+    def get(self, digest):
+        return self._find(digest)[1]
+
+    def add(self, digest, ofs):
+        """Record ofs for digest, which must not already be present."""
+        if (self.count + 1) * 2 > self.slots:
+            self._grow()
+        pos, old = self._find(digest)
+        assert old is None
+        struct.pack_into(META_HASH_SLOT_SIG, self.map, pos, digest, ofs + 1)
+        self.count += 1
+
+    def _grow(self):
+        old_map, old_slots = self.map, self.slots
+        tmpname = self.filename + b'.tmp'
+        self.slots *= 2
+        self.map = self._create(tmpname, self.slots)
+        self.count = 0
+        for i in range(old_slots):
+            pos = META_HASH_HDRLEN + i * META_HASH_SLOTLEN
+            digest, ofs = struct.unpack_from(META_HASH_SLOT_SIG, old_map, pos)
+            if ofs:
+                self.add(digest, ofs - 1)
+        old_map.close()
+        self._write_header(clean=False)
+        os.rename(tmpname, self.filename)
+
+    def mark_clean(self, meta_len, meta_check):
+        """Record that the table covers the first meta_len bytes of the
+        .meta file, whose last bytes have the sha1 meta_check."""
+        self.meta_len, self.meta_check = meta_len, meta_check
+        self._write_header(clean=True)
+
+    def close(self):
+        if self.map:
+            self.map.close()
+            self.map = None
+
+
 class MetaStoreWriter:
     # For now, we just append to the file, and try to handle any
-    # truncation or corruption somewhat sensibly.
+    # truncation or corruption somewhat sensibly.  Records are deduped
+    # via the MetaStoreHashes table in filename + '.hidx', so opening
+    # the store doesn't have to read the existing records, other than
+    # any the table doesn't cover yet.
 
     def __init__(self, filename):
-        # Map metadata hashes to bupindex.meta offsets.
-        self._offsets = {}
         self._filename = filename
-        self._file = None
-        # FIXME: see how slow this is; does it matter?
-        m_file = open(filename, 'ab+')
+        self._file = self._hashes = None
+        self._hashes = MetaStoreHashes(filename + b'.hidx')
+        self._file = open(filename, 'ab')
+        self._end = os.fstat(self._file.fileno()).st_size
+        with open(filename, 'rb') as m_file:
+            m_file.seek(max(0, self._end - _meta_check_len))
+            self._tail = m_file.read()
+        hashes = self._hashes
+        if hashes.meta_len:
+            if hashes.meta_len > self._end:
+                hashes.reset()
+            else:
+                start = max(0, hashes.meta_len - _meta_check_len)
+                with open(filename, 'rb') as m_file:
+                    m_file.seek(start)
+                    check = m_file.read(hashes.meta_len - start)
+                if hashlib.sha1(check).digest() != hashes.meta_check:
+                    hashes.reset()
+        if hashes.meta_len < self._end:
+            self._add_records(hashes.meta_len)
+
+    def _add_records(self, start):
+        m_file = open(self._filename, 'rb')
         try:
-            m_file.seek(0)
+            m_file.seek(start)
             try:
                 m_off = m_file.tell()
                 m = metadata.Metadata.read(m_file)
                 while m:
-                    m_encoded = m.encode()
-                    self._offsets[m_encoded] = m_off
+                    m_encoded = m.encode(include_path=False)
+                    digest = hashlib.sha1(m_encoded).digest()
+                    if self._hashes.get(digest) is None:
+                        self._hashes.add(digest, m_off)
                     m_off = m_file.tell()
                     m = metadata.Metadata.read(m_file)
             except EOFError:
                 pass
             except:
-                log('index metadata in %r appears to be corrupt' % filename)
+                log('index metadata in %r appears to be corrupt' % self._filename)
                 raise
         finally:
             m_file.close()
-        self._file = open(filename, 'ab')
 
     def close(self):
+        # The table stays open (read-only in effect) so that store()
+        # can still find existing records.
         if self._file:
             self._file.close()
             self._file = None
+            self._hashes.mark_clean(self._end,
+                                    hashlib.sha1(self._tail).digest())
 
     def __del__(self):
         # Be optimistic.
         self.close()
+        if self._hashes:
+            self._hashes.close()
 
     def store(self, metadata):
         meta_encoded = metadata.encode(include_path=False)
-        ofs = self._offsets.get(meta_encoded)
-        if ofs:
+        digest = hashlib.sha1(meta_encoded).digest()
+        ofs = self._hashes.get(digest)
+        if ofs is not None:
             return ofs
-        ofs = self._file.tell()
+        ofs = self._end
         self._file.write(meta_encoded)
-        self._offsets[meta_encoded] = ofs
+        self._end += len(meta_encoded)
+        self._tail = (self._tail + meta_encoded)[-_meta_check_len:]
+        self._hashes.add(digest, ofs)
         return ofs
 
 
@@ -0,0 +1,144 @@
+"""Shared table of the objects that concurrent writers have in flight.
+
+Every pack writer that opens the same table (i.e. every bup server
+session for a repository) publishes the id of each object as it writes
+it to a pack that hasn't been finished yet, and can ask whether any
+other writer has already done so.  That lets concurrent sessions avoid
+storing the same objects twice, even though none of them can see the
+others' packs until they're finished.
+
+The table is a memory mapped file: a header followed by an append-only
+array of (sha, tag) records, where the tag identifies the publishing
+table instance.  Appends are lock-free (cf. _helpers.inflight_append);
+a flock is only taken to open the table, and the table is cleared by
+the first opener after all of the previous users are gone.
+
+Since another writer's pack may never be finished (e.g. if its client
+disconnects), an object found here can only be "borrowed" (cf.
+git.PackWriter.borrow_inflight), never assumed to be stored.
+
+"""
+
+from __future__ import absolute_import
+import errno, fcntl, os, struct
+
+from bup import _helpers, metrics
+from bup.helpers import debug1, log, mmap_readwrite
+from bup.io import path_msg
+
+
+HEADER = struct.Struct('=8sII2Q')
+HEADERLEN = 64
+RECLEN = 24
+MAGIC = b'BUPINFL\0'
+VERSION = 1
+
+_published = metrics.counter('inflight.published')
+_full = metrics.counter('inflight.full')
+
+
+class Inflight:
+    def __init__(self, filename, capacity=1 << 20):
+        self.name = filename
+        self.capacity = capacity
+        self.size = HEADERLEN + capacity * RECLEN
+        self.file = self.map = None
+        self.pos = 0
+        self.foreign = set()
+        self.full = False
+        tag = 0
+        while not tag:
+            tag = struct.unpack('=I', os.urandom(4))[0]
+        self.tag = tag
+        fd = os.open(filename, os.O_RDWR | os.O_CREAT, 0o666)
+        try:
+            self.file = os.fdopen(fd, 'r+b')
+        except:
+            os.close(fd)
+            raise
+        try:
+            self._lock_and_map()
+        except:
+            self.close()
+            raise
+
+    def _lock_and_map(self):
+        fd = self.file.fileno()
+        try:
+            fcntl.flock(fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+            sole_user = True
+        except IOError as ex:
+            if ex.errno not in (errno.EAGAIN, errno.EWOULDBLOCK):
+                raise
+            sole_user = False
+        if sole_user:
+            self._reset()
+        # Holding a shared lock for as long as the table's open keeps
+        # anyone else from resetting it.
+        fcntl.flock(fd, fcntl.LOCK_SH)
+        if os.fstat(fd).st_size != self.size:
+            # Someone else is using a table with a different capacity.
+            raise IOError(errno.EINVAL, 'unexpected inflight table size',
+                          self.name)
+        self.map = mmap_readwrite(self.file, self.size, close=False)
+        magic, version, capacity = HEADER.unpack_from(self.map)[:3]
+        if magic != MAGIC or version != VERSION or capacity != self.capacity:
+            raise IOError(errno.EINVAL, 'invalid inflight table', self.name)
+
+    def _reset(self):
+        f = self.file
+        generation = 0
+        if os.fstat(f.fileno()).st_size == self.size:
+            f.seek(0)
+            header = f.read(HEADER.size)
+            magic, version, capacity, generation, next = HEADER.unpack(header)
+            if magic != MAGIC or version != VERSION:
+                generation = 0
+        # Truncating to zero first discards all of the old records
+        # without writing them (the file stays sparse).
+        f.truncate(0)
+        f.truncate(self.size)
+        f.seek(0)
+        f.write(HEADER.pack(MAGIC, VERSION, self.capacity, generation + 1, 0))
+        f.flush()
+        debug1('inflight: reset %s\n' % path_msg(self.name))
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.close()
+
+    def close(self):
+        map, self.map = self.map, None
+        f, self.file = self.file, None
+        if map:
+            map.close()
+        if f:
+            f.close()  # Drops the flock
+
+    def add(self, sha):
+        """Publish sha as being written by this table's owner."""
+        if self.full:
+            return
+        if _helpers.inflight_append(self.map, sha, self.tag) is None:
+            self.full = True
+            _full.value += 1
+            log('warning: inflight table %s is full\n' % path_msg(self.name))
+            return
+        _published.value += 1
+
+    def _catch_up(self):
+        shas, self.pos = _helpers.inflight_scan(self.map, self.pos, self.tag)
+        for ofs in range(0, len(shas), 20):
+            self.foreign.add(shas[ofs:ofs+20])
+
+    def exists(self, sha):
+        """Return true if some other table's owner has published sha."""
+        if sha in self.foreign:
+            return True
+        self._catch_up()
+        return sha in self.foreign
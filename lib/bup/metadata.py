@@ -7,13 +7,14 @@
 
 from __future__ import absolute_import, print_function
 from binascii import hexlify
+from collections import deque
 from copy import deepcopy
 from errno import EACCES, EINVAL, ENOTTY, ENOSYS, EOPNOTSUPP
 from io import BytesIO
 from time import gmtime, strftime
-import errno, os, sys, stat, time, pwd, grp, socket, struct
+import errno, os, sys, stat, time, pwd, grp, socket, struct, threading
 
-from bup import compat, vint, xstat
+from bup import _helpers, compat, vint, xstat
 from bup.compat import py_maj
 from bup.drecurse import recursive_dirlist
 from bup.helpers import add_error, mkdirp, log, is_superuser, format_filesize
@@ -265,27 +266,43 @@ class Metadata:
             and self.group == other.group \
             and self.size == other.size
 
-    def _encode_common(self):
+    def _common_fields(self):
         if not self.mode:
             return None
         atime = xstat.nsecs_to_timespec(self.atime)
         mtime = xstat.nsecs_to_timespec(self.mtime)
         ctime = xstat.nsecs_to_timespec(self.ctime)
-        result = vint.pack('vvsvsvvVvVvVv',
-                           self.mode,
-                           self.uid,
-                           self.user,
-                           self.gid,
-                           self.group,
-                           self.rdev,
-                           atime[0],
-                           atime[1],
-                           mtime[0],
-                           mtime[1],
-                           ctime[0],
-                           ctime[1],
-                           self.size if self.size is not None else -1)
-        return result
+        return (self.mode,
+                self.uid,
+                self.user,
+                self.gid,
+                self.group,
+                self.rdev,
+                atime[0],
+                atime[1],
+                mtime[0],
+                mtime[1],
+                ctime[0],
+                ctime[1],
+                self.size if self.size is not None else -1)
+
+    def _encode_common(self):
+        fields = self._common_fields()
+        if not fields:
+            return None
+        return vint.pack('vvsvsvvVvVvVv', *fields)
+
+    def _set_common_fields(self, fields):
+        (self.mode, self.uid, self.user, self.gid, self.group,
+         self.rdev,
+         atime, atime_ns,
+         mtime, mtime_ns,
+         ctime, ctime_ns, size) = fields
+        if size >= 0:
+            self.size = size
+        self.atime = xstat.timespec_to_nsecs((atime, atime_ns))
+        self.mtime = xstat.timespec_to_nsecs((mtime, mtime_ns))
+        self.ctime = xstat.timespec_to_nsecs((ctime, ctime_ns))
 
     def _load_common_rec(self, port, version=3):
         if version == 3:
@@ -299,23 +316,9 @@ class Metadata:
             raise Exception('unexpected common_rec version %d' % version)
         data = vint.read_bvec(port)
         values = vint.unpack(unpack_fmt, data)
-        if version == 3:
-            (self.mode, self.uid, self.user, self.gid, self.group,
-             self.rdev,
-             self.atime, atime_ns,
-             self.mtime, mtime_ns,
-             self.ctime, ctime_ns, size) = values
-            if size >= 0:
-                self.size = size
-        else:
-            (self.mode, self.uid, self.user, self.gid, self.group,
-             self.rdev,
-             self.atime, atime_ns,
-             self.mtime, mtime_ns,
-             self.ctime, ctime_ns) = values
-        self.atime = xstat.timespec_to_nsecs((self.atime, atime_ns))
-        self.mtime = xstat.timespec_to_nsecs((self.mtime, mtime_ns))
-        self.ctime = xstat.timespec_to_nsecs((self.ctime, ctime_ns))
+        if version != 3:
+            values.append(-1)
+        self._set_common_fields(values)
 
     def _recognized_file_type(self):
         return stat.S_ISREG(self.mode) \
@@ -684,22 +687,17 @@ class Metadata:
 
     def _encode_linux_xattr(self):
         if self.linux_xattr:
-            result = vint.pack('V', len(self.linux_xattr))
+            result = [vint.pack('V', len(self.linux_xattr))]
             for name, value in self.linux_xattr:
-                result += vint.pack('ss', name, value)
-            return result
+                result.append(vint.pack('ss', name, value))
+            return b''.join(result)
         else:
             return None
 
     def _load_linux_xattr_rec(self, file):
         data = vint.read_bvec(file)
-        memfile = BytesIO(data)
-        result = []
-        for i in range(vint.read_vuint(memfile)):
-            key = vint.read_bvec(memfile)
-            value = vint.read_bvec(memfile)
-            result.append((key, value))
-        self.linux_xattr = result
+        (n,), ofs = vint.unpack_from('V', data)
+        self.linux_xattr = vint.unpack_many('ss', data, n, ofs)[0]
 
     def _apply_linux_xattr_rec(self, path, restore_numeric_ids=False):
         if not xattr:
@@ -814,7 +812,7 @@ class Metadata:
         result += '>'
         return ''.join(result)
 
-    def write(self, port, include_path=True):
+    def _write_records(self, port, include_path=True):
         records = include_path and [(_rec_tag_path, self._encode_path())] or []
         records.extend([(_rec_tag_common_v3, self._encode_common()),
                         (_rec_tag_symlink_target,
@@ -830,10 +828,23 @@ class Metadata:
                 vint.write_bvec(port, data)
         vint.write_vuint(port, _rec_tag_end)
 
+    def write(self, port, include_path=True):
+        port.write(self.encode(include_path))
+
     def encode(self, include_path=True):
-        port = BytesIO()
-        self.write(port, include_path)
-        return port.getvalue()
+        try:
+            return _helpers.metadata_encode(include_path and self.path or None,
+                                            self._common_fields(),
+                                            self.symlink_target,
+                                            self.hardlink_target,
+                                            self.posix1e_acl,
+                                            self.linux_attr,
+                                            self.linux_xattr)
+        except OverflowError:
+            # e.g. a value that doesn't fit in 64 bits
+            port = BytesIO()
+            self._write_records(port, include_path)
+            return port.getvalue()
 
     def copy(self):
         return deepcopy(self)
@@ -877,6 +888,30 @@ class Metadata:
         except EOFError:
             raise Exception("EOF while reading Metadata")
 
+    @staticmethod
+    def _from_fields(fields):
+        # Apply the fields (as returned by _helpers.metadata_decode())
+        # in the same order read() would for a written entry.
+        (path, common, symlink_target, hardlink_target,
+         posix1e_acl, linux_attr, linux_xattr) = fields
+        result = Metadata()
+        result.path = path
+        if common:
+            result._set_common_fields(common)
+        if symlink_target is not None:
+            result.symlink_target = symlink_target
+            if result.size is None:
+                result.size = len(symlink_target)
+            else:
+                assert(result.size == len(symlink_target))
+        result.hardlink_target = hardlink_target
+        if posix1e_acl is not None and posix1e_acl[2] == b'':
+            posix1e_acl = posix1e_acl[:2]
+        result.posix1e_acl = posix1e_acl
+        result.linux_attr = linux_attr
+        result.linux_xattr = linux_xattr
+        return result
+
     def isdir(self):
         return stat.S_ISDIR(self.mode)
 
@@ -915,6 +950,24 @@ class Metadata:
             and self._same_linux_xattr(other)
 
 
+def decode_all(data):
+    """Yield each Metadata object encoded in data (e.g. the content of
+    a .bupm file), or None for an empty entry, as read() would."""
+    try:
+        entries = _helpers.metadata_decode(data)
+    except (EOFError, OverflowError, ValueError):
+        # Let read() handle (or complain about) anything unusual.
+        port = BytesIO(data)
+        while True:
+            try:
+                m = Metadata.read(port)
+            except EOFError:
+                return
+            yield m
+    for ent in entries:
+        yield None if ent is None else Metadata._from_fields(ent)
+
+
 def from_path(path, statinfo=None, archive_path=None,
               save_symlinks=True, hardlink_target=None,
               normalized=False):
@@ -938,6 +991,80 @@ def from_path(path, statinfo=None, archive_path=None,
     return result
 
 
+
+class Harvester:
+    """Collect from_path() results on a pool of threads, so that the
+    filesystem calls for many paths (stat, readlink, ACL, attr, and
+    xattr requests) can be in flight at once, which matters most on
+    network filesystems.  submit() takes from_path()'s arguments, and
+    returns a function that returns the metadata, or raises whatever
+    from_path() raised, waiting for it if necessary.  Callers can
+    resolve those in submission order to keep their output ordered.
+    With no threads, from_path() is just called when the function is.
+
+    """
+    def __init__(self, threads=0):
+        self._jobs = deque()
+        lock = threading.Lock()
+        self._job_ready = threading.Condition(lock)
+        self._result_ready = threading.Condition(lock)
+        self._closed = False
+        self._threads = []
+        for i in range(threads):
+            t = threading.Thread(target=self._work)
+            t.daemon = True
+            t.start()
+            self._threads.append(t)
+
+    def _work(self):
+        jobs = self._jobs
+        while True:
+            with self._job_ready:
+                while not jobs and not self._closed:
+                    self._job_ready.wait()
+                if not jobs:
+                    return
+                slot, args, kwargs = jobs.popleft()
+            try:
+                result = (from_path(*args, **kwargs), None)
+            except Exception as e:
+                result = (None, e)
+            with self._result_ready:
+                slot.append(result)
+                self._result_ready.notify_all()
+
+    def submit(self, *args, **kwargs):
+        if not self._threads:
+            return lambda: from_path(*args, **kwargs)
+        slot = []
+        with self._job_ready:
+            self._jobs.append((slot, args, kwargs))
+            self._job_ready.notify()
+        def result():
+            with self._result_ready:
+                while not slot:
+                    self._result_ready.wait()
+            meta, ex = slot[0]
+            if ex:
+                raise ex
+            return meta
+        return result
+
+    def close(self):
+        with self._job_ready:
+            self._closed = True
+            self._job_ready.notify_all()
+        for t in self._threads:
+            t.join()
+        self._threads = []
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.close()
+
+
 def save_tree(output_file, paths,
               recurse=False,
               write_paths=True,
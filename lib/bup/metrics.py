@@ -0,0 +1,157 @@
+"""Process-wide performance counters and histograms.
+
+Instrumented code fetches its metrics once, at import time, via
+counter() or histogram(), and then just updates them, which costs
+about as much as incrementing a module global.  The current values
+can be retrieved via snapshot(), and written as JSON via dump(),
+either at exit or on a signal (cf. enable_stats()).
+
+"""
+
+from __future__ import absolute_import
+import atexit, json, math, signal, sys, time
+
+from bup.io import byte_stream
+
+
+_registry = {}
+
+
+class Counter(object):
+    __slots__ = ('name', 'value')
+
+    def __init__(self, name):
+        self.name = name
+        self.value = 0
+
+    def add(self, n=1):
+        self.value += n
+
+    def snapshot(self):
+        return self.value
+
+
+class Histogram(object):
+    """Distribution of nonnegative values (seconds by default), kept
+    as counts per power of two, so percentiles are only accurate to
+    within a factor of two."""
+    __slots__ = ('name', 'unit', 'count', 'total', 'min', 'max', 'buckets')
+
+    def __init__(self, name, unit):
+        self.name = name
+        self.unit = unit
+        self.count = 0
+        self.total = 0
+        self.min = self.max = None
+        self.buckets = {}
+
+    def record(self, value):
+        self.count += 1
+        self.total += value
+        if self.min is None or value < self.min:
+            self.min = value
+        if self.max is None or value > self.max:
+            self.max = value
+        # Values in [2**(e-1), 2**e) land in bucket e.
+        e = math.frexp(value)[1] if value > 0 else None
+        self.buckets[e] = self.buckets.get(e, 0) + 1
+
+    def percentile(self, p):
+        if not self.count:
+            return None
+        rank = max(1, int(math.ceil(self.count * p / 100.0)))
+        seen = 0
+        for e in sorted(self.buckets, key=lambda e: -1e9 if e is None else e):
+            seen += self.buckets[e]
+            if seen >= rank:
+                if e is None:
+                    return 0
+                return min(math.ldexp(1, e), self.max)
+        return self.max
+
+    def snapshot(self):
+        return {'unit': self.unit,
+                'count': self.count,
+                'total': self.total,
+                'min': self.min,
+                'max': self.max,
+                'p50': self.percentile(50),
+                'p90': self.percentile(90),
+                'p99': self.percentile(99)}
+
+
+class _Timer(object):
+    __slots__ = ('histogram', 'start')
+
+    def __init__(self, histogram):
+        self.histogram = histogram
+
+    def __enter__(self):
+        self.start = time.time()
+
+    def __exit__(self, type, value, traceback):
+        self.histogram.record(time.time() - self.start)
+
+
+def counter(name):
+    """Return the counter called name, creating it if necessary."""
+    m = _registry.get(name)
+    if m is None:
+        m = _registry[name] = Counter(name)
+    assert isinstance(m, Counter)
+    return m
+
+
+def histogram(name, unit='s'):
+    """Return the histogram called name, creating it if necessary."""
+    m = _registry.get(name)
+    if m is None:
+        m = _registry[name] = Histogram(name, unit)
+    assert isinstance(m, Histogram)
+    return m
+
+
+def timed(name):
+    """Return a context manager that records the time spent within it
+    in the histogram called name."""
+    return _Timer(histogram(name))
+
+
+def snapshot():
+    """Return a dict mapping the name of every metric that has been
+    updated to its current value."""
+    result = {}
+    for name, m in _registry.items():
+        if isinstance(m, Counter):
+            if m.value:
+                result[name] = m.value
+        elif m.count:
+            result[name] = m.snapshot()
+    return result
+
+
+def reset():
+    for m in _registry.values():
+        m.__init__(*((m.name,) if isinstance(m, Counter) else
+                     (m.name, m.unit)))
+
+
+def dump(out=None):
+    """Write the snapshot() to out (default stderr) as a JSON object
+    on a single line."""
+    out = out or byte_stream(sys.stderr)
+    out.write(json.dumps(snapshot(), sort_keys=True).encode('ascii') + b'\n')
+    out.flush()
+
+
+stats_formats = ('json',)
+
+def enable_stats(fmt):
+    """Arrange for the metrics to be dumped (in fmt) to stderr at exit,
+    and whenever the process receives SIGUSR1.  Return false if fmt
+    isn't one of the stats_formats."""
+    if fmt not in stats_formats:
+        return False
+    atexit.register(dump)
+    signal.signal(signal.SIGUSR1, lambda signum, frame: dump())
+    return True
@@ -1,18 +1,22 @@
 
 from __future__ import absolute_import, print_function
-import glob, mmap, os, struct
+import glob, math, mmap, os, resource, struct
 
-from bup import _helpers
+from bup import _helpers, metrics
 from bup.compat import range
-from bup.helpers import log, mmap_read
+from bup.helpers import (atomically_replaced_file, debug1, fdatasync, log,
+                         mmap_read, mmap_readwrite, unlink)
 from bup.io import path_msg
 
 
 MIDX_VERSION = 4
 
+PAGE_SIZE=4096
+SHA_PER_PAGE=PAGE_SIZE/20.
+
 extract_bits = _helpers.extract_bits
-_total_searches = 0
-_total_steps = 0
+_probes = metrics.counter('midx.probes')
+_steps = metrics.counter('midx.steps')
 
 
 class PackMidx:
@@ -92,8 +96,7 @@ class PackMidx:
 
     def exists(self, hash, want_source=False):
         """Return nonempty if the object exists in the index files."""
-        global _total_searches, _total_steps
-        _total_searches += 1
+        _probes.value += 1
         want = hash
         el = extract_bits(want, self.bits)
         if el:
@@ -104,11 +107,11 @@ class PackMidx:
             startv = 0
         end = self._fanget(el)
         endv = (el+1) << (32-self.bits)
-        _total_steps += 1   # lookup table is a step
+        steps = 1   # lookup table is a step
         hashv = _helpers.firstword(hash)
         #print '(%08x) %08x %08x %08x' % (extract_bits(want, 32), startv, hashv, endv)
         while start < end:
-            _total_steps += 1
+            steps += 1
             #print '! %08x %08x %08x   %d - %d' % (startv, hashv, endv, start, end)
             mid = start + (hashv - startv) * (end - start - 1) // (endv - startv)
             #print '  %08x %08x %08x   %d %d %d' % (startv, hashv, endv, start, mid, end)
@@ -121,7 +124,9 @@ class PackMidx:
                 end = mid
                 endv = _helpers.firstword(v)
             else: # got it!
+                _steps.value += steps
                 return want_source and self._get_idxname(mid) or True
+        _steps.value += steps
         return None
 
     def __iter__(self):
@@ -133,6 +138,58 @@ class PackMidx:
         return int(self.nsha)
 
 
+def max_files():
+    """Return the number of idx files it's safe to open at once."""
+    mf = min(resource.getrlimit(resource.RLIMIT_NOFILE))
+    if mf > 32:
+        mf -= 20  # just a safety margin
+    else:
+        mf -= 6   # minimum safety margin
+    return mf
+
+
+def write(outfilename, ixs):
+    """Write a midx covering all of the objects in the open idx and
+    midx files ixs to outfilename, and return the number of objects."""
+    inp = []
+    total = 0
+    allfilenames = []
+    for ix in ixs:
+        inp.append((
+            ix.map,
+            len(ix),
+            ix.sha_ofs,
+            isinstance(ix, PackMidx) and ix.which_ofs or 0,
+            len(allfilenames),
+        ))
+        for n in ix.idxnames:
+            allfilenames.append(os.path.basename(n))
+        total += len(ix)
+    inp.sort(reverse=True, key=lambda x: x[0][x[2] : x[2] + 20])
+
+    pages = int(total/SHA_PER_PAGE) or 1
+    bits = int(math.ceil(math.log(pages, 2)))
+    entries = 2**bits
+    debug1('midx: table size: %d (%d bits)\n' % (entries*4, bits))
+
+    unlink(outfilename)
+    with atomically_replaced_file(outfilename, 'wb') as f:
+        f.write(b'MIDX')
+        f.write(struct.pack('!II', MIDX_VERSION, bits))
+        assert(f.tell() == 12)
+
+        f.truncate(12 + 4*entries + 20*total + 4*total)
+        f.flush()
+        fdatasync(f.fileno())
+
+        fmap = mmap_readwrite(f, close=False)
+        _helpers.merge_into(fmap, bits, total, inp)
+        del fmap # Assume this calls msync() now.
+        f.seek(0, os.SEEK_END)
+        f.write(b'\0'.join(allfilenames))
+    return total
+
+
 def clear_midxes(dir=None):
     for midx in glob.glob(os.path.join(dir, b'*.midx')):
         os.unlink(midx)
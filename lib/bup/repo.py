@@ -68,6 +68,15 @@ class LocalRepo:
                 yield data
         assert not next(it, None)
 
+    def cat_batch(self, refs):
+        """Yield (oidx, type, size, data_iterator) for each ref in refs,
+        or (None, None, None, None) if the ref doesn't exist.  The
+        data for each ref must be read (if at all) before asking for
+        the next result.
+
+        """
+        return self._cp.get_many(refs)
+
     def join(self, ref):
         return self._cp.join(ref)
 
@@ -135,6 +144,15 @@ class RemoteRepo:
                 yield data
         assert not next(items, None)
 
+    def cat_batch(self, refs):
+        """Yield (oidx, type, size, data_iterator) for each ref in refs,
+        or (None, None, None, None) if the ref doesn't exist.  The
+        data for each ref must be read (if at all) before asking for
+        the next result.
+
+        """
+        return self.client.cat_batch(refs)
+
     def join(self, ref):
         return self.client.join(ref)
 
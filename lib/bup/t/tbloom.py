@@ -1,6 +1,6 @@
 
 from __future__ import absolute_import, print_function
-import errno, platform, tempfile
+import errno, platform, tempfile, threading
 
 from wvtest import *
 
@@ -15,10 +15,10 @@ def test_bloom():
         with test_tempdir(b'bup-tbloom-') as tmpdir:
             hashes = [os.urandom(20) for i in range(100)]
             class Idx:
-                pass
+                def shas(self):
+                    return b''.join(hashes)
             ix = Idx()
             ix.name = b'dummy.idx'
-            ix.shatable = b''.join(hashes)
             for k in (4, 5):
                 b = bloom.create(tmpdir + b'/pybuptest.bloom', expected=100, k=k)
                 b.add_idx(ix)
@@ -34,6 +34,12 @@ def test_bloom():
                     if b.exists(h):
                         false_positives += 1
                 WVPASSLT(false_positives, 5)
+                others = [os.urandom(20) for i in range(1000)]
+                found = b.exists_many(b''.join(hashes + others))
+                WVPASSEQ(1100, len(found))
+                WVPASSEQ(bytearray(b'\1' * 100), found[:100])
+                WVPASSEQ([bool(b.exists(h)) for h in others],
+                         [bool(x) for x in found[100:]])
                 os.unlink(tmpdir + b'/pybuptest.bloom')
 
             tf = tempfile.TemporaryFile(dir=tmpdir)
@@ -59,3 +65,26 @@ def test_bloom():
                     raise
             if not skip_test:
                 WVPASSEQ(b.k, 4)
+
+
+@wvtest
+def test_concurrent_add():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tbloom-') as tmpdir:
+            parts = [b''.join(os.urandom(20) for i in range(5000))
+                     for i in range(8)]
+            for k in (4, 5):
+                b = bloom.create(tmpdir + b'/pybuptest.bloom',
+                                 expected=40000, k=k)
+                threads = [threading.Thread(target=b.add, args=(part,),
+                                            kwargs={'concurrent': True})
+                           for part in parts]
+                for t in threads:
+                    t.start()
+                for t in threads:
+                    t.join()
+                WVPASSEQ(len(b), 40000)
+                WVPASSEQ(bytearray(b'\1' * 40000),
+                         b.exists_many(b''.join(parts)))
+                b.close()
+                os.unlink(tmpdir + b'/pybuptest.bloom')
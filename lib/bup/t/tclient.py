@@ -139,6 +139,23 @@ def test_midx_refreshing():
             WVPASSEQ(len(pi.packs), 1)
 
 
+@wvtest
+def test_config_get():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tclient-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir
+            git.init_repo(bupdir)
+            c = client.Client(bupdir, create=True)
+            WVPASSEQ(c.config_get(b'bup.split.files'), None)
+            subprocess.check_call([b'git', b'--git-dir', bupdir, b'config',
+                                   b'bup.split.files', b'fastcdc'])
+            WVPASSEQ(c.config_get(b'bup.split.files'), b'fastcdc')
+            # Other settings aren't revealed, and don't end the session.
+            WVPASSEQ(c.config_get(b'core.bare'), None)
+            WVPASSEQ(c.config_get(b'bup.split.files'), b'fastcdc')
+            c.close()
+
+
 @wvtest
 def test_remote_parsing():
     with no_lingering_errors():
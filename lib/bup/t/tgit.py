@@ -2,13 +2,14 @@
 from __future__ import absolute_import, print_function
 from binascii import hexlify, unhexlify
 from subprocess import check_call
-import struct, os, time
+import glob, struct, os, time
 
 from wvtest import *
 
-from bup import git, path
+from bup import bloom, git, midx, path
 from bup.compat import bytes_from_byte, environ, range
 from bup.helpers import localtime, log, mkdirp, readpipe
+from bup.inflight import Inflight
 from buptest import no_lingering_errors, test_tempdir
 
 
@@ -83,6 +84,61 @@ def testencode():
         WVEXCEPT(ValueError, encode_pobj, b'x')
 
 
+@wvtest
+def test_tree_encode_decode():
+    with no_lingering_errors():
+        sha1, sha2, sha3 = b'\1' * 20, b'\2' * 20, b'\3' * 20
+        shalist = [(0o40000, b'a', sha1),
+                   (0o100644, b'a.b', sha2),
+                   (0o100644, b'a0', sha3)]
+        tree = git.tree_encode(shalist)
+        # Directories sort as if their names ended with a '/'
+        WVPASSEQ(tree,
+                 b'100644 a.b\0' + sha2 + b'40000 a\0' + sha1
+                 + b'100644 a0\0' + sha3)
+        WVPASSEQ(list(git.tree_decode(tree)),
+                 [(0o100644, b'a.b', sha2),
+                  (0o40000, b'a', sha1),
+                  (0o100644, b'a0', sha3)])
+        WVPASSEQ(git.tree_encode([]), b'')
+        WVPASSEQ(list(git.tree_decode(b'')), [])
+        WVEXCEPT(ValueError, git.tree_encode, [(0, b'a', sha1)])
+        WVEXCEPT(ValueError, git.tree_encode, [(0o100644, b'', sha1)])
+        WVEXCEPT(ValueError, git.tree_encode, [(0o100644, b'a', b'x')])
+        WVEXCEPT(ValueError, git.tree_decode, b'100644 a\0' + sha1[:19])
+        WVEXCEPT(ValueError, git.tree_decode, b'100648 a\0' + sha1)
+        WVEXCEPT(ValueError, git.tree_decode, b'100644a\0' + sha1)
+
+
+@wvtest
+def test_pack_compression():
+    with no_lingering_errors():
+        text = b'hello world ' * 1000
+        noise = os.urandom(len(text))
+        pc = git.PackCompression(6)
+        packt = b''.join(pc.encode(b'blob', text))
+        packn = b''.join(pc.encode(b'blob', noise))
+        WVPASSEQ(git._decode_packobj(packt), (b'blob', text))
+        WVPASSEQ(git._decode_packobj(packn), (b'blob', noise))
+        WVPASS(len(packt) < len(text) // 10)
+        WVPASS(len(packn) > len(noise))
+        WVPASSEQ(pc.objects, 2)
+        WVPASSEQ(pc.stored, 1)
+        WVPASSEQ(pc.bytes_in, len(text) + len(noise))
+
+        pc = git.PackCompression(1, auto=True)
+        for i in range(git._compression_auto_sample_len // len(noise) + 1):
+            pc.encode(b'blob', os.urandom(len(noise)))
+        WVPASSEQ(pc._stream_level, 0)
+        packt = b''.join(pc.encode(b'blob', text))
+        WVPASSEQ(git._decode_packobj(packt), (b'blob', text))
+        WVPASS(len(packt) > len(text))
+        pc.start_stream()
+        packt = b''.join(pc.encode(b'blob', text))
+        WVPASS(len(packt) < len(text) // 10)
+        WVEXCEPT(ValueError, git.PackCompression, 10)
+
+
 @wvtest
 def testpacks():
     with no_lingering_errors():
@@ -153,6 +209,75 @@ def test_pack_name_lookup():
                     WVPASSEQ(idxname, r.exists(hashes[i], want_source=True))
 
 
+@wvtest
+def test_pack_manifest():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            packdir = git.repo(b'objects/pack')
+            hits, scans = git._manifest_hits, git._manifest_scans
+            hashes = []
+            def write_pack(i):
+                w = git.PackWriter()
+                hashes.append(w.new_blob(b'%d' % i))
+                w.close(run_midx=False)
+            def check(expected_hits, expected_scans):
+                before = hits.value, scans.value
+                r = git.PackIdxList(packdir)
+                WVPASSEQ(hits.value - before[0], expected_hits)
+                WVPASSEQ(scans.value - before[1], expected_scans)
+                for sha in hashes:
+                    WVPASS(r.exists(sha))
+                return len(r.packs)
+
+            # The first writer's objcache creates the manifest, and
+            # pack writers keep it current.
+            write_pack(0)
+            write_pack(1)
+            WVPASSEQ(check(1, 0), 2)
+            write_pack(2)
+            WVPASSEQ(check(1, 0), 3)
+
+            # Anything else that changes the directory makes it stale.
+            os.utime(packdir, (0, 0))
+            WVPASSEQ(check(0, 1), 3)
+            WVPASSEQ(check(1, 0), 3)
+
+            # As does any damage to it.
+            with open(packdir + b'/bup.manifest', 'r+b') as f:
+                f.seek(-1, os.SEEK_END)
+                f.write(b'x')
+            WVPASSEQ(check(0, 1), 3)
+            WVPASSEQ(check(1, 0), 3)
+
+            # A midx may cover more idx files than fit in 16 bits.
+            manifest = git.PackManifest(packdir)
+            with manifest.lock() as f:
+                WVPASS(manifest.write(f, manifest.stamp(),
+                                      [(b'x.midx', 1, 70000)]))
+            WVPASSEQ(manifest.read(), [(b'x.midx', 1, 70000)])
+
+            # A manifest that can't be written is left empty, and the
+            # directory is just scanned.
+            with manifest.lock() as f:
+                WVFAIL(manifest.write(f, manifest.stamp(),
+                                      [(b'x.midx', 1, 1 << 32)]))
+            WVPASSEQ(manifest.read(), None)
+            class Unwritable:
+                def pack(self, *args):
+                    raise struct.error('too big')
+            entry = git.PackManifest.ENTRY
+            git.PackManifest.ENTRY = Unwritable()
+            try:
+                WVPASSEQ(check(0, 1), 3)
+                WVPASSEQ(check(0, 1), 3)
+            finally:
+                git.PackManifest.ENTRY = entry
+            WVPASSEQ(check(0, 1), 3)
+            WVPASSEQ(check(1, 0), 3)
+
+
 @wvtest
 def test_long_index():
     with no_lingering_errors():
@@ -181,6 +306,117 @@ def test_long_index():
             WVPASSEQ(i.find_offset(obj3_bin), 0xff)
 
 
+@wvtest
+def test_idx_lookup():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            w = git.PackWriter()
+            hashes = [w.new_blob(b'%d' % i) for i in range(1000)]
+            pack_name = w.close() + b'.pack'
+            v1_name = tmpdir + b'/v1.idx'
+            exc(b'git', b'index-pack', b'--index-version=1', b'-o', v1_name,
+                pack_name)
+            missing = [struct.pack('!IIIII', i, i, i, i, i)
+                       for i in (0, 0x7f7f7f7f, 0xffffffff)]
+            for name in (pack_name[:-4] + b'idx', v1_name):
+                ix = git.open_idx(name)
+                shas = bytes(ix.shas())
+                WVPASSEQ(list(ix), [shas[i:i+20] for i in range(0, len(shas), 20)])
+                WVPASSEQ(sorted(hashes), list(ix))
+                for i, sha in enumerate(ix):
+                    WVPASSEQ(i, ix._idx_from_hash(sha))
+                for sha in missing:
+                    WVPASSEQ(None, ix._idx_from_hash(sha))
+                    WVFAIL(ix.exists(sha))
+                WVPASSEQ(list(range(len(ix))) + [None] * len(missing),
+                         ix.exists_many(shas + b''.join(missing)))
+                WVPASSEQ([], ix.exists_many(b''))
+
+
+@wvtest
+def test_inflight_borrow():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            table = git.repo(b'bup-inflight')
+            def blob(content):
+                return (git.calc_hash(b'blob', content),
+                        b''.join(git._encode_packobj(b'blob', content)))
+            written = git._pack_borrowed_written
+            for finish in (False, True):
+                with Inflight(table) as in1, Inflight(table) as in2:
+                    WVPASSNE(in1.tag, in2.tag)
+                    w1 = git.PackWriter(objcache_maker=None, inflight=in1)
+                    w2 = git.PackWriter(inflight=in2)
+                    sha, raw = blob(b'shared %r' % finish)
+                    other_sha, other_raw = blob(b'other %r' % finish)
+                    w1._raw_write((raw,), sha)
+                    WVFAIL(in1.exists(sha))
+                    WVPASS(in2.exists(sha))
+                    WVPASS(w2.borrow_inflight(sha, raw))
+                    WVFAIL(w2.borrow_inflight(other_sha, other_raw))
+                    w2._raw_write((other_raw,), other_sha)
+                    before = written.value
+                    if finish:
+                        w1.close(run_midx=False)
+                    else:
+                        w1.abort()
+                    w2.close(run_midx=False)
+                    WVPASSEQ(written.value - before, 0 if finish else 1)
+                    WVPASS(git.PackIdxList(git.repo(b'objects/pack')).exists(sha))
+
+
+@wvtest
+def test_pack_maintainer():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            packdir = git.repo(b'objects/pack')
+            shas = []
+            def write_pack(i):
+                w = git.PackWriter()
+                for j in range(200):
+                    shas.append(w.new_blob(b'%d %d' % (i, j)))
+                w.close(run_midx=False)
+            for i in range(8):
+                write_pack(i)
+            m = git.PackMaintainer(packdir)
+            m.request()
+            midxs = glob.glob(packdir + b'/*.midx')
+            WVPASSEQ(len(midxs), 1)
+            WVPASSEQ(len(midx.PackMidx(midxs[0]).idxnames), 7)
+            b = bloom.ShaBloom(packdir + b'/bup.bloom')
+            WVPASSEQ(len(b), 1600)
+            WVPASSEQ(len(b.idxnames), 8)
+            WVPASSEQ(bytearray(b'\1' * 1600), b.exists_many(b''.join(shas)))
+            b.close()
+
+            # Later updates only open the new idx.
+            opened = []
+            open_idx = git.open_idx
+            def counting_open_idx(name):
+                opened.append(name)
+                return open_idx(name)
+            write_pack(8)
+            git.open_idx = counting_open_idx
+            try:
+                m.request(background=True)
+                m.wait()
+            finally:
+                git.open_idx = open_idx
+            WVPASSEQ(len(set(opened)), 1)
+            WVPASS(opened[0].endswith(b'.idx'))
+            b = bloom.ShaBloom(packdir + b'/bup.bloom')
+            WVPASSEQ(len(b), 1800)
+            WVPASSEQ(bytearray(b'\1' * 1800), b.exists_many(b''.join(shas)))
+            b.close()
+            WVPASSEQ(midxs, glob.glob(packdir + b'/*.midx'))
+
+
 @wvtest
 def test_check_repo_or_die():
     with no_lingering_errors():
@@ -440,3 +676,80 @@ def test_cat_pipe():
             for buf in next(it):
                 pass
             WVPASSEQ((oidx, typ, size), get_info)
+
+
+@wvtest
+def test_cat_pipe_get_many():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            blobs = [b'blob %d\n' % i for i in range(200)]
+            with git.PackWriter() as w:
+                oids = [w.new_blob(b) for b in blobs]
+            missing = b'0' * 40
+            refs = [hexlify(oid) for oid in oids]
+            refs.insert(3, missing)
+            content = dict(zip(refs[:3] + refs[4:], blobs))
+            cp = git.CatPipe()
+            results = list()
+            for i, (oidx, typ, size, it) in enumerate(cp.get_many(refs,
+                                                                  window=8)):
+                if i == 3:
+                    WVPASSEQ((oidx, typ, size, it), (None, None, None, None))
+                    continue
+                WVPASSEQ((oidx, typ, size), (refs[i], b'blob',
+                                             len(content[refs[i]])))
+                # Leave every other blob unread; it should be skipped.
+                if i % 2:
+                    WVPASSEQ(b''.join(it), content[refs[i]])
+                results.append(oidx)
+            WVPASSEQ(len(results), len(blobs))
+
+            # Abandoning a batch shouldn't break later requests.
+            batch = cp.get_many(refs)
+            next(batch)
+            del batch
+            it = cp.get(refs[0])
+            WVPASSEQ(next(it)[0], refs[0])
+            WVPASSEQ(b''.join(it), blobs[0])
+
+
+@wvtest
+def test_walk_object_batched():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tgit-') as tmpdir:
+            environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+            git.init_repo(bupdir)
+            with git.PackWriter() as w:
+                blobs = [w.new_blob(b'blob %d\n' % i) for i in range(10)]
+                sub = w.new_tree([(0o100644, b'%d' % i, oid)
+                                  for i, oid in enumerate(blobs)])
+                # Repeat blobs, and the subtree, to check that each
+                # object is only produced once when stop_at says so.
+                top = w.new_tree([(0o100644, b'a', blobs[0]),
+                                  (0o100644, b'b', blobs[0]),
+                                  (0o40000, b'c', sub),
+                                  (0o40000, b'd', sub)])
+                commit = w.new_commit(top, None,
+                                      b'x <x@x>', 0, None,
+                                      b'x <x@x>', 0, None, b'msg\n')
+            cp = git.CatPipe()
+            def walk(walker, get, include_data):
+                seen = set()
+                items = []
+                for item in walker(get, hexlify(commit),
+                                   stop_at=lambda oidx: oidx in seen,
+                                   include_data=include_data):
+                    seen.add(hexlify(item.oid))
+                    items.append((item.oid, item.type, item.data))
+                return items
+            for include_data in (False, True):
+                expected = walk(git.walk_object, cp.get, include_data)
+                WVPASSEQ(len(expected), 13)
+                for batch_size in (1, 3, 64):
+                    walker = lambda *args, **kwargs: \
+                        git.walk_object_batched(*args, batch_size=batch_size,
+                                                **kwargs)
+                    actual = walk(walker, cp.get_many, include_data)
+                    WVPASSEQ(sorted(actual), sorted(expected))
@@ -1,12 +1,13 @@
 
 from __future__ import absolute_import
 from io import BytesIO
+import io, math, os, random, threading
 
 from wvtest import *
 
-from bup import hashsplit, _helpers, helpers
+from bup import git, hashsplit, _helpers, helpers
 from bup.compat import byte_int, bytes_from_uint
-from buptest import no_lingering_errors
+from buptest import no_lingering_errors, test_tempdir
 
 
 def nr_regions(x, max_count=None):
@@ -137,3 +138,206 @@ def test_fanout_behaviour():
         hashsplit.BLOB_MAX = old_BLOB_MAX
         hashsplit.BLOB_READ_SIZE = old_BLOB_READ_SIZE
         hashsplit.fanout = old_fanout
+
+
+@wvtest
+def test_zero_runs():
+    # Split the whole input at once, the way hashsplit always has, and
+    # make sure the zero run shortcuts don't move any boundaries.
+    def reference_split(data, splitbuf):
+        basebits = _helpers.blobbits()
+        fanbits = int(math.log(hashsplit.fanout or 128, 2))
+        ofs = 0
+        while ofs < len(data):
+            n, bits = splitbuf(data[ofs:])
+            if n and n <= hashsplit.BLOB_MAX:
+                yield n, (bits - basebits) // fanbits
+            else:
+                n = min(hashsplit.BLOB_MAX, len(data) - ofs)
+                yield n, 0
+            ofs += n
+
+    with no_lingering_errors():
+        rand = random.Random(7)
+        parts = []
+        for i in range(40):
+            if rand.randint(0, 1):
+                parts.append(b'\0' * rand.randint(1, 300000))
+            else:
+                n = rand.randint(1, 100000)
+                parts.append(bytes(bytearray(rand.getrandbits(8)
+                                             for i in range(n))))
+        data = b''.join(parts)
+        try:
+            for method, splitbuf in hashsplit.split_methods.items():
+                hashsplit.set_split_method(method)
+                split = [(len(b), level) for b, level in
+                         hashsplit.hashsplit_iter([BytesIO(data)], True, None)]
+                WVPASSEQ(split, list(reference_split(data,
+                                                     getattr(_helpers,
+                                                             splitbuf))))
+        finally:
+            hashsplit.set_split_method(None)
+
+        blobs = []
+        def makeblob(b):
+            blobs.append(len(b))
+            return git.calc_hash(b'blob', b)
+        zeros = BytesIO(b'\0' * (hashsplit.BLOB_MAX * 10 + 1))
+        shas = [sha for sha, size, level in
+                hashsplit.split_to_blobs(makeblob, [zeros], True, None)]
+        WVPASSEQ(len(shas), 11)
+        WVPASSEQ(len(set(shas[:10])), 1)
+        WVPASSEQ(blobs, [hashsplit.BLOB_MAX, 1])
+
+
+@wvtest
+def test_gear_split():
+    with no_lingering_errors():
+        # These must never change, or repositories using fastcdc will
+        # stop deduplicating against their existing data.
+        rand = random.Random(1)
+        data = bytes(bytearray(rand.getrandbits(8) for i in range(100000)))
+        splits = []
+        ofs = 0
+        while True:
+            n, bits = _helpers.gear_splitbuf(data[ofs:ofs + hashsplit.BLOB_MAX])
+            if not n:
+                break
+            splits.append((n, bits))
+            ofs += n
+        WVPASSEQ(splits, [(11499, 13), (8847, 13), (14043, 13), (11211, 14),
+                          (8551, 13), (8760, 13), (9122, 16), (6373, 19),
+                          (8784, 13), (12371, 13)])
+        # Nothing is split before the minimum chunk size.
+        WVPASSEQ(_helpers.gear_splitbuf(data[:2048]), (0, -1))
+        WVPASSEQ(_helpers.gear_splitbuf(b'\0' * hashsplit.BLOB_MAX), (0, -1))
+
+        WVEXCEPT(ValueError, hashsplit.set_split_method, b'rabin')
+        WVPASSEQ(hashsplit.split_method, b'legacy')
+        try:
+            hashsplit.set_split_method(b'fastcdc\n')
+            WVPASSEQ(hashsplit.split_method, b'fastcdc')
+            sizes = [len(b) for b, level in
+                     hashsplit.hashsplit_iter([BytesIO(data)], True, None)]
+            WVPASSEQ(sizes, [n for n, bits in splits] + [len(data) - ofs])
+        finally:
+            hashsplit.set_split_method(None)
+        WVPASSEQ(hashsplit.split_method, b'legacy')
+
+
+@wvtest
+def test_sparse_reads():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-thashsplit-') as tmpdir:
+            name = tmpdir + b'/sparse'
+            rs = hashsplit.BLOB_READ_SIZE
+            with open(name, 'wb') as f:
+                f.seek(3 * rs + 17)
+                f.write(b'data')
+                f.seek(7 * rs)
+                f.write(b'more' * rs)
+                f.truncate(14 * rs + 5)
+            with open(name, 'rb') as f:
+                expected = f.read()
+            with open(name, 'rb') as f:
+                content = b''.join(hashsplit.readfile_iter([f]))
+            WVPASSEQ(len(content), len(expected))
+            WVPASS(content == expected)
+
+
+@wvtest
+def test_stream_reads():
+    with no_lingering_errors():
+        rand = random.Random(3)
+        data = bytes(bytearray(rand.getrandbits(8) for i in range(300000)))
+        expected = [(len(b), level) for b, level in
+                    hashsplit.hashsplit_iter([BytesIO(data)], False, None)]
+
+        # A pipe produces short reads, which must not change the split.
+        rfd, wfd = os.pipe()
+        def feed():
+            with os.fdopen(wfd, 'wb', 0) as f:
+                for ofs in range(0, len(data), 1000):
+                    f.write(data[ofs:ofs + 1000])
+        writer = threading.Thread(target=feed)
+        writer.start()
+        with io.FileIO(rfd, 'r') as f:
+            split = [(len(b), level) for b, level in
+                     hashsplit.hashsplit_iter([f], False, None)]
+        writer.join()
+        WVPASSEQ(split, expected)
+
+        chunks = [data[ofs:ofs + 7000] for ofs in range(0, len(data), 7000)]
+        split = [(len(b), level) for b, level in
+                 hashsplit.hashsplit_iter([hashsplit.IterReader(chunks)],
+                                          False, None)]
+        WVPASSEQ(split, expected)
+
+        r = hashsplit.IterReader(chunks)
+        WVPASSEQ(r.read(3), data[:3])
+        WVPASSEQ(r.read(10000), data[3:10003])
+        b = bytearray(10)
+        WVPASSEQ(r.readinto(b), 10)
+        WVPASS(bytes(b) == data[10003:10013])
+        WVPASS(r.read() == data[10013:])
+        WVPASSEQ(r.read(1), b'')
+        WVPASSEQ(r.readinto(b), 0)
+
+
+def reference_chunk_trees(chunks, maketree):
+    # The original, pure Python stack-of-levels tree builder.
+    def squish(stacks, n):
+        i = 0
+        while i < n or len(stacks[i]) >= hashsplit.MAX_PER_TREE:
+            while len(stacks) <= i+1:
+                stacks.append([])
+            if len(stacks[i]) == 1:
+                stacks[i+1] += stacks[i]
+            elif stacks[i]:
+                (shalist, size) = hashsplit._make_shalist(stacks[i])
+                tree = maketree(shalist)
+                stacks[i+1].append((hashsplit.GIT_MODE_TREE, tree, size))
+            stacks[i] = []
+            i += 1
+    stacks = [[]]
+    for (sha, size, level) in chunks:
+        stacks[0].append((hashsplit.GIT_MODE_FILE, sha, size))
+        squish(stacks, level)
+    squish(stacks, len(stacks)-1)
+    return hashsplit._make_shalist(stacks[-1])[0]
+
+
+@wvtest
+def test_chunk_trees():
+    with no_lingering_errors():
+        rand = random.Random(5)
+        for count, max_level in ((0, 0), (1, 0), (1, 3), (2, 0), (300, 0),
+                                 (5000, 2), (20000, 4)):
+            chunks = [(git.calc_hash(b'blob', b'%d' % i),
+                       rand.randint(1, 1 << rand.choice((4, 16, 33))),
+                       rand.randint(0, max_level) if rand.random() < 0.1
+                       else 0)
+                      for i in range(count)]
+            ref_trees = []
+            def maketree(shalist):
+                content = git.tree_encode(shalist)
+                ref_trees.append(content)
+                return git.calc_hash(b'tree', content)
+            trees = []
+            def write_tree(content):
+                trees.append(content)
+                return git.calc_hash(b'tree', content)
+            stacks = [bytearray()]
+            for sha, size, level in chunks:
+                _helpers.chunk_tree_add(stacks, sha, size, level, write_tree,
+                                        hashsplit.MAX_PER_TREE)
+            shalist = _helpers.chunk_tree_finish(stacks, write_tree,
+                                                 hashsplit.MAX_PER_TREE)
+            WVPASSEQ(shalist, reference_chunk_trees(chunks, maketree))
+            WVPASS(trees == ref_trees)
+
+        WVEXCEPT(ValueError, _helpers.chunk_tree_add, [bytearray()], b'x', 1, 0,
+                 write_tree, hashsplit.MAX_PER_TREE)
+        WVEXCEPT(ValueError, _helpers.chunk_tree_finish, [bytearray(b'x')],
+                 write_tree, hashsplit.MAX_PER_TREE)
@@ -1,7 +1,7 @@
 
 from __future__ import absolute_import
 from time import tzset
-import helpers, math, os, os.path, re, subprocess
+import helpers, math, os, os.path, random, re, subprocess
 
 from wvtest import *
 
@@ -257,3 +257,40 @@ def test_valid_save_name():
         WVFAIL(valid(b'foo/bar.lock/baz'))
         WVFAIL(valid(b'.bar/baz'))
         WVFAIL(valid(b'foo/.bar/baz'))
+
+
+@wvtest
+def test_write_sparsely():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-thelpers-') as tmpdir:
+            name = tmpdir + b'/sparse'
+            rand = random.Random(42)
+            mismatches = 0
+            # Mixed runs of zeros and data, at odd lengths and offsets,
+            # so the word-wide scans hit every boundary case.
+            for i in range(200):
+                parts = []
+                for j in range(rand.randint(0, 8)):
+                    n = rand.choice((1, 7, 8, 31, 33, 511, 512, 513, 4099))
+                    if rand.randint(0, 1):
+                        parts.append(b'\0' * n)
+                    else:
+                        parts.append(bytes(bytearray(rand.randint(1, 255)
+                                                     for k in range(n))))
+                data = b''.join(parts)
+                fd = os.open(name, os.O_WRONLY | os.O_CREAT | os.O_TRUNC)
+                try:
+                    zeros = 0
+                    ofs = 0
+                    while ofs < len(data):
+                        n = rand.randint(1, 5000)
+                        zeros = _helpers.write_sparsely(fd, data[ofs:ofs + n],
+                                                        512, zeros)
+                        ofs += n
+                    os.ftruncate(fd, os.lseek(fd, zeros, os.SEEK_END))
+                finally:
+                    os.close(fd)
+                with open(name, 'rb') as f:
+                    if f.read() != data:
+                        mismatches += 1
+            WVPASSEQ(mismatches, 0)
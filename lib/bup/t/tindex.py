@@ -4,9 +4,10 @@ import os, time
 
 from wvtest import *
 
-from bup import index, metadata
+from bup import hlinkdb, index, metadata
 from bup.compat import fsencode
 from bup.helpers import mkdirp, resolve_parent
+from bup.hlinkdb import pickle
 from buptest import no_lingering_errors, test_tempdir
 import bup.xstat as xstat
 
@@ -50,6 +51,66 @@ def index_writer():
                 os.chdir(orig_cwd)
 
 
+@wvtest
+def index_metastore():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tindex-') as tmpdir:
+            meta_path = tmpdir + b'/index.meta'
+            def meta(i):
+                m = metadata.Metadata()
+                m.mode, m.uid, m.gid, m.rdev = 0o100644, i, 0, 0
+                m.user = m.group = b''
+                m.atime = m.mtime = m.ctime = 0
+                return m
+            # Enough records to grow the hash table a couple of times.
+            n = 2000
+            ms = index.MetaStoreWriter(meta_path)
+            ofs = [ms.store(meta(i)) for i in range(n)]
+            WVPASSEQ(ms.store(meta(0)), 0)
+            WVPASSEQ(ms.store(meta(n - 1)), ofs[-1])
+            ms.close()
+            meta_size = os.path.getsize(meta_path)
+
+            def check_reopen():
+                ms = index.MetaStoreWriter(meta_path)
+                WVPASSEQ([ms.store(meta(i)) for i in range(0, n, 7)],
+                         ofs[0::7])
+                ms.close()
+                WVPASSEQ(os.path.getsize(meta_path), meta_size)
+
+            check_reopen()
+
+            # A table that wasn't closed is rebuilt from the .meta file.
+            ms = index.MetaStoreWriter(meta_path)
+            ms.store(meta(0))
+            ms._hashes.map.close()
+            ms._hashes.map = ms._file = None
+            check_reopen()
+
+            # As is one whose .meta file has been replaced by one of
+            # the same size.
+            with open(meta_path, 'wb') as f:
+                for i in reversed(range(n)):
+                    f.write(meta(i).encode(include_path=False))
+            WVPASSEQ(os.path.getsize(meta_path), meta_size)
+            ms = index.MetaStoreWriter(meta_path)
+            WVPASSEQ(ms.store(meta(n - 1)), 0)
+            ms.close()
+            with open(meta_path, 'wb') as f:
+                for i in range(n):
+                    f.write(meta(i).encode(include_path=False))
+            check_reopen()
+
+            # Records appended by something else are picked up.
+            with open(meta_path, 'ab') as f:
+                f.write(meta(n).encode(include_path=False))
+            ms = index.MetaStoreWriter(meta_path)
+            WVPASSEQ(ms.store(meta(n)), meta_size)
+            ms.close()
+            WVPASSEQ(os.path.getsize(meta_path),
+                     meta_size + len(meta(n).encode(include_path=False)))
+
+
 def dump(m):
     for e in list(m):
         print('%s%s %s' % (e.is_valid() and ' ' or 'M',
@@ -182,3 +243,129 @@ def index_dirty():
                 w3.close()
             finally:
                 os.chdir(orig_cwd)
+
+
+@wvtest
+def index_hlinkdb():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tindex-') as tmpdir:
+            name = tmpdir + b'/index.hlink'
+            db = hlinkdb.HLinkDB(name)
+            WVEXCEPT(KeyError, db.node_paths, 1, 2)
+            db.add_path(b'/a', 1, 2)
+            db.add_path(b'/b', 1, 2)
+            db.add_path(b'/b', 1, 2)
+            db.add_path(b'/c', 1, 3)
+            db.prepare_save()
+            db.commit_save()
+            WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+
+            db = hlinkdb.HLinkDB(name)
+            WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+            WVPASSEQ(db.node_paths(1, 3), [b'/c'])
+            size = os.path.getsize(name)
+            db.del_path(b'/c', 1, 3)
+            db.del_path(b'/x', 1, 2)
+            db.add_path(b'/d', 1, 4)
+            db.prepare_save()
+            db.abort_save()
+            db = hlinkdb.HLinkDB(name)
+            WVPASSEQ(db.node_paths(1, 3), [b'/c'])
+            WVEXCEPT(KeyError, db.node_paths, 1, 4)
+
+            # Small changes are applied in place.
+            ino = os.stat(name).st_ino
+            db.del_path(b'/c', 1, 3)
+            db.add_path(b'/d', 1, 4)
+            db.prepare_save()
+            db.commit_save()
+            WVPASSEQ(os.stat(name).st_ino, ino)
+            WVPASSEQ(os.path.getsize(name), size + 2)
+            for d in (db, hlinkdb.HLinkDB(name)):
+                WVEXCEPT(KeyError, d.node_paths, 1, 3)
+                WVPASSEQ(d.node_paths(1, 4), [b'/d'])
+                WVPASSEQ(d.node_paths(1, 2), [b'/a', b'/b'])
+
+            # An open reader follows a commit, even one that grows the file.
+            reader = hlinkdb.HLinkDB(name)
+            WVPASSEQ(reader.node_paths(1, 4), [b'/d'])
+            db.add_path(b'/long' * 1000, 1, 4)
+            db.prepare_save()
+            db.commit_save()
+            WVPASSEQ(reader.node_paths(1, 4), [b'/d', b'/long' * 1000])
+
+            # A commit interrupted while the slots were being rewritten
+            # is completed from its journal.
+            db.del_path(b'/d', 1, 4)
+            db.del_path(b'/long' * 1000, 1, 4)
+            db.add_path(b'/e', 1, 5)
+            db.prepare_save()
+            slot_updates, begin, hdr, end = db._slot_updates
+            with open(name, 'r+b') as f:
+                f.write(begin)
+                i, slot = slot_updates[0]
+                f.seek(hlinkdb.HLINK_HDRLEN + i * hlinkdb.HLINK_SLOTLEN)
+                f.write(slot[:5])
+            db.abort_save()
+            for d in (reader, hlinkdb.HLinkDB(name)):
+                WVEXCEPT(KeyError, d.node_paths, 1, 4)
+                WVPASSEQ(d.node_paths(1, 5), [b'/e'])
+                WVPASSEQ(d.node_paths(1, 2), [b'/a', b'/b'])
+            db = hlinkdb.HLinkDB(name)
+            db.add_path(b'/f', 1, 6)
+            db.prepare_save()
+            db.commit_save()
+            for d in (reader, db, hlinkdb.HLinkDB(name)):
+                WVEXCEPT(KeyError, d.node_paths, 1, 4)
+                WVPASSEQ(d.node_paths(1, 5), [b'/e'])
+                WVPASSEQ(d.node_paths(1, 6), [b'/f'])
+                WVPASSEQ(d.node_paths(1, 2), [b'/a', b'/b'])
+            with open(name, 'rb') as f:
+                WVPASSEQ(hlinkdb._unpack_header(f.read(hlinkdb.HLINK_HDRLEN))[-1],
+                         0)
+
+            # A damaged header is reported rather than trusted.
+            with open(name, 'r+b') as f:
+                f.seek(20)
+                f.write(b'\xff')
+            WVEXCEPT(hlinkdb.Error, hlinkdb.HLinkDB, name)
+            with open(name, 'r+b') as f:
+                f.seek(20)
+                f.write(b'\0')
+            reader = None
+
+            # Enough nodes to force the table to grow.
+            db = hlinkdb.HLinkDB(name)
+            for i in range(2000):
+                db.add_path(b'/n%d' % i, 7, i)
+                db.add_path(b'/m%d' % i, 7, i)
+            db.prepare_save()
+            db.commit_save()
+            WVPASSNE(os.stat(name).st_ino, ino)
+            db = hlinkdb.HLinkDB(name)
+            WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+            WVPASS(all(db.node_paths(7, i) == [b'/n%d' % i, b'/m%d' % i]
+                       for i in range(2000)))
+            for i in range(2000):
+                db.del_path(b'/n%d' % i, 7, i)
+                db.del_path(b'/m%d' % i, 7, i)
+            db.del_path(b'/a', 1, 2)
+            db.del_path(b'/b', 1, 2)
+            db.del_path(b'/d', 1, 4)
+            db.del_path(b'/e', 1, 5)
+            db.del_path(b'/f', 1, 6)
+            db.prepare_save()
+            db.commit_save()
+            WVPASS(not os.path.exists(name))
+
+            # Pickled databases from older versions are converted.
+            with open(name, 'wb') as f:
+                pickle.dump({'1:2': [b'/a', b'/b']}, f, 2)
+            db = hlinkdb.HLinkDB(name)
+            WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+            db.add_path(b'/c', 1, 3)
+            db.prepare_save()
+            db.commit_save()
+            db = hlinkdb.HLinkDB(name)
+            WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+            WVPASSEQ(db.node_paths(1, 3), [b'/c'])
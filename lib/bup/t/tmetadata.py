@@ -1,10 +1,11 @@
 
 from __future__ import absolute_import, print_function
+from io import BytesIO
 import errno, glob, grp, pwd, stat, tempfile, subprocess
 
 from wvtest import *
 
-from bup import git, metadata
+from bup import git, metadata, vint
 from bup import vfs
 from bup.compat import range
 from bup.helpers import clear_errors, detect_fakeroot, is_superuser, resolve_parent
@@ -168,6 +169,100 @@ def test_metadata_method():
                     WVPASSEQ(m.mtime, 0)
 
 
+@wvtest
+def test_metadata_codec():
+    with no_lingering_errors():
+        def common(m, mode):
+            m.mode, m.uid, m.gid, m.rdev = mode, 1000, 100, 0
+            m.user, m.group = b'user', b'group'
+            m.atime, m.mtime, m.ctime = -1, 13 * 10**9 + 7, 42 * 10**9
+            return m
+        def py_encode(m, include_path=True):
+            port = BytesIO()
+            metadata.Metadata.copy(m)._write_records(port, include_path)
+            return port.getvalue()
+        def py_decode(data):
+            port, result = BytesIO(data), []
+            while True:
+                try:
+                    result.append(metadata.Metadata.read(port))
+                except EOFError:
+                    return result
+
+        full = common(metadata.Metadata(), 0o120777)
+        full.path = b'some/link'
+        full.symlink_target = b'target'
+        full.size = len(full.symlink_target)
+        full.hardlink_target = b'other/link'
+        full.posix1e_acl = [b'u::rwx', b'u::7']
+        full.linux_attr = 0x80000
+        full.linux_xattr = [(b'user.a', b'x'), (b'user.b', b'')]
+        big = common(metadata.Metadata(), 0o100644)
+        big.uid = 2**40
+        big.size = 2**62
+        dir_acl = common(metadata.Metadata(), 0o40755)
+        dir_acl.posix1e_acl = [b'a', b'1', b'd', b'2']
+        huge = common(metadata.Metadata(), 0o100644)
+        huge.size = 2**70 # too big for the native codec
+        ms = [full, metadata.Metadata(), big, dir_acl, huge]
+
+        for m in ms:
+            for include_path in (True, False):
+                WVPASSEQ(m.encode(include_path), py_encode(m, include_path))
+
+        def check_decode(data):
+            expected = py_decode(data)
+            actual = list(metadata.decode_all(data))
+            WVPASSEQ(actual, expected)
+            WVPASSEQ([m and m.linux_xattr for m in actual],
+                     [m and m.linux_xattr for m in expected])
+            return actual
+
+        data = b''.join(m.encode() for m in ms[:-1])
+        actual = check_decode(data)
+        WVPASSEQ(actual[0], full)
+        WVPASSEQ(actual[1], None)
+        WVPASSEQ(check_decode(data + huge.encode())[-1], huge)
+
+        # Older common records, and an unknown record.
+        v2 = vint.pack('vvsvsvvVvVvV', 0o100644, 1, b'u', 2, b'g', 0,
+                       1, 2, 3, 4, 5, 6)
+        v1 = vint.pack('VVsVsVvVvVvV', 0o100644, 1, b'u', 2, b'g', 0,
+                       1, 2, 3, 4, 5, 6)
+        data = vint.pack('VsVsV', metadata._rec_tag_common_v2, v2,
+                         99, b'whatever', metadata._rec_tag_end)
+        data += vint.pack('VsV', metadata._rec_tag_common_v1, v1,
+                          metadata._rec_tag_end)
+        actual = check_decode(data)
+        WVPASSEQ(actual[0].mtime, 3 * 10**9 + 4)
+        WVPASSEQ(actual[1].uid, 1)
+
+        WVEXCEPT(Exception, list, metadata.decode_all(ms[0].encode()[:-1]))
+        WVPASSEQ(list(metadata.decode_all(b'')), [])
+
+
+@wvtest
+def test_harvester():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tmetadata-') as tmpdir:
+            paths = [tmpdir + b'/%d' % i for i in range(50)]
+            for i, path in enumerate(paths):
+                if i % 3:
+                    open(path, 'w').close()
+                    os.chmod(path, 0o600 + (i % 8))
+            for threads in (0, 1, 4):
+                with metadata.Harvester(threads) as harvester:
+                    results = [harvester.submit(path, archive_path=path)
+                               for path in paths]
+                    for i, (path, get_meta) in enumerate(zip(paths, results)):
+                        if i % 3:
+                            WVPASSEQ(get_meta(),
+                                     metadata.from_path(path,
+                                                        archive_path=path))
+                        else:
+                            WVEXCEPT(OSError, get_meta)
+
+
 def _first_err():
     if helpers.saved_errors:
         return str(helpers.saved_errors[0])
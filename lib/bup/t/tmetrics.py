@@ -0,0 +1,61 @@
+
+from __future__ import absolute_import
+from io import BytesIO
+import json
+
+from wvtest import *
+
+from bup import metrics
+from buptest import no_lingering_errors
+
+
+@wvtest
+def test_counter():
+    with no_lingering_errors():
+        c = metrics.counter('test.counter')
+        WVPASS(c is metrics.counter('test.counter'))
+        start = c.value
+        c.add()
+        c.add(41)
+        WVPASSEQ(c.value - start, 42)
+        WVPASSEQ(metrics.snapshot()['test.counter'], c.value)
+        WVEXCEPT(AssertionError, metrics.histogram, 'test.counter')
+
+
+@wvtest
+def test_histogram():
+    with no_lingering_errors():
+        h = metrics.histogram('test.histogram', unit='B')
+        WVPASS(h is metrics.histogram('test.histogram'))
+        WVPASSEQ(h.percentile(50), None)
+        for x in [0] + list(range(1, 101)):
+            h.record(x)
+        WVPASSEQ(h.count, 101)
+        WVPASSEQ(h.total, 5050)
+        WVPASSEQ((h.min, h.max), (0, 100))
+        WVPASSEQ(h.percentile(0.5), 0)
+        # Percentiles are only accurate to within a power of two.
+        p50 = h.percentile(50)
+        WVPASS(50 <= p50 <= 100)
+        WVPASSEQ(h.percentile(100), 100)
+        snap = metrics.snapshot()['test.histogram']
+        WVPASSEQ(snap['unit'], 'B')
+        WVPASSEQ(snap['p50'], p50)
+        with metrics.timed('test.timed'):
+            pass
+        WVPASSEQ(metrics.histogram('test.timed').count, 1)
+
+
+@wvtest
+def test_dump():
+    with no_lingering_errors():
+        metrics.reset()
+        WVPASSEQ(metrics.snapshot(), {})
+        metrics.counter('test.counter').add(3)
+        out = BytesIO()
+        metrics.dump(out)
+        WVPASSEQ(out.getvalue().count(b'\n'), 1)
+        WVPASSEQ(json.loads(out.getvalue().decode('ascii')),
+                 {'test.counter': 3})
+        WVPASSEQ(metrics.enable_stats('xml'), False)
+        metrics.reset()
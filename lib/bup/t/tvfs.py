@@ -8,6 +8,7 @@ from os import symlink
 from random import Random, randint
 from stat import S_IFDIR, S_IFLNK, S_IFREG, S_ISDIR, S_ISREG
 from sys import stderr
+from threading import Lock
 from time import localtime, strftime, tzset
 
 from wvtest import *
@@ -311,6 +312,181 @@ def test_read_and_seek():
                                           b'%s/%d' % (data_path, size),
                                           read_sizes)
 
+@wvtest
+def test_zero_chunks():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tvfs-zero-') as tmpdir:
+            bup_dir = tmpdir + b'/bup'
+            environ[b'GIT_DIR'] = bup_dir
+            environ[b'BUP_DIR'] = bup_dir
+            git.repodir = bup_dir
+            repo = LocalRepo()
+            data_path = tmpdir + b'/src'
+            os.mkdir(data_path)
+            with open(data_path + b'/f', 'wb') as f:
+                write_random(f.fileno(), 100000, 1, 0)
+                f.write(b'\0' * 300000)
+                write_random(f.fileno(), 100000, 2, 0)
+            with open(data_path + b'/f', 'rb') as f:
+                content = f.read()
+            ex((bup_path, b'init'))
+            ex((bup_path, b'index', data_path))
+            ex((bup_path, b'save', b'-n', b'test', b'--strip', data_path))
+            _, item = vfs.resolve(repo, b'/test/latest/f')[-1]
+            with vfs.fopen(repo, item) as f:
+                chunks = list(f.chunks())
+                wvpasseq(len(content), f.tell())
+            wvpass(b''.join(chunks) == content)
+            wvpass(len([c for c in chunks if c is vfs.zero_chunk]) > 5)
+            for ofs in (150000, 150001):
+                with vfs.fopen(repo, item) as f:
+                    f.seek(ofs)
+                    wvpass(b''.join(f.chunks()) == content[ofs:])
+            validate_vfs_streaming_read(repo, item, data_path + b'/f',
+                                        (4096, 65536))
+
+@wvtest
+def test_read_ahead():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tvfs-read-ahead-') as tmpdir:
+            bup_dir = tmpdir + b'/bup'
+            environ[b'GIT_DIR'] = bup_dir
+            environ[b'BUP_DIR'] = bup_dir
+            git.repodir = bup_dir
+            data_path = tmpdir + b'/src'
+            os.mkdir(data_path)
+            seed = randint(-(1 << 31), (1 << 31) - 1)
+            rand = Random()
+            rand.seed(seed)
+            print('test_read_ahead seed:', seed, file=sys.stderr)
+            size = 1024 * 1024 + 17
+            write_sized_random_content(data_path, size, seed)
+            with open(b'%s/%d' % (data_path, size), 'rb') as f:
+                data = f.read()
+            ex((bup_path, b'init'))
+            ex((bup_path, b'index', b'-v', data_path))
+            ex((bup_path, b'save', b'-d', b'100000', b'-tvvn', b'test',
+                b'--strip', data_path))
+            repo = LocalRepo()
+            _, item = vfs.resolve(repo, b'/test/latest/%d' % size)[-1]
+            lock = Lock()
+
+            def reader(**kwargs):
+                return vfs.ReadAhead(vfs.fopen(repo, item), lock, **kwargs)
+
+            # Sequential reads that start, and then fill, the window
+            for read_size in (1000, 4095, 65536, 100000):
+                with reader(block_size=8192, window=64 * 1024) as f:
+                    ofs = 0
+                    while True:
+                        buf = f.read(read_size, ofs)
+                        wvpass(buf == data[ofs:ofs + read_size])
+                        if not buf:
+                            break
+                        ofs += len(buf)
+                    wvpasseq(size, ofs)
+                    wvpasseq(b'', f.read(read_size, size + 10))
+
+            # Mostly sequential reads with occasional jumps
+            with reader(block_size=4096, window=32 * 1024) as f:
+                ofs = 0
+                for _ in range(200):
+                    if rand.randint(0, 9) == 0:
+                        ofs = rand.randint(0, size)
+                    read_size = rand.randint(1, 20000)
+                    buf = f.read(read_size, ofs)
+                    wvpass(buf == data[ofs:ofs + read_size])
+                    ofs += len(buf)
+
+            # Closing while the thread is (probably) still fetching
+            f = reader(block_size=4096, window=size)
+            wvpass(f.read(10, 0) == data[:10])
+            wvpass(f.read(10, 10) == data[10:20])
+            wvpass(f.read(10, 20) == data[20:30])
+            f.close()
+            wvpasseq(None, f._thread)
+
+@wvtest
+def test_dentry_cache():
+    with no_lingering_errors():
+        with test_tempdir(b'bup-tvfs-dentry-') as tmpdir:
+            bup_dir = tmpdir + b'/bup'
+            environ[b'GIT_DIR'] = bup_dir
+            environ[b'BUP_DIR'] = bup_dir
+            git.repodir = bup_dir
+            data_path = tmpdir + b'/src'
+            os.mkdir(data_path)
+            os.mkdir(data_path + b'/dir')
+            with open(data_path + b'/dir/file', 'wb') as f:
+                f.write(b'canary\n')
+            symlink(b'dir', data_path + b'/symlink')
+            ex((bup_path, b'init'))
+            ex((bup_path, b'index', b'-v', data_path))
+            ex((bup_path, b'save', b'-d', b'100000', b'-tvvn', b'test',
+                b'--strip', data_path))
+            repo = LocalRepo()
+
+            def summary(res):
+                name, item = res[-1]
+                return (tuple((name, type(item), item and vfs.item_mode(item))
+                              for name, item in res),
+                        item and item.meta.size)
+
+            paths = (b'/', b'/test', b'/test/latest', b'/test/latest/dir',
+                     b'/test/latest/dir/file', b'/test/latest/symlink',
+                     b'/test/latest/symlink/file', b'/test/latest/nope',
+                     b'/test/latest/dir/nope', b'/test/latest/dir/file/x',
+                     b'/nope', b'/.tag')
+            for want_meta in (True, False):
+                cache = vfs.DentryCache(repo, want_meta=want_meta,
+                                        max_entries=3, max_listings=1)
+                for _ in range(2):
+                    for path in paths:
+                        try:
+                            res = vfs.resolve(repo, path, want_meta=want_meta,
+                                              follow=False)
+                        except vfs.IOError:
+                            wvexcept(vfs.IOError, cache.resolve, path)
+                            continue
+                        name, item = res[-1]
+                        if item and want_meta:
+                            item = vfs.ensure_item_has_metadata(
+                                repo, item, include_size=True)
+                        elif item:
+                            item = vfs.augment_item_meta(repo, item,
+                                                         include_size=True)
+                        res = res[:-1] + ((name, item),)
+                        wvpasseq(summary(res), summary(cache.resolve(path)))
+
+            cache = vfs.DentryCache(repo)
+            wvpasseq(None, cache.names(b'/test/latest/nope'))
+            save = vfs.resolve(repo, b'/test/latest')[-1][0]
+            wvpasseq(None, cache.names(b'/test/latest'))
+            wvpasseq(sorted([b'.', b'latest', save]),
+                     sorted(cache.names(b'/test')))
+            wvpasseq([b'.', b'dir', b'symlink'],
+                     sorted(cache.names(b'/test/' + save)))
+            wvpasseq([b'.', b'file'], sorted(cache.names(b'/test/latest/dir')))
+            wvpass(b'test' in cache.names(b'/'))
+
+            # Once a tree has been listed, lookups in it (including
+            # misses) shouldn't touch the repository.
+            _, dir_item = cache.resolve(b'/test/latest/dir')[-1]
+            orig_contents = vfs.contents
+            listed = []
+            def contents(repo, item, *args, **kwargs):
+                listed.append(item)
+                return orig_contents(repo, item, *args, **kwargs)
+            vfs.contents = contents
+            try:
+                for _ in range(3):
+                    wvpass(cache.resolve(b'/test/latest/dir/file')[-1][1])
+                    wvpasseq(None, cache.resolve(b'/test/latest/dir/x')[-1][1])
+                    cache.names(b'/test/latest/dir')
+            finally:
+                vfs.contents = orig_contents
+            wvpasseq([], [x for x in listed if x.oid == dir_item.oid])
+
 @wvtest
 def test_contents_with_mismatched_bupm_git_ordering():
     with no_lingering_errors():
@@ -351,6 +527,31 @@ def test_contents_with_mismatched_bupm_git_ordering():
             name, item = next(((n, i) for n, i in contents if n == b'foo.'))
             wvpass(S_ISREG(item.meta.mode))
 
+@wvtest
+def test_truncated_bupm():
+    with no_lingering_errors(), test_tempdir(b'bup-tvfs-') as tmpdir:
+        with open(tmpdir + b'/f', 'wb'):
+            pass
+        dir_meta = metadata.from_path(tmpdir, normalized=True)
+        file_meta = metadata.from_path(tmpdir + b'/f', normalized=True)
+        blob = git.calc_hash(b'blob', b'')
+        tree_data = git.tree_encode([(0o100644, b'.bupm', blob),
+                                     (0o100644, b'a', blob),
+                                     (0o100644, b'b', blob)])
+        tree_oid = git.calc_hash(b'tree', tree_data)
+        entries = [dir_meta, file_meta, file_meta]
+        complete = b''.join(m.encode() for m in entries)
+        truncated = b''.join(m.encode() for m in entries[:2])
+        wvpasseq([b'.', b'a', b'b'],
+                 [name for name, item
+                  in vfs.tree_items(tree_oid, tree_data,
+                                    bupm=metadata.decode_all(complete))])
+        for names in (frozenset(), frozenset([b'.', b'b'])):
+            items = vfs.tree_items(tree_oid, tree_data, names=names,
+                                   bupm=metadata.decode_all(truncated))
+            wvexcept(EOFError, list, items)
+
+
 @wvtest
 def test_duplicate_save_dates():
     with no_lingering_errors():
@@ -93,3 +93,25 @@ def test_pack_and_unpack():
         WVEXCEPT(Exception, vint.pack, 'x', 1)
         WVEXCEPT(Exception, vint.unpack, 's', '')
         WVEXCEPT(Exception, vint.unpack, 'x', '')
+
+
+@wvtest
+def test_unpack_from_and_many():
+    with no_lingering_errors():
+        recs = [(b'foo', 1, -1), (b'', 0, 0), (b'x' * 300, 2**63, -2**63),
+                (b'big', 2**70, -2**70)]
+        data = b'pre' + b''.join(vint.pack('sVv', *r) for r in recs)
+        WVPASSEQ(vint.unpack_from('sVv', data, 3)[0], list(recs[0]))
+        for buf in (data, memoryview(data)):
+            WVPASSEQ(vint.unpack_many('sVv', buf, ofs=3), (recs, len(data)))
+            got, ofs = vint.unpack_many('sVv', buf, 2, 3)
+            WVPASSEQ(got, recs[:2])
+            got, ofs = vint.unpack_many('sVv', buf, 1, ofs)
+            WVPASSEQ(got, recs[2:3])
+            WVPASSEQ(vint.unpack_from('sVv', buf, ofs),
+                     (list(recs[3]), len(data)))
+            WVPASSEQ(vint.unpack_many('sVv', buf, 0, 3), ([], 3))
+        WVEXCEPT(EOFError, vint.unpack_many, 'sVv', data[:-1], -1, 3)
+        WVEXCEPT(EOFError, vint.unpack, 'V', b'\x80')
+        WVEXCEPT(EOFError, vint.unpack, 's', b'\x05abc')
+        WVEXCEPT(Exception, vint.pack, 'V', -1)
@@ -48,17 +48,18 @@ item.coid.
 
 from __future__ import absolute_import, print_function
 from binascii import hexlify, unhexlify
-from collections import namedtuple
+from collections import OrderedDict, deque, namedtuple
 from errno import EINVAL, ELOOP, ENOENT, ENOTDIR
-from itertools import chain, dropwhile, groupby, tee
+from itertools import chain, dropwhile, groupby, islice, tee
 from random import randrange
 from stat import S_IFDIR, S_IFLNK, S_IFREG, S_ISDIR, S_ISLNK, S_ISREG
 from time import localtime, strftime
-import re, sys
+import re, sys, threading
 
-from bup import git, metadata, vint
+from bup import git, hashsplit, metadata, vint
 from bup.compat import hexstr, range
-from bup.git import BUP_CHUNKED, cp, get_commit_items, parse_commit, tree_decode
+from bup.git import (BUP_CHUNKED, MissingObject, cp, get_commit_items,
+                     parse_commit, tree_decode)
 from bup.helpers import debug2, last
 from bup.io import path_msg
 from bup.metadata import Metadata
@@ -140,25 +141,62 @@ def _skip_chunks_before_offset(tree, offset):
         prev_ent = ent
     return [prev_ent]
 
+# _tree_chunks() fetches chunks in batches that start with one chunk
+# and double (up to this limit) as long as the reader keeps going, so
+# that sequential reads make fewer round trips to the repository,
+# while seeks followed by small reads don't fetch much extra.
+_max_chunk_batch = 32
+
+def _cat_batch_data(repo, oids):
+    """Return a list of (type, data) for each of the oids."""
+    result = []
+    for oidx, obj_t, size, it in repo.cat_batch(hexlify(oid) for oid in oids):
+        if not oidx:
+            raise MissingObject(oids[len(result)])
+        result.append((obj_t, b''.join(it)))
+    return result
+
+# Every whole chunk of zeros is stored as the same BLOB_MAX blob of
+# zeros (cf. hashsplit), so _tree_chunks() produces zero_chunk for it
+# without fetching it, and readers like sparse restore can recognize
+# it by identity instead of scanning it.
+zero_chunk = b'\0' * hashsplit.BLOB_MAX
+_zero_chunk_oid = None
+
 def _tree_chunks(repo, tree, startofs):
     "Tree should be a sequence of (name, mode, hash) as per tree_decode()."
+    global _zero_chunk_oid
     assert(startofs >= 0)
+    if not _zero_chunk_oid:
+        _zero_chunk_oid = git.calc_hash(b'blob', zero_chunk)
     # name is the chunk's hex offset in the original file
-    for mode, name, oid in _skip_chunks_before_offset(tree, startofs):
-        ofs = int(name, 16)
-        skipmore = startofs - ofs
-        if skipmore < 0:
-            skipmore = 0
-        it = repo.cat(hexlify(oid))
-        _, obj_t, size = next(it)
-        data = b''.join(it)
-        if S_ISDIR(mode):
-            assert obj_t == b'tree'
-            for b in _tree_chunks(repo, tree_decode(data), skipmore):
-                yield b
-        else:
-            assert obj_t == b'blob'
-            yield data[skipmore:]
+    ents = iter(_skip_chunks_before_offset(tree, startofs))
+    batch_len = 1
+    while True:
+        batch = tuple(islice(ents, batch_len))
+        if not batch:
+            break
+        batch_len = min(batch_len * 2, _max_chunk_batch)
+        # Read the whole batch before yielding anything so that the
+        # repository is free for other requests between reads.
+        objs = iter(_cat_batch_data(repo, [oid for mode, name, oid in batch
+                                           if oid != _zero_chunk_oid]))
+        for mode, name, oid in batch:
+            ofs = int(name, 16)
+            skipmore = startofs - ofs
+            if skipmore < 0:
+                skipmore = 0
+            if oid == _zero_chunk_oid:
+                yield zero_chunk[skipmore:] if skipmore else zero_chunk
+                continue
+            obj_t, data = next(objs)
+            if S_ISDIR(mode):
+                assert obj_t == b'tree'
+                for b in _tree_chunks(repo, tree_decode(data), skipmore):
+                    yield b
+            else:
+                assert obj_t == b'blob'
+                yield data[skipmore:]
 
 class _ChunkReader:
     def __init__(self, repo, oid, startofs):
@@ -175,23 +213,37 @@ class _ChunkReader:
         self.ofs = startofs
 
     def next(self, size):
-        out = b''
-        while len(out) < size:
+        parts = []
+        n = 0
+        while n < size:
             if self.it and not self.blob:
                 try:
                     self.blob = next(self.it)
                 except StopIteration:
                     self.it = None
             if self.blob:
-                want = size - len(out)
-                out += self.blob[:want]
+                want = size - n
+                parts.append(self.blob[:want])
+                n += len(parts[-1])
                 self.blob = self.blob[want:]
             if not self.it:
                 break
+        out = b''.join(parts)
         debug2('next(%d) returned %d\n' % (size, len(out)))
         self.ofs += len(out)
         return out
 
+    def chunks(self):
+        """Yield the rest of the data in the chunks it was stored in."""
+        if self.blob:
+            b, self.blob = self.blob, None
+            self.ofs += len(b)
+            yield b
+        for b in self.it or ():
+            self.ofs += len(b)
+            yield b
+        self.it = None
+
 class _FileReader(object):
     def __init__(self, repo, oid, known_size=None):
         assert len(oid) == 20
@@ -230,6 +282,17 @@ class _FileReader(object):
         self.ofs += len(buf)
         return buf
 
+    def chunks(self):
+        """Yield the rest of the file's data, a chunk at a time, with
+        each whole chunk of zeros produced as zero_chunk."""
+        if self.ofs >= self._compute_size():
+            return
+        if not self.reader or self.reader.ofs != self.ofs:
+            self.reader = _ChunkReader(self._repo, self.oid, self.ofs)
+        for b in self.reader.chunks():
+            self.ofs += len(b)
+            yield b
+
     def close(self):
         pass
 
@@ -239,6 +302,153 @@ class _FileReader(object):
         self.close()
         return False
 
+class ReadAhead(object):
+    """Serve pread-style reads of f (as returned by fopen()), and once
+    the reads look sequential, fetch up to window bytes past the last
+    one in a background thread, block_size bytes at a time.  All
+    access to the repository happens with repo_lock held, so anything
+    else sharing the repository from other threads must hold it too.
+    Call close() to stop the thread."""
+
+    def __init__(self, f, repo_lock, block_size=128 * 1024,
+                 window=2 * 1024 * 1024, min_sequential=2):
+        self._f = f
+        self._repo_lock = repo_lock
+        self._block_size = block_size
+        self._window = window
+        self._min_sequential = min_sequential
+        self._lock = threading.Lock() # Serializes read() and close()
+        self._ofs = 0 # Offset of the data at the front of _blocks
+        self._sequential = 0
+        self._thread = None
+        # Everything below is shared with the thread, and guarded by
+        # _cond.  The thread's reads of f always continue from the end
+        # of _blocks.
+        self._cond = threading.Condition()
+        self._blocks = deque()
+        self._buffered = 0
+        self._want = 0 # Size of the read waiting for data, if any
+        self._done = False # The thread has stopped (EOF or error)
+        self._error = None
+        self._stop = False
+
+    def _fetch(self):
+        try:
+            while True:
+                with self._cond:
+                    while not self._stop \
+                          and self._buffered >= max(self._window, self._want):
+                        self._cond.wait()
+                    if self._stop:
+                        return
+                with self._repo_lock:
+                    data = self._f.read(self._block_size)
+                with self._cond:
+                    if self._stop:
+                        return
+                    if not data:
+                        return
+                    self._blocks.append(data)
+                    self._buffered += len(data)
+                    self._cond.notify_all()
+        except Exception as ex:
+            with self._cond:
+                self._error = ex
+        finally:
+            with self._cond:
+                self._done = True
+                self._cond.notify_all()
+
+    def _stop_fetching(self):
+        """Stop the thread (if any), discard whatever it fetched, and
+        leave f positioned at _ofs."""
+        if not self._thread:
+            return
+        with self._cond:
+            self._stop = True
+            self._cond.notify_all()
+        self._thread.join()
+        self._thread = None
+        self._blocks.clear()
+        self._buffered = 0
+        self._done = self._stop = False
+        self._error = None
+        with self._repo_lock:
+            self._f.seek(self._ofs)
+
+    def _take(self, size):
+        with self._cond:
+            self._want = size
+            self._cond.notify_all()
+            while self._buffered < size and not self._done:
+                self._cond.wait()
+            self._want = 0
+            if self._error and not self._buffered:
+                ex = self._error
+                self._error = None
+                raise ex
+            parts = []
+            n = 0
+            while self._blocks and n < size:
+                b = self._blocks.popleft()
+                if n + len(b) > size:
+                    self._blocks.appendleft(b[size - n:])
+                    b = b[:size - n]
+                parts.append(b)
+                n += len(b)
+            self._buffered -= n
+            self._cond.notify_all()
+        return b''.join(parts)
+
+    def read(self, size, offset):
+        with self._lock:
+            return self._read(size, offset)
+
+    def _read(self, size, offset):
+        if offset == self._ofs:
+            self._sequential += 1
+        else:
+            self._stop_fetching()
+            self._sequential = 0
+            self._ofs = None
+            with self._repo_lock:
+                try:
+                    self._f.seek(offset)
+                except IOError as ex:
+                    if ex.errno != EINVAL:
+                        raise
+                    return b'' # Past EOF; _ofs None forces the next seek
+            self._ofs = offset
+        if not self._thread and self._sequential >= self._min_sequential:
+            self._thread = threading.Thread(target=self._fetch)
+            self._thread.daemon = True
+            self._thread.start()
+        if self._thread:
+            try:
+                data = self._take(size)
+            except:
+                # Start over from _ofs, without the thread.
+                self._stop_fetching()
+                self._sequential = 0
+                raise
+        else:
+            with self._repo_lock:
+                data = self._f.read(size)
+        self._ofs += len(data)
+        return data
+
+    def close(self):
+        with self._lock:
+            self._stop_fetching()
+            self._f.close()
+
+    def __enter__(self):
+        return self
+    def __exit__(self, type, value, traceback):
+        self.close()
+        return False
+
+
 _multiple_slashes_rx = re.compile(br'//+')
 
 def _decompose_path(path):
@@ -277,7 +487,7 @@ Commit = namedtuple('Commit', ('meta', 'oid', 'coid'))
 item_types = frozenset((Item, Chunky, Root, Tags, RevList, Commit))
 real_tree_types = frozenset((Item, Commit))
 
-def write_item(port, item):
+def encode_item(item):
     kind = type(item)
     name = bytes(kind.__name__.encode('ascii'))
     meta = item.meta
@@ -285,33 +495,31 @@ def write_item(port, item):
     if kind in (Item, Chunky, RevList):
         assert len(item.oid) == 20
         if has_meta:
-            vint.send(port, 'sVs', name, has_meta, item.oid)
-            Metadata.write(meta, port, include_path=False)
-        else:
-            vint.send(port, 'sVsV', name, has_meta, item.oid, item.meta)
-    elif kind in (Root, Tags):
+            return vint.pack('sVs', name, has_meta, item.oid) \
+                + meta.encode(include_path=False)
+        return vint.pack('sVsV', name, has_meta, item.oid, item.meta)
+    if kind in (Root, Tags):
         if has_meta:
-            vint.send(port, 'sV', name, has_meta)
-            Metadata.write(meta, port, include_path=False)
-        else:
-            vint.send(port, 'sVV', name, has_meta, item.meta)
-    elif kind == Commit:
+            return vint.pack('sV', name, has_meta) \
+                + meta.encode(include_path=False)
+        return vint.pack('sVV', name, has_meta, item.meta)
+    if kind == Commit:
         assert len(item.oid) == 20
         assert len(item.coid) == 20
         if has_meta:
-            vint.send(port, 'sVss', name, has_meta, item.oid, item.coid)
-            Metadata.write(meta, port, include_path=False)
-        else:
-            vint.send(port, 'sVssV', name, has_meta, item.oid, item.coid,
-                      item.meta)
-    elif kind == FakeLink:
+            return vint.pack('sVss', name, has_meta, item.oid, item.coid) \
+                + meta.encode(include_path=False)
+        return vint.pack('sVssV', name, has_meta, item.oid, item.coid,
+                         item.meta)
+    if kind == FakeLink:
         if has_meta:
-            vint.send(port, 'sVs', name, has_meta, item.target)
-            Metadata.write(meta, port, include_path=False)
-        else:
-            vint.send(port, 'sVsV', name, has_meta, item.target, item.meta)
-    else:
-        assert False
+            return vint.pack('sVs', name, has_meta, item.target) \
+                + meta.encode(include_path=False)
+        return vint.pack('sVsV', name, has_meta, item.target, item.meta)
+    assert False
+
+def write_item(port, item):
+    port.write(encode_item(item))
 
 def read_item(port):
     def read_m(port, has_meta):
@@ -343,14 +551,16 @@ def read_item(port):
     assert False
 
 def write_resolution(port, resolution):
-    write_vuint(port, len(resolution))
+    # Encode the whole resolution first, so it's sent in one write.
+    out = [vint.pack('V', len(resolution))]
     for name, item in resolution:
-        write_bvec(port, name)
+        out.append(vint.pack('s', name))
         if item:
-            port.write(b'\x01')
-            write_item(port, item)
+            out.append(b'\x01')
+            out.append(encode_item(item))
         else:
-            port.write(b'\x00')
+            out.append(b'\x00')
+    port.write(b''.join(out))
 
 def read_resolution(port):
     n = read_vuint(port)
@@ -460,10 +670,9 @@ def item_mode(item):
         return m.mode
     return m
 
-def _read_dir_meta(bupm):
+def _dir_meta(m):
     # This is because save writes unmodified Metadata() entries for
     # fake parents -- test-save-strip-graft.sh demonstrates.
-    m = Metadata.read(bupm)
     if not m:
         return default_dir_mode
     assert m.mode is not None
@@ -503,7 +712,7 @@ def _find_treeish_oid_metadata(repo, oid):
     tree_data, bupm_oid = tree_data_and_bupm(repo, oid)
     if bupm_oid:
         with _FileReader(repo, bupm_oid) as meta_stream:
-            return _read_dir_meta(meta_stream)
+            return _dir_meta(Metadata.read(meta_stream))
     return None
 
 def _readlink(repo, oid):
@@ -633,11 +842,20 @@ def ordered_tree_entries(tree_data, bupm=None):
     for ent in tree_ents:
         yield ent
     
+def _next_bupm_meta(bupm):
+    # A bare next() would just end the tree_items() generator (in
+    # python 2) if the .bupm is short, silently truncating the listing.
+    try:
+        return next(bupm)
+    except StopIteration:
+        raise EOFError('.bupm has fewer entries than its tree')
+
 def tree_items(oid, tree_data, names=frozenset(), bupm=None):
+    # bupm, if not None, is an iterator over the tree's .bupm entries.
 
     def tree_item(ent_oid, kind, gitmode):
         if kind == BUP_CHUNKED:
-            meta = Metadata.read(bupm) if bupm else default_file_mode
+            meta = _next_bupm_meta(bupm) if bupm else default_file_mode
             return Chunky(oid=ent_oid, meta=meta)
 
         if S_ISDIR(gitmode):
@@ -645,12 +863,13 @@ def tree_items(oid, tree_data, names=frozenset(), bupm=None):
             return Item(meta=default_dir_mode, oid=ent_oid)
 
         return Item(oid=ent_oid,
-                    meta=(Metadata.read(bupm) if bupm \
+                    meta=(_next_bupm_meta(bupm) if bupm \
                           else _default_mode_for_gitmode(gitmode)))
 
     assert len(oid) == 20
     if not names:
-        dot_meta = _read_dir_meta(bupm) if bupm else default_dir_mode
+        dot_meta = _dir_meta(_next_bupm_meta(bupm)) if bupm \
+                   else default_dir_mode
         yield b'.', Item(oid=oid, meta=dot_meta)
         tree_entries = ordered_tree_entries(tree_data, bupm)
         for name, mangled_name, kind, gitmode, ent_oid in tree_entries:
@@ -670,7 +889,8 @@ def tree_items(oid, tree_data, names=frozenset(), bupm=None):
     last_name = max(names) if bupm else max(names) + b'/'
 
     if b'.' in names:
-        dot_meta = _read_dir_meta(bupm) if bupm else default_dir_mode
+        dot_meta = _dir_meta(_next_bupm_meta(bupm)) if bupm \
+                   else default_dir_mode
         yield b'.', Item(oid=oid, meta=dot_meta)
         if remaining == 1:
             return
@@ -685,7 +905,7 @@ def tree_items(oid, tree_data, names=frozenset(), bupm=None):
             if name > last_name:
                 break  # given bupm sort order, we're finished
             if (kind == BUP_CHUNKED or not S_ISDIR(gitmode)) and bupm:
-                Metadata.read(bupm)
+                _next_bupm_meta(bupm)
             continue
         yield name, tree_item(ent_oid, kind, gitmode)
         if remaining == 1:
@@ -700,7 +920,8 @@ def tree_items_with_meta(repo, oid, tree_data, names):
     bupm = None
     for _, mangled_name, sub_oid in tree_decode(tree_data):
         if mangled_name == b'.bupm':
-            bupm = _FileReader(repo, sub_oid)
+            with _FileReader(repo, sub_oid) as meta_stream:
+                bupm = metadata.decode_all(meta_stream.read())
             break
         if mangled_name > b'.bupm':
             break
@@ -919,7 +1140,7 @@ def _resolve_path(repo, path, parent=None, want_meta=True, follow=True):
         raise IOError(ENOTDIR,
                       "path %s%s resolves to non-directory %r"
                       % (path,
-                         ' (relative to %r)' % parent if parent else '',
+                         ' (relative to %r)' % (parent,) if parent else '',
                          past),
                       terminus=past)
     global _root
@@ -983,7 +1204,7 @@ def _resolve_path(repo, path, parent=None, want_meta=True, follow=True):
                         raise IOError(ENOTDIR,
                                       'path %r%s ends internally in non-directory here: %r'
                                       % (path,
-                                         ' (relative to %r)' % parent if parent else '',
+                                         ' (relative to %r)' % (parent,) if parent else '',
                                          past),
                                       terminus=past)
                     if must_be_dir:
@@ -1002,7 +1223,7 @@ def _resolve_path(repo, path, parent=None, want_meta=True, follow=True):
                 if hops > 100:
                     raise IOError(ELOOP,
                                   'too many symlinks encountered while resolving %r%s'
-                                  % (path, ' relative to %r' % parent if parent else ''),
+                                  % (path, ' relative to %r' % (parent,) if parent else ''),
                                   terminus=tuple(past + [(segment, item)]))
                 target = readlink(repo, item)
                 is_absolute, _, target_future = _decompose_path(target)
@@ -1148,3 +1369,153 @@ def ensure_item_has_metadata(repo, item, include_size=False):
     return augment_item_meta(repo,
                              fill_in_metadata_if_dir(repo, item),
                              include_size=include_size)
+
+
+class DentryCache(object):
+    """Resolve paths like resolve(..., follow=False), but remember the
+    items found inside trees (along with names that don't exist), each
+    keyed by (tree oid, name), and the listing of each tree.  Since
+    trees are immutable, nothing ever needs to be invalidated, so both
+    caches are just bounded (LRU).  The levels above the trees (/,
+    save names, tags, ...) can change, and are always left to
+    resolve().  Looking up a name in a tree that hasn't been listed
+    lists the whole tree, so walking a directory costs one listing,
+    not one per entry.
+
+    The leaf items returned by resolve() always have complete
+    metadata, via ensure_item_has_metadata(..., include_size=True),
+    or augment_item_meta(..., include_size=True) when want_meta is
+    false, and the completed items are cached too.
+
+    Not thread-safe.
+
+    """
+
+    def __init__(self, repo, want_meta=True, max_entries=100000,
+                 max_listings=1000):
+        self._repo = repo
+        self._want_meta = want_meta
+        self._max_entries = max_entries
+        self._max_listings = max_listings
+        # (tree oid, name) -> (item, complete), or None if name doesn't exist
+        self._entries = OrderedDict()
+        # tree oid -> names (including '.')
+        self._listings = OrderedDict()
+
+    @staticmethod
+    def _lru_get(d, key):
+        value = d.pop(key, d)
+        if value is not d:
+            d[key] = value
+        return value
+
+    @staticmethod
+    def _lru_put(d, key, value, limit):
+        d.pop(key, None)
+        d[key] = value
+        while len(d) > limit:
+            d.popitem(last=False)
+
+    def _list_tree(self, tree, name=None):
+        """Cache the contents of tree, and return its names and the entry
+        for name (or None)."""
+        names = []
+        found = None
+        for ent_name, ent_item in contents(self._repo, tree,
+                                           want_meta=self._want_meta):
+            names.append(ent_name)
+            if ent_name == b'.':
+                continue
+            ent = ent_item, False
+            self._lru_put(self._entries, (tree.oid, ent_name), ent,
+                          self._max_entries)
+            if ent_name == name:
+                found = ent
+        names = tuple(names)
+        self._lru_put(self._listings, tree.oid, names, self._max_listings)
+        return names, found
+
+    def _lookup(self, tree, name):
+        key = tree.oid, name
+        ent = self._lru_get(self._entries, key)
+        if ent is self._entries:
+            names = self._lru_get(self._listings, tree.oid)
+            if names is self._listings or name in names:
+                ent = self._list_tree(tree, name)[1]
+            else:
+                ent = None
+            if not ent:
+                self._lru_put(self._entries, key, None, self._max_entries)
+        return ent
+
+    def _complete(self, item):
+        if self._want_meta:
+            return ensure_item_has_metadata(self._repo, item,
+                                            include_size=True)
+        return augment_item_meta(self._repo, item, include_size=True)
+
+    def _resolve(self, path, complete):
+        assert path.startswith(b'/')
+        names = [x for x in path.split(b'/') if x]
+        res = resolve(self._repo, b'/', want_meta=self._want_meta,
+                      follow=False)
+        key = None # The entry key for the leaf, if it's in a tree
+        done = False
+        for i, name in enumerate(names):
+            parent = res[-1][1]
+            key = None
+            done = False
+            if S_ISLNK(item_mode(parent)):
+                res = resolve(self._repo, names[i - 1], parent=res[:-1],
+                              want_meta=self._want_meta)
+                parent = res[-1][1]
+                if not parent:
+                    return res
+            if not S_ISDIR(item_mode(parent)):
+                raise IOError(ENOTDIR,
+                              'path %r ends internally in non-directory here: %r'
+                              % (path, res),
+                              terminus=res)
+            if name in (b'.', b'..'):
+                res = resolve(self._repo, b'/'.join(names[i:]), parent=res,
+                              want_meta=self._want_meta, follow=False)
+                break
+            if type(parent) in real_tree_types:
+                key = parent.oid, name
+                item, done = self._lookup(parent, name) or (None, False)
+                res += ((name, item),)
+            else:
+                res = resolve(self._repo, name, parent=res,
+                              want_meta=self._want_meta, follow=False)
+            if not res[-1][1]:
+                return res
+        name, item = res[-1]
+        if complete and item and not done:
+            item = self._complete(item)
+            res = res[:-1] + ((name, item),)
+            if key:
+                self._lru_put(self._entries, key, (item, True),
+                              self._max_entries)
+        return res
+
+    def resolve(self, path):
+        """Return the resolution of the absolute path, as per
+        resolve(repo, path, follow=False), with complete metadata for
+        the leaf item (if it exists)."""
+        return self._resolve(path, complete=True)
+
+    def names(self, path):
+        """Return the names of the items in the directory at the
+        absolute path, including '.', or None if it doesn't exist, or
+        isn't a directory."""
+        res = self._resolve(path, complete=False)
+        item = res[-1][1]
+        if not item or not S_ISDIR(item_mode(item)):
+            return None
+        if type(item) in real_tree_types:
+            names = self._lru_get(self._listings, item.oid)
+            if names is self._listings:
+                names = self._list_tree(item)[0]
+            return names
+        return [name for name, _ in contents(self._repo, item,
+                                            want_meta=False)]
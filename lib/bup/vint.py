@@ -7,14 +7,19 @@
 
 # Variable length integers are encoded as vints -- see lucene.
 
+# The pack and unpack functions are handled by _helpers whenever
+# possible, and the Python implementations are only used for anything
+# it can't handle, e.g. integers that don't fit in 64 bits.
+
 from __future__ import absolute_import
 from io import BytesIO
 import sys
 
 from bup import compat
+from bup._helpers import vint_pack, vint_unpack, vint_unpack_many
 
 
-def write_vuint(port, x):
+def _write_vuint(port, x):
     write = port.write
     bytes_from_uint = compat.bytes_from_uint
     if x < 0:
@@ -31,6 +36,9 @@ def write_vuint(port, x):
                 write(bytes_from_uint(seven_bits))
                 break
 
+def write_vuint(port, x):
+    port.write(pack('V', x))
+
 
 def read_vuint(port):
     c = port.read(1)
@@ -55,7 +63,7 @@ def read_vuint(port):
     return result
 
 
-def write_vint(port, x):
+def _write_vint(port, x):
     # Sign is handled with the second bit of the first byte.  All else
     # matches vuint.
     write = port.write
@@ -71,10 +79,13 @@ def write_vint(port, x):
         x >>= 6
         if x:
             write(bytes_from_uint(0x80 | sign_and_six_bits))
-            write_vuint(port, x)
+            _write_vuint(port, x)
         else:
             write(bytes_from_uint(sign_and_six_bits))
 
+def write_vint(port, x):
+    port.write(pack('v', x))
+
 
 def read_vint(port):
     c = port.read(1)
@@ -113,10 +124,13 @@ def read_vint(port):
         return result
 
 
-def write_bvec(port, x):
-    write_vuint(port, len(x))
+def _write_bvec(port, x):
+    _write_vuint(port, len(x))
     port.write(x)
 
+def write_bvec(port, x):
+    port.write(pack('s', x))
+
 
 def read_bvec(port):
     n = read_vuint(port)
@@ -126,19 +140,22 @@ def read_bvec(port):
 def skip_bvec(port):
     port.read(read_vuint(port))
 
-def send(port, types, *args):
+def _send(port, types, *args):
     if len(types) != len(args):
         raise Exception('number of arguments does not match format string')
     for (type, value) in zip(types, args):
         if type == 'V':
-            write_vuint(port, value)
+            _write_vuint(port, value)
         elif type == 'v':
-            write_vint(port, value)
+            _write_vint(port, value)
         elif type == 's':
-            write_bvec(port, value)
+            _write_bvec(port, value)
         else:
             raise Exception('unknown xpack format string item "' + type + '"')
 
+def send(port, types, *args):
+    port.write(pack(types, *args))
+
 def recv(port, types):
     result = []
     for type in types:
@@ -153,10 +170,37 @@ def recv(port, types):
     return result
 
 def pack(types, *args):
-    port = BytesIO()
-    send(port, types, *args)
-    return port.getvalue()
+    try:
+        return vint_pack(types, args)
+    except (OverflowError, TypeError):
+        port = BytesIO()
+        _send(port, types, *args)
+        return port.getvalue()
+
+def unpack_from(types, buf, ofs=0):
+    """Decode a record of the given types from buf (any bytes-like
+    object, e.g. a memoryview) at ofs, and return a list of the values
+    and the offset just past the record."""
+    try:
+        return vint_unpack(types, buf, ofs)
+    except OverflowError:
+        port = BytesIO(memoryview(buf)[ofs:].tobytes())
+        return recv(port, types), ofs + port.tell()
+
+def unpack_many(types, buf, n=-1, ofs=0):
+    """Decode n records of the given types (or all of them, if n is
+    negative) from buf starting at ofs, as per unpack_from(), and
+    return a list of the records (as tuples), and the offset just past
+    the last one."""
+    try:
+        return vint_unpack_many(types, buf, n, ofs)
+    except OverflowError:
+        result = []
+        while n and (n > 0 or ofs < len(buf)):
+            rec, ofs = unpack_from(types, buf, ofs)
+            result.append(tuple(rec))
+            n -= 1
+        return result, ofs
 
 def unpack(types, data):
-    port = BytesIO(data)
-    return recv(port, types)
+    return unpack_from(types, data)[0]
@@ -0,0 +1,3 @@
+COMMIT='f1cdd73d388aa0f4030d05f65fb26d28e59b0501'
+NAMES='(tag: f1cdd73)'
+DATE='2026-10-19 01:19:21 +0000'
@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+. ./wvtest-bup.sh || exit $?
+
+set -o pipefail
+
+top="$(WVPASS pwd)" || exit $?
+tmpdir="$(WVPASS wvmktempdir)" || exit $?
+
+bup() { "$top/bup" "$@"; }
+
+WVPASS cd "$tmpdir"
+
+WVSTART "bench --list"
+WVPASS bup bench --list > list
+WVPASSEQ "$(head -n 1 list | cut -d' ' -f1)" split
+WVPASSEQ "$(wc -l < list | tr -d ' ')" 15
+WVFAIL bup bench no-such-benchmark
+
+WVSTART "bench --json"
+small=(-r 2 --size 64k -n 500 --files 5)
+WVPASS bup bench --json "${small[@]}" > run-1.json
+WVPASS bup bench --json "${small[@]}" split save > run-2.json
+WVPASS bup bench --json -S 2 "${small[@]}" save > run-3.json
+WVPASS bup python -c "
+import json
+r1, r2, r3 = [json.load(open('run-%d.json' % i)) for i in (1, 2, 3)]
+names = [l.split()[0] for l in open('list')]
+assert sorted(r1['benchmarks']) == sorted(names), r1['benchmarks'].keys()
+for name, b in r1['benchmarks'].items():
+    assert b['runs'] == 2, name
+    assert b['ops_per_run'] > 0, name
+    lat = b['latency_us']
+    assert lat['min'] <= lat['p50'] <= lat['p90'] <= lat['p99'] <= lat['max']
+# Latency is sampled per batch, or per run for single-operation runs.
+assert r1['benchmarks']['bloom-contains']['latency_samples'] > 2 * 10
+assert r1['benchmarks']['save']['latency_samples'] == 2
+assert sorted(r2['benchmarks']) == ['save', 'split']
+# The workloads are determined by the seed.
+for name in ('split', 'save'):
+    for k in ('ops_per_run', 'bytes_per_run'):
+        assert r1['benchmarks'][name][k] == r2['benchmarks'][name][k]
+assert r1['benchmarks']['save']['bytes_per_run'] \
+    != r3['benchmarks']['save']['bytes_per_run']
+"
+
+WVPASS rm -rf "$tmpdir"
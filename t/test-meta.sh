@@ -184,6 +184,30 @@ WVSTART 'metadata save/restore (general)'
     WVPASS rm -r "$tmpdir"
 ) || exit $?
 
+WVSTART 'metadata save (--meta-threads)'
+(
+    tmpdir="$(WVPASS wvmktempdir)" || exit $?
+    WVPASS cd "$tmpdir"
+    WVPASS mkdir -p src/many src/sub
+    # More files in one directory than save keeps outstanding.
+    for i in $(seq 200); do
+        WVPASS touch src/many/"$i"
+        WVPASS chmod $((600 + i % 7 * 10)) src/many/"$i"
+    done
+    WVPASS echo sub > src/sub/file
+    for threads in 0 2; do
+        export BUP_DIR="$tmpdir/bup-$threads"
+        WVPASS bup init
+        WVPASS bup index src
+        tree="$(WVPASS bup save -t --strip --meta-threads "$threads" \
+                    -n src src)" || exit $?
+        WVPASS git --git-dir "$BUP_DIR" rev-parse "$tree:many" "$tree:sub" \
+            > "trees-$threads"
+    done
+    WVPASSEQ "$(cat trees-2)" "$(cat trees-0)"
+    WVPASS rm -r "$tmpdir"
+) || exit $?
+
 # Test that we pull the index (not filesystem) metadata for any
 # unchanged files whenever we're saving other files in a given
 # directory.
@@ -167,7 +167,8 @@ verify-changes-caused-by-rewriting-save()
 ">fcst\.\.\.[.]*[ ]+logs/refs/heads/src
 \.d\.\.t\.\.\.[.]*[ ]+objects/
 \.d\.\.t\.\.\.[.]*[ ]+objects/pack/
->fcst\.\.\.[.]*[ ]+objects/pack/bup\.bloom
+>fcst\.\.\.[.]*[ ]+objects/pack/bup\.bloom(
+>f[^ ]*[ ]+objects/pack/bup\.manifest)?
 >f\+\+\+\+\+\+\+[+]*[ ]+$new_idx
 >f\+\+\+\+\+\+\+[+]*[ ]+$new_pack
 \.d\.\.t\.\.\.[.]*[ ]+refs/heads/
@@ -93,4 +93,16 @@ WVPASS diff -u "$top/t/testfile2" out2t.tmp
 WVPASS diff -u "$top/t/testfile2" out2c.tmp
 WVPASSEQ "$(bup join split_empty_string.tmp)" ""
 
+WVSTART "split with bup.split.files"
+WVPASS git --git-dir "$BUP_DIR" config bup.split.files fastcdc
+WVPASS bup split -b "$top/t/testfile2" >tags2g.tmp
+WVPASS bup split -r ":$BUP_DIR" -b "$top/t/testfile2" >tags2gr.tmp
+WVPASS diff -u tags2g.tmp tags2gr.tmp
+WVFAIL diff -u tags2.tmp tags2g.tmp
+WVPASS bup join <tags2g.tmp >out2g.tmp
+WVPASS diff -u "$top/t/testfile2" out2g.tmp
+WVPASS git --git-dir "$BUP_DIR" config bup.split.files bogus
+WVFAIL bup split -b "$top/t/testfile2"
+WVPASS git --git-dir "$BUP_DIR" config --unset bup.split.files
+
 WVPASS rm -rf "$tmpdir"
@@ -52,6 +52,8 @@ if test -n "$run_test"; then
     WVPASS bup init
     WVPASS mkdir src
     WVPASS echo '¡excitement!' > src/data
+    WVPASS printf 'abcdefghij' > src/abc
+    WVPASS touch src/empty
     WVPASS bup index src
     WVPASS bup save -n '¡excitement!' --strip src
 
@@ -65,6 +67,30 @@ if test -n "$run_test"; then
              "$(cat "$TOP/lib/web/static/styles.css")"
 
     WVPASSEQ '¡excitement!' "$(cat result)"
+
+    WVSTART 'web ranges and conditional requests'
+    url='http://localhost/%C2%A1excitement%21/latest/abc'
+    WVPASSEQ cde "$(curl -s --unix-socket ./socket -r 2-4 "$url")"
+    WVPASSEQ hij "$(curl -s --unix-socket ./socket -r -3 "$url")"
+    WVPASSEQ defghij "$(curl -s --unix-socket ./socket -r 3- "$url")"
+    WVPASSEQ 206 "$(curl -s -o /dev/null -w '%{http_code}' \
+                      --unix-socket ./socket -r 2-4 "$url")"
+    WVPASSEQ 416 "$(curl -s -o /dev/null -w '%{http_code}' \
+                      --unix-socket ./socket -r 20- "$url")"
+    empty_url='http://localhost/%C2%A1excitement%21/latest/empty'
+    WVPASSEQ 416 "$(curl -s -o /dev/null -w '%{http_code}' \
+                      --unix-socket ./socket -r -3 "$empty_url")"
+    WVPASSEQ 416 "$(curl -s -o /dev/null -w '%{http_code}' \
+                      --unix-socket ./socket -r 0- "$empty_url")"
+    etag="$(curl -s -I --unix-socket ./socket "$url" \
+              | sed -n 's/^etag: *//Ip' | tr -d '\r')" || exit $?
+    WVPASS test -n "$etag"
+    WVPASSEQ 304 "$(curl -s -o /dev/null -w '%{http_code}' \
+                      --unix-socket ./socket -H "If-None-Match: $etag" "$url")"
+    WVPASSEQ cde "$(curl -s --unix-socket ./socket -r 2-4 \
+                      -H "If-Range: $etag" "$url")"
+    WVPASSEQ abcdefghij "$(curl -s --unix-socket ./socket -r 2-4 \
+                             -H 'If-Range: "0000"' "$url")"
     WVPASS kill -s TERM "$web_pid"
     WVPASS wait "$web_pid"
 fi
@@ -37,6 +37,16 @@ WVPASS bup bloom -d "$BUP_DIR"/objects/pack --ruin --force
 WVFAIL bup bloom -c $(ls -1 "$BUP_DIR"/objects/pack/*.idx|head -n1)
 WVPASS bup bloom --force -k 5
 WVPASS bup bloom -c $(ls -1 "$BUP_DIR"/objects/pack/*.idx|head -n1)
+for i in 1 2 3 4 5; do
+    WVPASS bup random --seed=$i 256k | WVPASS bup split -q -n bloom-$i
+done
+WVPASS bup bloom --force -j 3
+WVPASS bup bloom --check-all -j 3
+WVPASS bup bloom --check-all -j 1
+WVPASS bup bloom -d "$BUP_DIR"/objects/pack --ruin
+WVFAIL bup bloom --check-all -j 3
+WVPASS bup bloom --force
+WVPASS bup bloom --check-all
 
 
 WVSTART "memtest"